@@ -0,0 +1,83 @@
+#   Decode FF_ShellyMilight binary telemetry frames (see TELEMETRY_HOST)
+#
+#   Usage: python decodeTelemetry.py [port]
+#
+#   Listens on UDP port (default 5140) and prints a line per received frame. Counters are sent since
+#       module boot, so loop timing and latency histograms are printed as differences with previous
+#       frame of same module (a lost frame only makes next difference cover a longer time).
+#
+#   Frame layout is telemetryFrame in FF_ShellyMilight.example. Change FRAME_VERSION and FRAME_FORMAT
+#       here when TELEMETRY_VERSION changes there.
+
+import socket
+import struct
+import sys
+import time
+
+FRAME_MAGIC = 0x4653
+FRAME_VERSION = 2
+LATENCY_BUCKETS = 24
+HISTOGRAM_NAMES = ['pressToPublish', 'publishToAck', 'pressToRelay']
+FRAME_FORMAT = '<HBBHHIII8i5IIHBb3I' + str(3 * LATENCY_BUCKETS) + 'I'
+FRAME_FIELDS = ['magic', 'version', 'channelCount', 'flags', 'interval', 'chipId', 'sequence', 'uptime',
+    'networkLost', 'mqttLost', 'syncLost', 'pushLost', 'pushCount', 'queueCoalesced', 'predictRollback', 'peerUpdates',
+    'syslogLost', 'syslogTruncated', 'edgeLost', 'radioSent', 'commandTimeout',
+    'freeHeap', 'maxBlock', 'fragmentation', 'rssi',
+    'loopCount', 'loopMicros', 'loopMaxMicros']
+# Frame flags (options compiled in), and fields only meaningful with them
+FLAG_FIELDS = [(0x0001, 'syslogLost'), (0x0002, 'queueCoalesced'), (0x0008, 'edgeLost'), (0x0010, 'radioSent'),
+    (0x0020, 'predictRollback'), (0x0040, 'peerUpdates'), (0x0100, 'syslogTruncated')]
+FLAG_LATENCY = 0x0080
+
+# Decode a frame, returning a dictionary (or None if not a valid frame)
+def decode(data):
+    if len(data) != struct.calcsize(FRAME_FORMAT):
+        return None
+    values = struct.unpack(FRAME_FORMAT, data)
+    frame = dict(zip(FRAME_FIELDS, values))
+    if frame['magic'] != FRAME_MAGIC or frame['version'] != FRAME_VERSION:
+        return None
+    latency = values[len(FRAME_FIELDS):]
+    frame['latency'] = [latency[i * LATENCY_BUCKETS:(i + 1) * LATENCY_BUCKETS] for i in range(3)]
+    return frame
+
+# Format histogram differences as bucket:count (bucket n is 2^(n-1) to 2^n-1 us)
+def histogram(current, previous):
+    counts = [(current[i] - previous[i]) & 0xffffffff for i in range(LATENCY_BUCKETS)]
+    return ' '.join('<'+str(1 << i)+'us:'+str(counts[i]) for i in range(LATENCY_BUCKETS) if counts[i])
+
+port = int(sys.argv[1]) if len(sys.argv) > 1 else 5140
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.bind(('', port))
+print('Listening on UDP port '+str(port))
+lastFrames = {}
+
+while True:
+    data, address = sock.recvfrom(2048)
+    frame = decode(data)
+    if not frame:
+        print(time.strftime('%H:%M:%S')+' '+address[0]+': not a version '+str(FRAME_VERSION)+' frame ('+str(len(data))+' bytes)')
+        continue
+    line = time.strftime('%H:%M:%S')+' '+address[0]+' %06x #%d up %ds' % (frame['chipId'], frame['sequence'], frame['uptime'])
+    line += ' networkLost %d, mqttLost %d, syncLost %d, pushLost %d, pushCount %d' % (frame['networkLost'],
+        frame['mqttLost'], frame['syncLost'], frame['pushLost'], frame['pushCount'])
+    for flag, name in FLAG_FIELDS:
+        if frame['flags'] & flag:
+            line += ', '+name+' '+str(frame[name])
+    line += ', timeout %d, freeHeap %d, maxBlock %d, fragmentation %d%%, rssi %d' % (frame['commandTimeout'],
+        frame['freeHeap'], frame['maxBlock'], frame['fragmentation'], frame['rssi'])
+    previous = lastFrames.get(frame['chipId'])
+    if previous and frame['sequence'] > previous['sequence']:
+        # Same module, not rebooted: give differences
+        if frame['sequence'] != previous['sequence'] + 1:
+            line += ', '+str(frame['sequence'] - previous['sequence'] - 1)+' frame(s) lost'
+        loops = (frame['loopCount'] - previous['loopCount']) & 0xffffffff
+        micros = (frame['loopMicros'] - previous['loopMicros']) & 0xffffffff
+        line += ', %d loops, mean %.1f us, max %d us' % (loops, micros / max(loops, 1), frame['loopMaxMicros'])
+        if frame['flags'] & FLAG_LATENCY:
+            for i in range(3):
+                counts = histogram(frame['latency'][i], previous['latency'][i])
+                if counts:
+                    line += '\n    '+HISTOGRAM_NAMES[i]+' '+counts
+    lastFrames[frame['chipId']] = frame
+    print(line, flush=True)
@@ -62,7 +62,9 @@
 class Debouncer
 {
  // Note : this is private as it migh change in the futur
-private:
+// *** FF_CHANGE *** (protected to let EdgeBounce debounce queued edges)
+protected:
+// *** FF_CHANGE ***
   static const uint8_t DEBOUNCED_STATE = 0b00000001; // Final returned calculated debounced state
   static const uint8_t UNSTABLE_STATE  = 0b00000010; // Actual last state value behind the scene
   static const uint8_t CHANGED_STATE   = 0b00000100; // The DEBOUNCED_STATE has changed since last update()
@@ -70,6 +72,9 @@ private:
 // Note : this is private as it migh change in the futur
 private:
   inline void changeState();
+// *** FF_CHANGE ***
+protected:
+// *** FF_CHANGE ***
   inline void setStateFlag(const uint8_t flag)       {state |= flag;}
   inline void unsetStateFlag(const uint8_t flag)     {state &= ~flag;}
   inline void toggleStateFlag(const uint8_t flag)    {state ^= flag;}
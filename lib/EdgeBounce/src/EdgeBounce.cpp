@@ -0,0 +1,166 @@
+/*
+  EdgeBounce.cpp - Interrupt driven Bounce2 debouncer.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#include "EdgeBounce.h"
+
+#if (EDGE_BOUNCE_QUEUE_SIZE & (EDGE_BOUNCE_QUEUE_SIZE - 1)) || (EDGE_BOUNCE_QUEUE_SIZE > 128)
+#error "EDGE_BOUNCE_QUEUE_SIZE should be a power of 2, up to 128"
+#endif
+
+#define EDGE_BOUNCE_MASK (EDGE_BOUNCE_QUEUE_SIZE - 1)
+
+// Queued edge: level bit and time bits
+#define EDGE_BOUNCE_LEVEL 0x8000
+#define EDGE_BOUNCE_TIME 0x7fff
+
+// GPIO pin interrupt types (as SDK GPIO_PIN_INTR_xxx)
+#define EDGE_BOUNCE_INTR_ANYEDGE 3
+#define EDGE_BOUNCE_INTR_LOLEVEL 4
+#define EDGE_BOUNCE_INTR_HILEVEL 5
+
+EdgeBounce::EdgeBounce() : Bounce() {
+    this->head = 0;
+    this->tail = 0;
+    this->lostEdges = 0;
+    this->attached = false;
+    this->wakeArmed = false;
+}
+
+EdgeBounce::~EdgeBounce() {
+    detach();
+}
+
+void EdgeBounce::attach(int pin, int mode) {
+    setPinMode(pin, mode);
+    this->attach(pin);
+}
+
+void EdgeBounce::attach(int pin) {
+    detach();
+    Bounce::attach(pin);
+    this->head = 0;
+    this->tail = 0;
+    this->attached = true;
+    attachInterruptArg(digitalPinToInterrupt(pin), handleInterrupt, this, CHANGE);
+}
+
+void EdgeBounce::detach() {
+    if (this->attached) {
+        detachInterrupt(digitalPinToInterrupt(this->pin));
+        this->attached = false;
+    }
+}
+
+// Called on each pin change: queue edge level and time
+void IRAM_ATTR EdgeBounce::handleInterrupt(void* arg) {
+    EdgeBounce* self = (EdgeBounce*) arg;
+    if (self->wakeArmed) {
+        // Pin woke module up, go back to edge interrupt (level one would fire again and again)
+        self->wakeArmed = false;
+        restoreEdgeInterrupt(self->pin);
+    }
+    uint8_t head = self->head;
+    uint8_t next = (head + 1) & EDGE_BOUNCE_MASK;
+    if (next == self->tail) {
+        // Queue full, update() will resync on pin level
+        self->lostEdges++;
+        return;
+    }
+    self->queue[head] = (millis() & EDGE_BOUNCE_TIME) | (digitalRead(self->pin) ? EDGE_BOUNCE_LEVEL : 0);
+    // Publish edge only once fully written
+    self->head = next;
+}
+
+// Get time (ms) of a queued edge, from its low bits (edge being less than 32 s old)
+unsigned long EdgeBounce::edgeTime(uint16_t edge) {
+    unsigned long now = millis();
+    return now - ((now - edge) & EDGE_BOUNCE_TIME);
+}
+
+// Change debounced state, as if it occurred at given time
+void EdgeBounce::changeStateAt(unsigned long time) {
+    toggleStateFlag(DEBOUNCED_STATE);
+    setStateFlag(CHANGED_STATE);
+    durationOfPreviousState = time - stateChangeLastTime;
+    stateChangeLastTime = time;
+}
+
+bool EdgeBounce::update() {
+    unsetStateFlag(CHANGED_STATE);
+    unsigned long now = millis();
+
+    for (;;) {
+        bool hasEdge = (this->tail != this->head);
+        // Level is stable until next edge (or now if none)
+        unsigned long stableUntil = hasEdge ? edgeTime(this->queue[this->tail]) : now;
+        if (getStateFlag(UNSTABLE_STATE) != getStateFlag(DEBOUNCED_STATE)
+                && (stableUntil - previous_millis) >= interval_millis) {
+            // Level has been stable long enough, report change (remaining edges are kept for next call)
+            changeStateAt(previous_millis + interval_millis);
+            return true;
+        }
+        if (!hasEdge) {
+            break;
+        }
+        // Consume edge
+        uint8_t tail = this->tail;
+        bool level = this->queue[tail] & EDGE_BOUNCE_LEVEL;
+        if (level != getStateFlag(UNSTABLE_STATE)) {
+            toggleStateFlag(UNSTABLE_STATE);
+            previous_millis = edgeTime(this->queue[tail]);
+        }
+        this->tail = (tail + 1) & EDGE_BOUNCE_MASK;
+    }
+
+    // Resync if an edge has been missed (queue full)
+    if (readCurrentState() != getStateFlag(UNSTABLE_STATE)) {
+        toggleStateFlag(UNSTABLE_STATE);
+        previous_millis = now;
+    }
+    return false;
+}
+
+unsigned long EdgeBounce::lostCount() {
+    return this->lostEdges;
+}
+
+bool EdgeBounce::edgesQueued() {
+    return this->tail != this->head;
+}
+
+bool EdgeBounce::debounceTime(unsigned long &time) {
+    if (getStateFlag(UNSTABLE_STATE) == getStateFlag(DEBOUNCED_STATE)) {
+        return false;
+    }
+    time = previous_millis + interval_millis;
+    return true;
+}
+
+// Set pin interrupt to level opposite to current one, with wake up enabled (as SDK gpio_pin_wakeup_enable, but for this pin only)
+void EdgeBounce::wakeOnChange() {
+    if (!this->attached || this->wakeArmed) {
+        return;
+    }
+    uint8_t type = digitalRead(this->pin) ? EDGE_BOUNCE_INTR_LOLEVEL : EDGE_BOUNCE_INTR_HILEVEL;
+    noInterrupts();
+    this->wakeArmed = true;
+    GPC(this->pin) = (GPC(this->pin) & ~(0xF << GPCI)) | (type << GPCI) | (1 << GPCWE);
+    interrupts();
+}
+
+void EdgeBounce::awake() {
+    noInterrupts();
+    if (this->wakeArmed) {
+        this->wakeArmed = false;
+        restoreEdgeInterrupt(this->pin);
+    }
+    interrupts();
+}
+
+// Disable wake up and set pin interrupt back to any edge (as attachInterrupt CHANGE)
+void IRAM_ATTR EdgeBounce::restoreEdgeInterrupt(uint8_t pin) {
+    GPC(pin) = (GPC(pin) & ~((0xF << GPCI) | (1 << GPCWE))) | (EDGE_BOUNCE_INTR_ANYEDGE << GPCI);
+}
@@ -0,0 +1,66 @@
+/*
+  EdgeBounce.h - Interrupt driven Bounce2 debouncer.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Pin edges are captured by an interrupt, with their time, into a small lock free
+  single producer (ISR)/single consumer (loop) queue. update() then debounces these
+  queued edges at their own time, so a slow loop() neither loses nor delays changes.
+  Each edge takes 2 bytes (level and low bits of its time), so edges should be read by
+  update() less than 32 seconds after they occurred (older ones would get a wrong time).
+
+  Each instance gets its own interrupt (using attachInterruptArg), so several buttons
+  can be debounced at the same time.
+
+  To let module sleep between loops, debounceTime() gives when a pending change will be
+  reported. As edge interrupts don't run in light sleep, wakeOnChange() arms a level wake
+  up on the pin before sleeping, awake() restoring edge interrupt once back.
+*/
+
+#ifndef EdgeBounce_h
+#define EdgeBounce_h
+
+#include <Arduino.h>
+#include <Bounce2.h>
+
+// EDGE_BOUNCE_QUEUE_SIZE : number of queued edges (power of 2, 2 bytes each)
+#ifndef EDGE_BOUNCE_QUEUE_SIZE
+#define EDGE_BOUNCE_QUEUE_SIZE 32
+#endif
+
+class EdgeBounce : public Bounce {
+private:
+   // Edge: pin level after edge (EDGE_BOUNCE_LEVEL bit), and low bits of millis() when it occurred
+   uint16_t queue[EDGE_BOUNCE_QUEUE_SIZE];
+   volatile uint8_t head;                                   // Written by ISR only
+   volatile uint8_t tail;                                   // Written by update() only
+   volatile unsigned long lostEdges;                        // Edges lost because queue was full
+   bool attached;                                           // Interrupt attached flag
+   volatile bool wakeArmed;                                 // Pin is set to wake module up from light sleep
+   static void IRAM_ATTR restoreEdgeInterrupt(uint8_t pin);
+   static void IRAM_ATTR handleInterrupt(void* arg);
+   void changeStateAt(unsigned long time);
+   static unsigned long edgeTime(uint16_t edge);
+public:
+   EdgeBounce();
+   ~EdgeBounce();
+   // Attach to a pin, set its mode and start capturing its edges
+   void attach(int pin, int mode);
+   void attach(int pin);
+   // Stop capturing edges
+   void detach();
+   // Debounce queued edges. Returns true if debounced state changed (at most one change per call)
+   bool update();
+   // Count of edges lost because queue was full
+   unsigned long lostCount();
+   // Are there edges waiting for update()?
+   bool edgesQueued();
+   // Get time (ms) when pending level change will be reported by update(). Returns false if none
+   bool debounceTime(unsigned long &time);
+   // Wake module up from light sleep on next pin change
+   void wakeOnChange();
+   // Back from light sleep, restore edge interrupt (if pin didn't change)
+   void awake();
+};
+
+#endif
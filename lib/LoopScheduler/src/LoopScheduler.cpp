@@ -0,0 +1,119 @@
+/*
+  LoopScheduler.cpp - Run periodic and one shot tasks from loop(), at their deadline.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#include "LoopScheduler.h"
+
+LoopScheduler::LoopScheduler(Task* tasks, uint8_t count) {
+    this->tasks = tasks;
+    this->count = count;
+    memset(tasks, 0, count * sizeof(Task));
+    this->nextDue = 0;
+    this->nextValid = false;
+    this->nextDirty = false;
+}
+
+void LoopScheduler::set(uint8_t task, TaskFunction function, unsigned long period) {
+    this->tasks[task].function = function;
+    this->tasks[task].period = period;
+    if (period) {
+        runIn(task, period);
+    }
+}
+
+void LoopScheduler::runAt(uint8_t task, unsigned long time) {
+    Task &slot = this->tasks[task];
+    // Moving earliest task later needs a new scan
+    if (slot.scheduled && before(slot.due, time)) {
+        this->nextDirty = true;
+    }
+    slot.due = time;
+    slot.scheduled = true;
+    if (!this->nextValid || before(time, this->nextDue)) {
+        this->nextDue = time;
+        this->nextValid = true;
+    }
+}
+
+void LoopScheduler::runIn(uint8_t task, unsigned long delay) {
+    runAt(task, millis() + delay);
+}
+
+void LoopScheduler::cancel(uint8_t task) {
+    if (this->tasks[task].scheduled) {
+        this->tasks[task].scheduled = false;
+        this->nextDirty = true;
+    }
+}
+
+bool LoopScheduler::scheduled(uint8_t task) {
+    return this->tasks[task].scheduled;
+}
+
+uint8_t LoopScheduler::run() {
+    if (this->nextDirty) {
+        updateNext();
+    }
+    unsigned long now = millis();
+    if (!this->nextValid || before(now, this->nextDue)) {
+        return 0;
+    }
+    uint8_t ran = 0;
+    for (uint8_t i = 0; i < this->count; i++) {
+        Task &slot = this->tasks[i];
+        if (!slot.scheduled || before(now, slot.due)) {
+            continue;
+        }
+        if (slot.period) {
+            // Keep period, unless more than one has been missed
+            slot.due += slot.period;
+            if (!before(now, slot.due)) {
+                slot.due = now + slot.period;
+            }
+        } else {
+            slot.scheduled = false;
+        }
+        if (slot.function) {
+            slot.function(i);
+            ran++;
+        }
+    }
+    // Tasks may have been rescheduled by the ones that ran
+    updateNext();
+    return ran;
+}
+
+unsigned long LoopScheduler::nextDelay(unsigned long maxDelay) {
+    if (this->nextDirty) {
+        updateNext();
+    }
+    if (!this->nextValid) {
+        return maxDelay;
+    }
+    unsigned long now = millis();
+    if (!before(now, this->nextDue)) {
+        return 0;
+    }
+    unsigned long delay = this->nextDue - now;
+    return delay < maxDelay ? delay : maxDelay;
+}
+
+// Scan slots for earliest deadline
+void LoopScheduler::updateNext() {
+    this->nextValid = false;
+    for (uint8_t i = 0; i < this->count; i++) {
+        Task &slot = this->tasks[i];
+        if (slot.scheduled && (!this->nextValid || before(slot.due, this->nextDue))) {
+            this->nextDue = slot.due;
+            this->nextValid = true;
+        }
+    }
+    this->nextDirty = false;
+}
+
+// Is time before reference (millis() wrap around safe)?
+bool LoopScheduler::before(unsigned long time, unsigned long reference) {
+    return (long) (time - reference) < 0;
+}
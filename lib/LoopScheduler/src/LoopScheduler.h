@@ -0,0 +1,58 @@
+/*
+  LoopScheduler.h - Run periodic and one shot tasks from loop(), at their deadline.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Tasks are kept in an array of slots given by caller (usually indexed by an enum), so
+  nothing is allocated at run time, and a task is (re)scheduled or cancelled by writing
+  its slot. run() calls due tasks, nextDelay() gives time before the next one (to sleep).
+
+  With a few slots, caching the earliest deadline is cheaper than a heap or a timer wheel:
+  run() only compares it to millis() until a task is due, slots being scanned only when
+  one is due or when a task is moved later or cancelled.
+*/
+
+#ifndef LoopScheduler_h
+#define LoopScheduler_h
+
+#include <Arduino.h>
+
+class LoopScheduler {
+public:
+   // Task function, called with its slot
+   typedef void (*TaskFunction)(uint8_t task);
+
+   struct Task {
+      TaskFunction function;                                // Function to call
+      unsigned long period;                                 // Period (ms), 0 for one shot task
+      unsigned long due;                                    // Next run time (ms)
+      bool scheduled;                                       // Task will run at due time
+   };
+
+   // Use given slots (should stay allocated)
+   LoopScheduler(Task* tasks, uint8_t count);
+   // Set task function and period (0 for one shot task). Periodic tasks are scheduled one period from now
+   void set(uint8_t task, TaskFunction function, unsigned long period = 0);
+   // (Re)schedule task at given time (ms), or after given delay (ms). Periodic tasks then go on from there
+   void runAt(uint8_t task, unsigned long time);
+   void runIn(uint8_t task, unsigned long delay);
+   // Don't run task (until rescheduled)
+   void cancel(uint8_t task);
+   // Is task scheduled?
+   bool scheduled(uint8_t task);
+   // Run due tasks (each one at most once, one shot tasks being unscheduled before being called). Returns count of tasks run
+   uint8_t run();
+   // Time (ms) before next task, up to maxDelay (0 if a task is due)
+   unsigned long nextDelay(unsigned long maxDelay);
+
+private:
+   Task* tasks;
+   uint8_t count;
+   unsigned long nextDue;                                   // Earliest deadline (if nextValid and not nextDirty)
+   bool nextValid;                                          // A task is scheduled
+   bool nextDirty;                                          // Earliest deadline should be computed again
+   void updateNext();
+   static bool before(unsigned long time, unsigned long reference);
+};
+
+#endif
@@ -0,0 +1,162 @@
+/*
+  MilightRadio.cpp - Send Milight RGB+CCT on/off packets with a local LT8900 radio.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#include "MilightRadio.h"
+#include <SPI.h>
+
+// LT8900 registers
+#define LT8900_CHANNEL 7                                    // TX/RX enable and channel
+#define LT8900_SYNCWORD_0 36                                // Syncword, low word
+#define LT8900_SYNCWORD_3 39                                // Syncword, high word (32 bits syncword)
+#define LT8900_STATUS 48                                    // Status (bit 6 is packet sent)
+#define LT8900_FIFO 50                                      // FIFO data (8 bits)
+#define LT8900_FIFO_CONTROL 52                              // FIFO pointers
+#define LT8900_TX_ENABLE 0x0100
+#define LT8900_PACKET_FLAG 0x0040
+
+// RGB+CCT syncword and channels (as milight hub)
+#define MILIGHT_SYNCWORD_0 0x7236
+#define MILIGHT_SYNCWORD_3 0x1809
+static const uint8_t milightChannels[] = {8, 39, 70};
+
+// Maximum time to wait for a packet to be sent (us)
+#define LT8900_SEND_TIMEOUT 1000
+
+// Initial registers values (datasheet recommended values, with 3 bytes preamble, 32 bits syncword, CRC and length byte)
+static const struct {
+    uint8_t reg;
+    uint16_t value;
+} lt8900Init[] = {
+    {0, 0x6fe0}, {1, 0x5681}, {2, 0x6617}, {4, 0x9cc9}, {5, 0x6637}, {7, 0x0000}, {8, 0x6c90}, {9, 0x1840},
+    {10, 0x7ffd}, {11, 0x0008}, {12, 0x0000}, {13, 0x48bd}, {22, 0x00ff}, {23, 0x8005}, {24, 0x0067}, {25, 0x1659},
+    {26, 0x19e0}, {27, 0x1300}, {28, 0x1800}, {32, 0x4800}, {33, 0x3fc7}, {34, 0x2000}, {35, 0x0300},
+    {LT8900_SYNCWORD_0, MILIGHT_SYNCWORD_0}, {37, 0x0000}, {38, 0x0000}, {LT8900_SYNCWORD_3, MILIGHT_SYNCWORD_3},
+    {40, 0x4401}, {41, 0xb000}, {42, 0xfdb0}, {43, 0x000f}
+};
+
+MilightRadio::MilightRadio() {
+    this->csPin = 0;
+    this->repeats = 0;
+    this->sequence = 0;
+    this->transmissions = 0;
+    this->transmitStart = 0;
+    this->found = false;
+    this->sent = 0;
+}
+
+bool MilightRadio::begin(uint8_t csPin, uint8_t resetPin, uint8_t repeats) {
+    this->csPin = csPin;
+    this->repeats = repeats;
+    digitalWrite(csPin, HIGH);
+    pinMode(csPin, OUTPUT);
+    SPI.begin();
+    // Reset radio
+    digitalWrite(resetPin, LOW);
+    pinMode(resetPin, OUTPUT);
+    delayMicroseconds(100);
+    digitalWrite(resetPin, HIGH);
+    delay(5);
+    for (uint8_t i = 0; i < sizeof(lt8900Init) / sizeof(lt8900Init[0]); i++) {
+        writeRegister(lt8900Init[i].reg, lt8900Init[i].value);
+    }
+    // Radio is there if syncword can be read back
+    this->found = (readRegister(LT8900_SYNCWORD_0) == MILIGHT_SYNCWORD_0);
+    return this->found;
+}
+
+bool MilightRadio::send(const Packet &packet) {
+    if (!this->found) {
+        return false;
+    }
+    // Encode sequence and checksum, other bytes are already encoded
+    memcpy(this->data, packet.data, sizeof(this->data));
+    uint8_t sequence = this->sequence++;
+    this->data[6] = encodeByte(sequence, 0, 6);
+    this->data[MILIGHT_PACKET_LENGTH - 1] = encodeByte(packet.sum + sequence, 2, MILIGHT_PACKET_LENGTH - 1);
+    // Send it repeats times on each channel, starting with first one
+    this->transmissions = sizeof(milightChannels) * this->repeats;
+    if (this->transmissions) {
+        transmit();
+    }
+    return true;
+}
+
+bool MilightRadio::update() {
+    if (!this->transmissions) {
+        return true;
+    }
+    if (!(readRegister(LT8900_STATUS) & LT8900_PACKET_FLAG)) {
+        if ((micros() - this->transmitStart) > LT8900_SEND_TIMEOUT) {
+            // Radio stopped answering
+            writeRegister(LT8900_CHANNEL, 0);
+            this->transmissions = 0;
+            return false;
+        }
+        // Still sending
+        return true;
+    }
+    if (--this->transmissions) {
+        transmit();
+    } else {
+        // All transmissions done
+        writeRegister(LT8900_CHANNEL, 0);
+        this->sent++;
+    }
+    return true;
+}
+
+bool MilightRadio::busy() {
+    return this->transmissions != 0;
+}
+
+unsigned long MilightRadio::sentCount() {
+    return this->sent;
+}
+
+void MilightRadio::writeRegister(uint8_t reg, uint16_t value) {
+    SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE1));
+    digitalWrite(this->csPin, LOW);
+    SPI.transfer(reg & 0x7f);
+    SPI.transfer(value >> 8);
+    SPI.transfer(value & 0xff);
+    digitalWrite(this->csPin, HIGH);
+    SPI.endTransaction();
+}
+
+uint16_t MilightRadio::readRegister(uint8_t reg) {
+    SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE1));
+    digitalWrite(this->csPin, LOW);
+    SPI.transfer(reg | 0x80);
+    uint16_t value = SPI.transfer(0) << 8;
+    value |= SPI.transfer(0);
+    digitalWrite(this->csPin, HIGH);
+    SPI.endTransaction();
+    return value;
+}
+
+// Start next transmission of packet (channels in order, repeats times each)
+void MilightRadio::transmit() {
+    uint8_t channel = (sizeof(milightChannels) * this->repeats - this->transmissions) / this->repeats;
+    // Stop radio, clear FIFO, fill it with packet, then send it
+    writeRegister(LT8900_CHANNEL, 0);
+    writeRegister(LT8900_FIFO_CONTROL, 0x8080);
+    writeFifo(this->data, sizeof(this->data));
+    writeRegister(LT8900_CHANNEL, LT8900_TX_ENABLE | milightChannels[channel]);
+    this->transmitStart = micros();
+}
+
+// Write packet in FIFO, preceded by its length
+void MilightRadio::writeFifo(const uint8_t* data, uint8_t length) {
+    SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE1));
+    digitalWrite(this->csPin, LOW);
+    SPI.transfer(LT8900_FIFO);
+    SPI.transfer(length);
+    for (uint8_t i = 0; i < length; i++) {
+        SPI.transfer(data[i]);
+    }
+    digitalWrite(this->csPin, HIGH);
+    SPI.endTransaction();
+}
@@ -0,0 +1,143 @@
+/*
+  MilightRadio.h - Send Milight RGB+CCT on/off packets with a local LT8900 radio.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  LT8900 (the PL1167 compatible chip used by Milight remotes) handles preamble, syncword,
+  length and CRC by itself, so a packet only has to be written to its FIFO, then sent on
+  the 3 RGB+CCT channels, a few times each (bulb ignores repeats with the same sequence).
+  send() only starts the first transmission: update() then checks (without waiting) if it
+  is over and starts the next one, so a packet is sent without blocking loop().
+
+  Packets are encoded as milight hub does for RGB+CCT (V2) remotes. All of it but sequence
+  and checksum only depends on bulb id, so encode() is constexpr: given a constant hub id
+  ("0x1234/rgb_cct/1"), packets are computed at compile time, only leaving two bytes to
+  encode at send time.
+
+  LT8900 is wired on hardware SPI (SCK, MISO, MOSI) plus a chip select and a reset pin.
+*/
+
+#ifndef MilightRadio_h
+#define MilightRadio_h
+
+#include <Arduino.h>
+
+#define MILIGHT_PACKET_LENGTH 9
+
+class MilightRadio {
+public:
+   // Packet of a bulb command, encoded but sequence and checksum
+   struct Packet {
+      uint8_t data[MILIGHT_PACKET_LENGTH];                  // Packet bytes (sequence and checksum encoded at send time)
+      uint8_t sum;                                          // Sum of clear bytes, but sequence (for checksum)
+      bool valid;                                           // Bulb id is a valid rgb_cct one
+   };
+
+   // Encode on or off packet of a bulb, given by its hub id ("0x<16 bits device id>/rgb_cct/<group 1 to 8>")
+   static constexpr Packet encode(const char* bulbId, bool on) {
+      Packet packet = {};
+      // Parse device id
+      uint16_t deviceId = 0;
+      const char* c = bulbId;
+      if (c[0] != '0' || (c[1] != 'x' && c[1] != 'X')) {
+         return packet;
+      }
+      c += 2;
+      while (*c && *c != '/') {
+         int8_t digit = hexDigit(*c++);
+         if (digit < 0 || deviceId > 0x0fff) {
+            return packet;
+         }
+         deviceId = (deviceId << 4) | digit;
+      }
+      // Check remote type
+      const char* type = "/rgb_cct/";
+      while (*type) {
+         if (*c++ != *type++) {
+            return packet;
+         }
+      }
+      // Parse group (group 0, all bulbs of remote, uses other arguments and isn't a bulb id)
+      if (*c < '1' || *c > '8' || c[1]) {
+         return packet;
+      }
+      uint8_t group = *c - '0';
+      // Clear packet
+      uint8_t clear[MILIGHT_PACKET_LENGTH] = {
+         PACKET_KEY,                                        // Key
+         0x20,                                              // RGB+CCT remote
+         (uint8_t) (deviceId >> 8),                         // Device id
+         (uint8_t) (deviceId & 0xff),
+         0x01,                                              // On/off command
+         (uint8_t) (group + (on ? 0 : 5)),                  // On group n is n, off is n + 5
+         0,                                                 // Sequence (set at send time)
+         group,                                             // Group
+         0                                                  // Checksum (computed at send time)
+      };
+      // Encode it, but sequence and checksum
+      packet.data[0] = clear[0];
+      packet.sum = clear[0];
+      for (uint8_t i = 1; i < MILIGHT_PACKET_LENGTH - 1; i++) {
+         packet.sum += clear[i];
+         packet.data[i] = encodeByte(clear[i], 0, i);
+      }
+      packet.valid = true;
+      return packet;
+   }
+
+   MilightRadio();
+   // Reset radio and configure it for RGB+CCT. Returns true if radio answers
+   bool begin(uint8_t csPin, uint8_t resetPin, uint8_t repeats);
+   // Start sending a packet with next sequence (replacing the one being sent). Returns false if radio not found
+   bool send(const Packet &packet);
+   // Go on sending packet (call it at each loop while busy()). Returns false if radio stopped answering
+   bool update();
+   // Packet is being sent
+   bool busy();
+   // Count of packets sent
+   unsigned long sentCount();
+
+private:
+   static constexpr uint8_t PACKET_KEY = 0x00;              // Packet key (sent in clear, selects encoding offsets)
+   static constexpr uint8_t OFFSET_JUMP_START = 0x54;       // Keys from here add 0x80 to offsets
+   static constexpr int8_t hexDigit(char c) {
+      return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+   }
+   // XOR key derived from packet key
+   static constexpr uint8_t xorKey(uint8_t key) {
+      return (uint8_t) ((((4 + ((((key & 0xf0) >> 4) + ((key & 0x0f) < 0x04 ? 0 : 1) + 6) % 8)) ^ 1) & 0x0f) << 4)
+         | (uint8_t) ((((key & 0x0f) + 4) ^ 2) & 0x0f);
+   }
+   // Offset added to byte at index (1 to 8) once XORed
+   static constexpr uint8_t offset(uint8_t index, uint8_t key, uint8_t jumpStart) {
+      constexpr uint8_t offsets[8][4] = {
+         {0x45, 0x1f, 0x14, 0x5c},                          // Remote type
+         {0x2b, 0xc9, 0xe3, 0x11},                          // Device id (high)
+         {0x6d, 0x5f, 0x8a, 0x2b},                          // Device id (low)
+         {0xaf, 0x03, 0x1d, 0xf3},                          // Command
+         {0x1a, 0xe2, 0xf0, 0xd1},                          // Argument
+         {0x04, 0xd8, 0x71, 0x42},                          // Sequence
+         {0xaf, 0x04, 0xdd, 0x07},                          // Group
+         {0x61, 0x13, 0x38, 0x64}                           // Checksum
+      };
+      return offsets[index - 1][key % 4] + ((jumpStart && key >= jumpStart && key < jumpStart + 0x80) ? 0x80 : 0);
+   }
+   static constexpr uint8_t encodeByte(uint8_t value, uint8_t shift, uint8_t index) {
+      return (uint8_t) (((uint8_t) (value + shift) ^ xorKey(PACKET_KEY))
+         + offset(index, PACKET_KEY, index == MILIGHT_PACKET_LENGTH - 1 ? 0 : OFFSET_JUMP_START));
+   }
+   uint8_t csPin;
+   uint8_t repeats;                                         // Sends of packet on each channel
+   uint8_t sequence;                                        // Sequence of next packet
+   uint8_t data[MILIGHT_PACKET_LENGTH];                     // Packet being sent
+   uint8_t transmissions;                                   // Transmissions of packet left
+   unsigned long transmitStart;                             // micros() when last transmission started
+   bool found;                                              // Radio answered at begin
+   unsigned long sent;
+   void writeRegister(uint8_t reg, uint16_t value);
+   uint16_t readRegister(uint8_t reg);
+   void writeFifo(const uint8_t* data, uint8_t length);
+   void transmit();
+};
+
+#endif
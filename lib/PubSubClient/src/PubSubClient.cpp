@@ -29,6 +29,21 @@ PubSubClient::PubSubClient(Client& client) {
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
 
+// *** FF_CHANGE ***
+PubSubClient::PubSubClient(Client& client, uint8_t* txBuffer, uint8_t* rxBuffer, uint16_t size) {
+    this->_state = MQTT_DISCONNECTED;
+    setClient(client);
+    this->stream = NULL;
+    this->buffer = txBuffer;
+    this->rxBuffer = rxBuffer;
+    this->bufferSize = size;
+    this->staticBuffers = true;
+    resetParser();
+    setKeepAlive(MQTT_KEEPALIVE);
+    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+}
+// *** FF_CHANGE ***
+
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client) {
     this->_state = MQTT_DISCONNECTED;
     setServer(addr, port);
@@ -159,7 +174,15 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
 }
 
 PubSubClient::~PubSubClient() {
-  free(this->buffer);
+  // *** FF_CHANGE ***
+  if (!this->staticBuffers) {
+    free(this->buffer);
+    free(this->rxBuffer);
+  }
+  if (!this->staticBatch) {
+    free(this->batchBuffer);
+  }
+  // *** FF_CHANGE ***
 }
 
 boolean PubSubClient::connect(const char *id) {
@@ -180,109 +203,222 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 
 boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
     if (!connected()) {
-        int result = 0;
+        // *** FF_CHANGE ***
+        if (!sendConnect(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession)) {
+            return false;
+        }
+
+        while (!_client->available()) {
+            unsigned long t = millis();
+            if (t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
+                _state = MQTT_CONNECTION_TIMEOUT;
+                _client->stop();
+                return false;
+            }
+        }
+        return readConnack();
+        // *** FF_CHANGE ***
+    }
+    return true;
+}
+
+// *** FF_CHANGE ***
+boolean PubSubClient::beginConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    if (connected()) {
+        return true;
+    }
+    if (!sendConnect(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession)) {
+        return false;
+    }
+    _state = MQTT_CONNECTING;
+    return true;
+}
+
+boolean PubSubClient::connecting() {
+    return _state == MQTT_CONNECTING;
+}
+
+unsigned long PubSubClient::keepAliveDelay() {
+    if (_state != MQTT_CONNECTED) {
+        return 0;
+    }
+    unsigned long t = millis();
+    unsigned long idle = t - lastInActivity;
+    if (t - lastOutActivity > idle) {
+        idle = t - lastOutActivity;
+    }
+    // loop() acts once idle time is over keep alive
+    if (idle > this->keepAlive*1000UL) {
+        return 0;
+    }
+    return this->keepAlive*1000UL - idle + 1;
+}
 
+boolean PubSubClient::setBatchSize(uint16_t size) {
+    if (this->staticBatch) {
+        return false;
+    }
+    flushBatch();
+    free(this->batchBuffer);
+    this->batchBuffer = NULL;
+    this->batchSize = 0;
+    if (size) {
+        this->batchBuffer = (uint8_t*)malloc(size);
+        if (this->batchBuffer == NULL) {
+            return false;
+        }
+        this->batchSize = size;
+    }
+    return true;
+}
 
-        if(_client->connected()) {
-            result = 1;
+void PubSubClient::setBatchBuffer(uint8_t* storage, uint16_t size) {
+    flushBatch();
+    if (!this->staticBatch) {
+        free(this->batchBuffer);
+    }
+    this->batchBuffer = storage;
+    this->batchSize = size;
+    this->staticBatch = true;
+}
+
+boolean PubSubClient::flushBatch() {
+    if (this->batchLength == 0) {
+        return true;
+    }
+    uint16_t rc = _client->write(this->batchBuffer,this->batchLength);
+    boolean result = (rc == this->batchLength);
+    this->batchLength = 0;
+    lastOutActivity = millis();
+    return result;
+}
+
+boolean PubSubClient::batchPacket(const uint8_t* buf, uint16_t length) {
+    // Only batch while connected (CONNECT has to be sent immediately)
+    if (this->batchSize == 0 || _state != MQTT_CONNECTED) {
+        return false;
+    }
+    if (this->batchLength + length > this->batchSize) {
+        // Send what's batched, then batch this packet if it fits
+        flushBatch();
+        if (length > this->batchSize) {
+            return false;
+        }
+    }
+    memcpy(this->batchBuffer+this->batchLength,buf,length);
+    this->batchLength += length;
+    return true;
+}
+
+boolean PubSubClient::writePacket(const uint8_t* buf, uint16_t length) {
+    if (batchPacket(buf,length)) {
+        return true;
+    }
+    return (_client->write(buf,length) == length);
+}
+
+boolean PubSubClient::sendConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    int result = 0;
+
+
+    if(_client->connected()) {
+        result = 1;
+    } else {
+        if (domain != NULL) {
+            result = _client->connect(this->domain, this->port);
         } else {
-            if (domain != NULL) {
-                result = _client->connect(this->domain, this->port);
-            } else {
-                result = _client->connect(this->ip, this->port);
-            }
+            result = _client->connect(this->ip, this->port);
         }
+    }
 
-        if (result == 1) {
-            nextMsgId = 1;
-            // Leave room in the buffer for header and variable length field
-            uint16_t length = MQTT_MAX_HEADER_SIZE;
-            unsigned int j;
+    if (result == 1) {
+        nextMsgId = 1;
+        resetParser();
+        this->batchLength = 0;
+        // Leave room in the buffer for header and variable length field
+        uint16_t length = MQTT_MAX_HEADER_SIZE;
+        unsigned int j;
 
 #if MQTT_VERSION == MQTT_VERSION_3_1
-            uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
+        uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
 #define MQTT_HEADER_VERSION_LENGTH 9
 #elif MQTT_VERSION == MQTT_VERSION_3_1_1
-            uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
+        uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
 #define MQTT_HEADER_VERSION_LENGTH 7
 #endif
-            for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
-                this->buffer[length++] = d[j];
-            }
+        for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
+            this->buffer[length++] = d[j];
+        }
 
-            uint8_t v;
-            if (willTopic) {
-                v = 0x04|(willQos<<3)|(willRetain<<5);
-            } else {
-                v = 0x00;
-            }
-            if (cleanSession) {
-                v = v|0x02;
-            }
+        uint8_t v;
+        if (willTopic) {
+            v = 0x04|(willQos<<3)|(willRetain<<5);
+        } else {
+            v = 0x00;
+        }
+        if (cleanSession) {
+            v = v|0x02;
+        }
 
-            if(user != NULL) {
-                v = v|0x80;
+        if(user != NULL) {
+            v = v|0x80;
 
-                if(pass != NULL) {
-                    v = v|(0x80>>1);
-                }
-            }
-            this->buffer[length++] = v;
-
-            this->buffer[length++] = ((this->keepAlive) >> 8);
-            this->buffer[length++] = ((this->keepAlive) & 0xFF);
-
-            CHECK_STRING_LENGTH(length,id)
-            length = writeString(id,this->buffer,length);
-            if (willTopic) {
-                CHECK_STRING_LENGTH(length,willTopic)
-                length = writeString(willTopic,this->buffer,length);
-                CHECK_STRING_LENGTH(length,willMessage)
-                length = writeString(willMessage,this->buffer,length);
+            if(pass != NULL) {
+                v = v|(0x80>>1);
             }
+        }
+        this->buffer[length++] = v;
+
+        this->buffer[length++] = ((this->keepAlive) >> 8);
+        this->buffer[length++] = ((this->keepAlive) & 0xFF);
+
+        CHECK_STRING_LENGTH(length,id)
+        length = writeString(id,this->buffer,length);
+        if (willTopic) {
+            CHECK_STRING_LENGTH(length,willTopic)
+            length = writeString(willTopic,this->buffer,length);
+            CHECK_STRING_LENGTH(length,willMessage)
+            length = writeString(willMessage,this->buffer,length);
+        }
 
-            if(user != NULL) {
-                CHECK_STRING_LENGTH(length,user)
-                length = writeString(user,this->buffer,length);
-                if(pass != NULL) {
-                    CHECK_STRING_LENGTH(length,pass)
-                    length = writeString(pass,this->buffer,length);
-                }
+        if(user != NULL) {
+            CHECK_STRING_LENGTH(length,user)
+            length = writeString(user,this->buffer,length);
+            if(pass != NULL) {
+                CHECK_STRING_LENGTH(length,pass)
+                length = writeString(pass,this->buffer,length);
             }
+        }
 
-            write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
 
-            lastInActivity = lastOutActivity = millis();
+        lastInActivity = lastOutActivity = millis();
+        return true;
+    }
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+}
 
-            while (!_client->available()) {
-                unsigned long t = millis();
-                if (t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
-                    _state = MQTT_CONNECTION_TIMEOUT;
-                    _client->stop();
-                    return false;
-                }
-            }
-            uint8_t llen;
-            uint32_t len = readPacket(&llen);
+boolean PubSubClient::readConnack() {
+    uint8_t llen;
+    uint32_t len = readPacket(&llen);
 
-            if (len == 4) {
-                if (buffer[3] == 0) {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                } else {
-                    _state = buffer[3];
-                }
-            }
-            _client->stop();
+    if (len == 4) {
+        if (buffer[3] == 0) {
+            lastInActivity = millis();
+            pingOutstanding = false;
+            _state = MQTT_CONNECTED;
+            return true;
         } else {
-            _state = MQTT_CONNECT_FAILED;
+            _state = buffer[3];
         }
-        return false;
+    } else if (_state == MQTT_CONNECTING) {
+        _state = MQTT_CONNECT_FAILED;
     }
-    return true;
+    _client->stop();
+    return false;
 }
+// *** FF_CHANGE ***
 
 // reads a byte into result
 boolean PubSubClient::readByte(uint8_t * result) {
@@ -367,7 +503,134 @@ uint32_t PubSubClient::readPacket(uint8_t* lengthLength) {
     return len;
 }
 
+// *** FF_CHANGE ***
+#define MQTT_PARSE_HEADER 0
+#define MQTT_PARSE_LENGTH 1
+#define MQTT_PARSE_BODY   2
+
+void PubSubClient::resetParser() {
+    this->parseStage = MQTT_PARSE_HEADER;
+}
+
+boolean PubSubClient::parsePacket(uint8_t* lengthLength, uint16_t* length) {
+    int available;
+
+    while ((available = _client->available()) > 0) {
+        if (this->parseStage == MQTT_PARSE_HEADER) {
+            this->rxBuffer[0] = _client->read();
+            this->parseLen = 1;
+            this->parseLength = 0;
+            this->parseMultiplier = 1;
+            this->parseBody = 0;
+            this->parseSkip = 0;
+            this->parseStage = MQTT_PARSE_LENGTH;
+        } else if (this->parseStage == MQTT_PARSE_LENGTH) {
+            if (this->parseLen == 5) {
+                // Invalid remaining length encoding - kill the connection
+                _state = MQTT_DISCONNECTED;
+                _client->stop();
+                resetParser();
+                *length = 0;
+                return true;
+            }
+            uint8_t digit = _client->read();
+            this->rxBuffer[this->parseLen++] = digit;
+            this->parseLength += (digit & 127) * this->parseMultiplier;
+            this->parseMultiplier <<= 7; //multiplier *= 128
+            if ((digit & 128) == 0) {
+                this->parseLlen = this->parseLen-1;
+                this->parseStage = MQTT_PARSE_BODY;
+            }
+        } else {
+            // Read as many body bytes as available, in one call
+            uint8_t scratch[32];
+            uint8_t* chunk;
+            uint32_t count = this->parseLength - this->parseBody;
+            if (count > (uint32_t) available) {
+                count = available;
+            }
+            if (this->parseLen < this->bufferSize) {
+                chunk = this->rxBuffer + this->parseLen;
+                if (count > (uint32_t) (this->bufferSize - this->parseLen)) {
+                    count = this->bufferSize - this->parseLen;
+                }
+            } else {
+                // Packet doesn't fit in buffer, read the rest (for stream, or to skip it)
+                chunk = scratch;
+                if (count > sizeof(scratch)) {
+                    count = sizeof(scratch);
+                }
+            }
+            int rc = _client->read(chunk, count);
+            if (rc <= 0) {
+                break;
+            }
+            if (chunk != scratch) {
+                this->parseLen += rc;
+            }
+            if (this->stream && (this->rxBuffer[0]&0xF0) == MQTTPUBLISH) {
+                // First 2 body bytes give topic length to skip before payload (always kept in buffer)
+                if (this->parseBody < 2 && this->parseBody + rc >= 2) {
+                    this->parseSkip = 2 + (this->rxBuffer[this->parseLlen+1]<<8) + this->rxBuffer[this->parseLlen+2];
+                    if (this->rxBuffer[0]&MQTTQOS1) {
+                        // skip message id
+                        this->parseSkip += 2;
+                    }
+                }
+                for (int i = 0; i < rc; i++) {
+                    if (this->parseSkip && this->parseBody + i >= this->parseSkip) {
+                        this->stream->write(chunk[i]);
+                    }
+                }
+            }
+            this->parseBody += rc;
+        }
+        if (this->parseStage == MQTT_PARSE_BODY && this->parseBody == this->parseLength) {
+            // Full packet received
+            *lengthLength = this->parseLlen;
+            *length = this->parseLen;
+            if (!this->stream && (1 + this->parseLlen + this->parseLength) > this->bufferSize) {
+                *length = 0; // This will cause the packet to be ignored.
+            }
+            resetParser();
+            return true;
+        }
+    }
+    return false;
+}
+
+void PubSubClient::dispatch(char* topic, uint16_t topicLength, uint8_t* payload, unsigned int length) {
+    for (uint8_t i = 0; i < this->topicCallbackCount; i++) {
+        if (this->topicCallbackLength[i] == topicLength && memcmp(topic, this->topicCallbackTopic[i], topicLength) == 0) {
+            this->topicCallback[i](topic,payload,length);
+            return;
+        }
+    }
+    if (callback) {
+        callback(topic,payload,length);
+    }
+}
+// *** FF_CHANGE ***
+
 boolean PubSubClient::loop() {
+    // *** FF_CHANGE ***
+    if (_state == MQTT_CONNECTING) {
+        // Wait for full CONNACK (4 bytes) without blocking
+        if (_client->available() >= 4) {
+            return readConnack();
+        }
+        if (!_client->connected()) {
+            _state = MQTT_CONNECTION_LOST;
+            _client->stop();
+        } else if (millis()-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
+            _state = MQTT_CONNECTION_TIMEOUT;
+            _client->stop();
+        }
+        return false;
+    }
+    // Send what has been batched since last call
+    flushBatch();
+    // *** FF_CHANGE ***
     if (connected()) {
         unsigned long t = millis();
         if ((t - lastInActivity > this->keepAlive*1000UL) || (t - lastOutActivity > this->keepAlive*1000UL)) {
@@ -378,53 +641,69 @@ boolean PubSubClient::loop() {
             } else {
                 this->buffer[0] = MQTTPINGREQ;
                 this->buffer[1] = 0;
-                _client->write(this->buffer,2);
+                // *** FF_CHANGE ***
+                writePacket(this->buffer,2);
+                // *** FF_CHANGE ***
                 lastOutActivity = t;
                 lastInActivity = t;
                 pingOutstanding = true;
             }
         }
-        if (_client->available()) {
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
+        // *** FF_CHANGE ***
+        uint8_t llen;
+        uint16_t len;
+        if (parsePacket(&llen, &len)) {
+        // *** FF_CHANGE ***
             uint16_t msgId = 0;
             uint8_t *payload;
             if (len > 0) {
                 lastInActivity = t;
-                uint8_t type = this->buffer[0]&0xF0;
+                uint8_t type = this->rxBuffer[0]&0xF0;
                 if (type == MQTTPUBLISH) {
-                    if (callback) {
-                        uint16_t tl = (this->buffer[llen+1]<<8)+this->buffer[llen+2]; /* topic length in bytes */
-                        memmove(this->buffer+llen+2,this->buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
-                        this->buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
-                        char *topic = (char*) this->buffer+llen+2;
+                    // *** FF_CHANGE ***
+                    if (callback || topicCallbackCount) {
+                        // End payload as a 'C' string (rxBuffer has one extra byte for this)
+                        this->rxBuffer[len] = 0;
+                    // *** FF_CHANGE ***
+                        uint16_t tl = (this->rxBuffer[llen+1]<<8)+this->rxBuffer[llen+2]; /* topic length in bytes */
+                        memmove(this->rxBuffer+llen+2,this->rxBuffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
+                        this->rxBuffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
+                        char *topic = (char*) this->rxBuffer+llen+2;
                         // msgId only present for QOS>0
-                        if ((this->buffer[0]&0x06) == MQTTQOS1) {
-                            msgId = (this->buffer[llen+3+tl]<<8)+this->buffer[llen+3+tl+1];
-                            payload = this->buffer+llen+3+tl+2;
-                            callback(topic,payload,len-llen-3-tl-2);
+                        if ((this->rxBuffer[0]&0x06) == MQTTQOS1) {
+                            msgId = (this->rxBuffer[llen+3+tl]<<8)+this->rxBuffer[llen+3+tl+1];
+                            payload = this->rxBuffer+llen+3+tl+2;
+                            // *** FF_CHANGE ***
+                            dispatch(topic,tl,payload,len-llen-3-tl-2);
+                            // *** FF_CHANGE ***
 
                             this->buffer[0] = MQTTPUBACK;
                             this->buffer[1] = 2;
                             this->buffer[2] = (msgId >> 8);
                             this->buffer[3] = (msgId & 0xFF);
-                            _client->write(this->buffer,4);
+                            // *** FF_CHANGE ***
+                            writePacket(this->buffer,4);
+                            // *** FF_CHANGE ***
                             lastOutActivity = t;
 
                         } else {
-                            payload = this->buffer+llen+3+tl;
-                            callback(topic,payload,len-llen-3-tl);
+                            payload = this->rxBuffer+llen+3+tl;
+                            // *** FF_CHANGE ***
+                            dispatch(topic,tl,payload,len-llen-3-tl);
+                            // *** FF_CHANGE ***
                         }
                     }
                 } else if (type == MQTTPINGREQ) {
                     this->buffer[0] = MQTTPINGRESP;
                     this->buffer[1] = 0;
-                    _client->write(this->buffer,2);
+                    // *** FF_CHANGE ***
+                    writePacket(this->buffer,2);
+                    // *** FF_CHANGE ***
                 } else if (type == MQTTPINGRESP) {
                     pingOutstanding = false;
                 }
             } else if (!connected()) {
-                // readPacket has closed the connection
+                // parsePacket has closed the connection
                 return false;
             }
         }
@@ -490,6 +769,11 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
         return false;
     }
 
+    // *** FF_CHANGE ***
+    // Keep packets order
+    flushBatch();
+    // *** FF_CHANGE ***
+
     tlen = strnlen(topic, this->bufferSize);
 
     header = MQTTPUBLISH;
@@ -525,6 +809,10 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
 
 boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
     if (connected()) {
+        // *** FF_CHANGE ***
+        // Keep packets order
+        flushBatch();
+        // *** FF_CHANGE ***
         // Send the header and variable length field
         uint16_t length = MQTT_MAX_HEADER_SIZE;
         length = writeString(topic,this->buffer,length);
@@ -582,6 +870,12 @@ boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
     uint16_t rc;
     uint8_t hlen = buildHeader(header, buf, length);
 
+    // *** FF_CHANGE ***
+    if (batchPacket(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen)) {
+        return true;
+    }
+    // *** FF_CHANGE ***
+
 #ifdef MQTT_MAX_TRANSFER_SIZE
     uint8_t* writeBuf = buf+(MQTT_MAX_HEADER_SIZE-hlen);
     uint16_t bytesRemaining = length+hlen;  //Match the length type
@@ -634,6 +928,42 @@ boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
     return false;
 }
 
+// *** FF_CHANGE ***
+boolean PubSubClient::subscribe(const char* topics[], uint8_t count, uint8_t qos) {
+    if (qos > 1 || count == 0) {
+        return false;
+    }
+    // Header, message id and (length, topic, qos) for each topic
+    size_t totalLength = MQTT_MAX_HEADER_SIZE + 2;
+    for (uint8_t i = 0; i < count; i++) {
+        if (topics[i] == 0) {
+            return false;
+        }
+        totalLength += 3 + strnlen(topics[i], this->bufferSize);
+    }
+    if (this->bufferSize < totalLength) {
+        // Too long
+        return false;
+    }
+    if (connected()) {
+        // Leave room in the buffer for header and variable length field
+        uint16_t length = MQTT_MAX_HEADER_SIZE;
+        nextMsgId++;
+        if (nextMsgId == 0) {
+            nextMsgId = 1;
+        }
+        this->buffer[length++] = (nextMsgId >> 8);
+        this->buffer[length++] = (nextMsgId & 0xFF);
+        for (uint8_t i = 0; i < count; i++) {
+            length = writeString(topics[i], this->buffer,length);
+            this->buffer[length++] = qos;
+        }
+        return write(MQTTSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+    }
+    return false;
+}
+// *** FF_CHANGE ***
+
 boolean PubSubClient::unsubscribe(const char* topic) {
 	size_t topicLength = strnlen(topic, this->bufferSize);
     if (topic == 0) {
@@ -658,6 +988,9 @@ boolean PubSubClient::unsubscribe(const char* topic) {
 }
 
 void PubSubClient::disconnect() {
+    // *** FF_CHANGE ***
+    flushBatch();
+    // *** FF_CHANGE ***
     this->buffer[0] = MQTTDISCONNECT;
     this->buffer[1] = 0;
     _client->write(this->buffer,2);
@@ -723,6 +1056,19 @@ PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
     return *this;
 }
 
+// *** FF_CHANGE ***
+boolean PubSubClient::setTopicCallback(const char* topic, MqttTopicCallback callback) {
+    if (topic == NULL || this->topicCallbackCount >= MQTT_MAX_TOPIC_CALLBACKS) {
+        return false;
+    }
+    this->topicCallbackTopic[this->topicCallbackCount] = topic;
+    this->topicCallbackLength[this->topicCallbackCount] = strlen(topic);
+    this->topicCallback[this->topicCallbackCount] = callback;
+    this->topicCallbackCount++;
+    return true;
+}
+// *** FF_CHANGE ***
+
 PubSubClient& PubSubClient::setClient(Client& client){
     this->_client = &client;
     return *this;
@@ -742,8 +1088,19 @@ boolean PubSubClient::setBufferSize(uint16_t size) {
         // Cannot set it back to 0
         return false;
     }
+    // *** FF_CHANGE ***
+    if (this->staticBuffers) {
+        // Static buffers can't be resized
+        return (size == this->bufferSize);
+    }
+    // *** FF_CHANGE ***
     if (this->bufferSize == 0) {
         this->buffer = (uint8_t*)malloc(size);
+        // *** FF_CHANGE ***
+        // One more byte to end received payload as a 'C' string
+        this->rxBuffer = (uint8_t*)malloc(size+1);
+        resetParser();
+        // *** FF_CHANGE ***
     } else {
         uint8_t* newBuffer = (uint8_t*)realloc(this->buffer, size);
         if (newBuffer != NULL) {
@@ -751,9 +1108,19 @@ boolean PubSubClient::setBufferSize(uint16_t size) {
         } else {
             return false;
         }
+        // *** FF_CHANGE ***
+        newBuffer = (uint8_t*)realloc(this->rxBuffer, size+1);
+        if (newBuffer != NULL) {
+            this->rxBuffer = newBuffer;
+        } else {
+            return false;
+        }
+        // Packet being received may not fit anymore
+        resetParser();
+        // *** FF_CHANGE ***
     }
     this->bufferSize = size;
-    return (this->buffer != NULL);
+    return (this->buffer != NULL && this->rxBuffer != NULL);
 }
 
 uint16_t PubSubClient::getBufferSize() {
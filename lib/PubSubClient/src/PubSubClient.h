@@ -42,6 +42,9 @@
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
 // Possible values for client.state()
+// *** FF_CHANGE ***
+#define MQTT_CONNECTING             -5
+// *** FF_CHANGE ***
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -83,6 +86,19 @@
 #define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
 #endif
 
+// *** FF_CHANGE ***
+// MQTT_MAX_TOPIC_CALLBACKS : maximum number of per topic callbacks (see setTopicCallback)
+#ifndef MQTT_MAX_TOPIC_CALLBACKS
+#define MQTT_MAX_TOPIC_CALLBACKS 4
+#endif
+
+#if defined(ESP8266) || defined(ESP32)
+typedef std::function<void(char*, uint8_t*, unsigned int)> MqttTopicCallback;
+#else
+typedef void (*MqttTopicCallback)(char*, uint8_t*, unsigned int);
+#endif
+// *** FF_CHANGE ***
+
 #define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, this->bufferSize) > this->bufferSize) {_client->stop();return false;}
 
 class PubSubClient : public Print {
@@ -107,11 +123,55 @@ private:
    // Note: the header is built at the end of the first MQTT_MAX_HEADER_SIZE bytes, so will start
    //       (MQTT_MAX_HEADER_SIZE - <returned size>) bytes into the buffer
    size_t buildHeader(uint8_t header, uint8_t* buf, uint16_t length);
+   // *** FF_CHANGE ***
+   // Open TCP connection (if needed) and send CONNECT packet
+   boolean sendConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Read and check CONNACK packet
+   boolean readConnack();
+   // Incremental packet parser: received packets are assembled in rxBuffer across loop() calls,
+   //  so that a partially received packet doesn't block, and doesn't get overwritten by publish()
+   uint8_t* rxBuffer;
+   uint8_t parseStage;
+   uint8_t parseLlen;
+   uint16_t parseLen;
+   uint32_t parseLength;
+   uint32_t parseBody;
+   uint32_t parseMultiplier;
+   uint32_t parseSkip;
+   // Consume available bytes. Returns true when a full packet is in rxBuffer (length is 0 if packet should be ignored)
+   boolean parsePacket(uint8_t* lengthLength, uint16_t* length);
+   void resetParser();
+   // Per topic callbacks
+   const char* topicCallbackTopic[MQTT_MAX_TOPIC_CALLBACKS];
+   uint16_t topicCallbackLength[MQTT_MAX_TOPIC_CALLBACKS];
+   MqttTopicCallback topicCallback[MQTT_MAX_TOPIC_CALLBACKS];
+   uint8_t topicCallbackCount = 0;
+   // Give received message to its topic callback (or default one)
+   void dispatch(char* topic, uint16_t topicLength, uint8_t* payload, unsigned int length);
+   // Outgoing packets batch (while connected), sent in one write by flushBatch()
+   uint8_t* batchBuffer = NULL;
+   uint16_t batchSize = 0;
+   uint16_t batchLength = 0;
+   // Add a packet to batch. Returns false if batching is off or packet too large (caller should send it)
+   boolean batchPacket(const uint8_t* buf, uint16_t length);
+   // Batch or send a packet
+   boolean writePacket(const uint8_t* buf, uint16_t length);
+   // Buffers given by caller (see StaticPubSubClient): never reallocated nor freed
+   boolean staticBuffers = false;
+   boolean staticBatch = false;
+   // *** FF_CHANGE ***
    IPAddress ip;
    const char* domain;
    uint16_t port;
    Stream* stream;
    int _state;
+// *** FF_CHANGE ***
+protected:
+   // Use caller's buffers (rxBuffer should be size+1 bytes long) instead of allocating them
+   PubSubClient(Client& client, uint8_t* txBuffer, uint8_t* rxBuffer, uint16_t size);
+   // Use caller's batch buffer instead of allocating it
+   void setBatchBuffer(uint8_t* storage, uint16_t size);
+// *** FF_CHANGE ***
 public:
    PubSubClient();
    PubSubClient(Client& client);
@@ -134,11 +194,21 @@ public:
    PubSubClient& setServer(uint8_t * ip, uint16_t port);
    PubSubClient& setServer(const char * domain, uint16_t port);
    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+   // *** FF_CHANGE ***
+   // Call a specific callback for messages received on given topic (exact match, no wildcard).
+   // Topic should stay allocated. Messages on other topics go to default callback.
+   // Note that payload given to callbacks is null terminated (in buffer, without copy).
+   // Returns false if MQTT_MAX_TOPIC_CALLBACKS are already set.
+   boolean setTopicCallback(const char* topic, MqttTopicCallback callback);
+   // *** FF_CHANGE ***
    PubSubClient& setClient(Client& client);
    PubSubClient& setStream(Stream& stream);
    PubSubClient& setKeepAlive(uint16_t keepAlive);
    PubSubClient& setSocketTimeout(uint16_t timeout);
 
+   // *** FF_CHANGE ***
+   // Note that size of static buffers (see StaticPubSubClient) can't be changed
+   // *** FF_CHANGE ***
    boolean setBufferSize(uint16_t size);
    uint16_t getBufferSize();
 
@@ -147,6 +217,22 @@ public:
    boolean connect(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // *** FF_CHANGE ***
+   // Start a connection without waiting for CONNACK. Returns true if CONNECT has been sent.
+   // loop() then completes it: state() is MQTT_CONNECTING until connected() or failure.
+   // Note that TCP connection itself is still done by client (use its timeout to limit it).
+   boolean beginConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession = 1);
+   // Is an asynchronous connection in progress?
+   boolean connecting();
+   // Batch packets sent while connected (publish, subscribe, acks...) in a buffer of given size (0 to stop batching).
+   // They're sent in one write by flushBatch() (or when buffer is full, or at loop() start).
+   boolean setBatchSize(uint16_t size);
+   // Send batched packets. Returns false if write failed
+   boolean flushBatch();
+   // Time (ms) before loop() has to send a keep alive ping (or to give up waiting for its answer), 0 if not connected.
+   // Received packets are to be checked by caller (client available()).
+   unsigned long keepAliveDelay();
+   // *** FF_CHANGE ***
    void disconnect();
    boolean publish(const char* topic, const char* payload);
    boolean publish(const char* topic, const char* payload, boolean retained);
@@ -173,6 +259,10 @@ public:
    virtual size_t write(const uint8_t *buffer, size_t size);
    boolean subscribe(const char* topic);
    boolean subscribe(const char* topic, uint8_t qos);
+   // *** FF_CHANGE ***
+   // Subscribe to multiple topics with one SUBSCRIBE packet
+   boolean subscribe(const char* topics[], uint8_t count, uint8_t qos = 0);
+   // *** FF_CHANGE ***
    boolean unsubscribe(const char* topic);
    boolean loop();
    boolean connected();
@@ -180,5 +270,23 @@ public:
 
 };
 
+// *** FF_CHANGE ***
+// PubSubClient with buffers allocated at compile time (in object itself), so it never uses heap.
+// SIZE is maximum packet size, BATCH_SIZE size of batch buffer (0 if not batching).
+// setBufferSize() and setBatchSize() return false on such client.
+template<uint16_t SIZE, uint16_t BATCH_SIZE = 0>
+class StaticPubSubClient : public PubSubClient {
+private:
+   uint8_t txStorage[SIZE];
+   uint8_t rxStorage[SIZE + 1];
+   uint8_t batchStorage[BATCH_SIZE ? BATCH_SIZE : 1];
+public:
+   StaticPubSubClient(Client& client) : PubSubClient(client, txStorage, rxStorage, SIZE) {
+      if (BATCH_SIZE) {
+         setBatchBuffer(batchStorage, BATCH_SIZE);
+      }
+   }
+};
+// *** FF_CHANGE ***
 
 #endif
@@ -0,0 +1,454 @@
+/*
+  PullUpdate.cpp - Download and flash a firmware image over HTTP, a chunk at a time.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#include "PullUpdate.h"
+#include <Updater.h>
+#include <stdarg.h>
+
+#define DELTA_SIGNATURE "FFD1"
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL_OP 'L'
+
+PullUpdate::PullUpdate() {
+    this->client = NULL;
+    this->currentState = UPDATE_IDLE;
+    this->maxRetries = 10;
+    this->retryDelay = 5000;
+    this->timeout = 10000;
+    this->updaterStarted = false;
+    this->errorText[0] = 0;
+}
+
+void PullUpdate::setRetry(uint8_t maxRetries, unsigned long retryDelay, unsigned long timeout) {
+    this->maxRetries = maxRetries;
+    this->retryDelay = retryDelay;
+    this->timeout = timeout;
+}
+
+bool PullUpdate::begin(Client &client, const char* url, const char* md5) {
+    abort();
+    this->errorText[0] = 0;
+    if (!parseUrl(url)) {
+        fail("Bad URL %s", url);
+        return false;
+    }
+    if (strlen(md5) != 32) {
+        fail("Bad MD5 %s", md5);
+        return false;
+    }
+    strcpy(this->md5, md5);
+    this->client = &client;
+    this->retries = 0;
+    this->resumeCount = 0;
+    this->offset = 0;
+    this->resourceSize = 0;
+    this->isDelta = false;
+    this->typeKnown = false;
+    this->size = 0;
+    this->writtenBytes = 0;
+    this->deltaState = DELTA_HEADER;
+    this->deltaLength = 0;
+    this->literalRemaining = 0;
+    this->copyRemaining = 0;
+    this->bufferStart = 0;
+    this->bufferLength = 0;
+    this->currentState = UPDATE_REQUEST;
+    return true;
+}
+
+PullUpdate::State PullUpdate::run(size_t maxBytes) {
+    maxBytes = min(maxBytes, (size_t) PULL_UPDATE_BUFFER_SIZE);
+    switch (this->currentState) {
+        case UPDATE_REQUEST:
+            request();
+            break;
+        case UPDATE_HEADERS:
+            readHeaders(maxBytes);
+            break;
+        case UPDATE_BODY:
+            if (this->copyRemaining) {
+                // Copy running image bytes before applying next received ones
+                copy(maxBytes);
+            } else if (this->bufferLength) {
+                // Apply bytes received before a copy operation
+                size_t used = apply(this->buffer + this->bufferStart, this->bufferLength);
+                this->bufferStart += used;
+                this->bufferLength -= used;
+            } else {
+                readBody(maxBytes);
+            }
+            if (this->currentState == UPDATE_BODY && this->size && this->writtenBytes >= this->size
+                    && !this->copyRemaining && !this->literalRemaining) {
+                finish();
+            }
+            break;
+        case UPDATE_RETRY:
+            if ((millis() - this->lastActivity) >= this->retryDelay) {
+                this->currentState = UPDATE_REQUEST;
+            }
+            break;
+        default:
+            break;
+    }
+    return this->currentState;
+}
+
+void PullUpdate::abort() {
+    if (this->client) {
+        this->client->stop();
+    }
+    if (this->updaterStarted) {
+        // Ending an unfinished update drops it
+        Update.end();
+        this->updaterStarted = false;
+    }
+    this->currentState = UPDATE_IDLE;
+}
+
+PullUpdate::State PullUpdate::state() {
+    return this->currentState;
+}
+
+bool PullUpdate::running() {
+    return this->currentState >= UPDATE_REQUEST && this->currentState <= UPDATE_RETRY;
+}
+
+bool PullUpdate::delta() {
+    return this->isDelta;
+}
+
+uint32_t PullUpdate::imageSize() {
+    return this->size;
+}
+
+uint32_t PullUpdate::written() {
+    return this->writtenBytes;
+}
+
+unsigned long PullUpdate::resumes() {
+    return this->resumeCount;
+}
+
+const char* PullUpdate::error() {
+    return this->errorText;
+}
+
+// Split "http://host[:port]/path". Returns false if not valid
+bool PullUpdate::parseUrl(const char* url) {
+    if (strncmp(url, "http://", 7)) {
+        return false;
+    }
+    const char* start = url + 7;
+    const char* slash = strchr(start, '/');
+    if (!slash || strlen(slash) >= sizeof(this->path)) {
+        return false;
+    }
+    const char* colon = (const char*) memchr(start, ':', slash - start);
+    const char* hostEnd = colon ? colon : slash;
+    if (hostEnd == start || (size_t) (hostEnd - start) >= sizeof(this->host)) {
+        return false;
+    }
+    memcpy(this->host, start, hostEnd - start);
+    this->host[hostEnd - start] = 0;
+    this->port = colon ? atoi(colon + 1) : 80;
+    strcpy(this->path, slash);
+    return this->port != 0;
+}
+
+// Connect and ask for resource, from current offset
+void PullUpdate::request() {
+    if (!this->client->connect(this->host, this->port)) {
+        connectionLost();
+        return;
+    }
+    char request[sizeof(this->path) + sizeof(this->host) + 64];
+    int length = snprintf_P(request, sizeof(request), PSTR("GET %s HTTP/1.0\r\nHost: %s\r\n"), this->path, this->host);
+    if (this->offset) {
+        length += snprintf_P(request + length, sizeof(request) - length, PSTR("Range: bytes=%lu-\r\n"),
+            (unsigned long) this->offset);
+    }
+    length += snprintf_P(request + length, sizeof(request) - length, PSTR("\r\n"));
+    if (this->client->write((const uint8_t*) request, length) != (size_t) length) {
+        connectionLost();
+        return;
+    }
+    this->httpStatus = 0;
+    this->bodyLength = -1;
+    this->bodyReceived = 0;
+    this->rangeStart = 0;
+    this->skip = 0;
+    this->lineLength = 0;
+    this->lastActivity = millis();
+    this->currentState = UPDATE_HEADERS;
+}
+
+// Read answer headers (a line at a time)
+void PullUpdate::readHeaders(size_t maxBytes) {
+    while (maxBytes-- && this->client->available() > 0) {
+        int c = this->client->read();
+        if (c < 0) {
+            break;
+        }
+        this->lastActivity = millis();
+        if (c == '\r') {
+            continue;
+        }
+        if (c != '\n') {
+            // Keep start of too long lines (only short ones are useful)
+            if (this->lineLength < sizeof(this->line) - 1) {
+                this->line[this->lineLength++] = c;
+            }
+            continue;
+        }
+        this->line[this->lineLength] = 0;
+        bool more = this->lineLength ? headerLine() : headersDone();
+        this->lineLength = 0;
+        if (!more) {
+            return;
+        }
+    }
+    if (this->client->available() <= 0 && ((millis() - this->lastActivity) > this->timeout || !this->client->connected())) {
+        connectionLost();
+    }
+}
+
+// Parse a header line. Returns false if update failed
+bool PullUpdate::headerLine() {
+    if (!this->httpStatus) {
+        // Status line
+        const char* space = strchr(this->line, ' ');
+        if (strncmp(this->line, "HTTP/", 5) || !space) {
+            fail("Bad answer %s", this->line);
+            return false;
+        }
+        this->httpStatus = atoi(space + 1);
+    } else if (!strncasecmp(this->line, "Content-Length:", 15)) {
+        this->bodyLength = atol(this->line + 15);
+    } else if (!strncasecmp(this->line, "Content-Range:", 14)) {
+        // "bytes start-end/size"
+        const char* start = strpbrk(this->line + 14, "0123456789");
+        this->rangeStart = start ? strtoul(start, NULL, 10) : 0;
+    }
+    return true;
+}
+
+// All headers read, check answer. Returns false (no more headers to read)
+bool PullUpdate::headersDone() {
+    if (this->httpStatus == 206 && this->rangeStart == this->offset && this->bodyLength >= 0) {
+        // Rest of resource
+    } else if (this->httpStatus == 200 && this->bodyLength >= 0) {
+        // Whole resource (ignore what we already have)
+        this->skip = this->offset;
+        if (!this->resourceSize) {
+            this->resourceSize = this->bodyLength;
+        } else if (this->resourceSize != (uint32_t) this->bodyLength) {
+            fail("Resource size changed (%lu, then %ld)", (unsigned long) this->resourceSize, (long) this->bodyLength);
+            return false;
+        }
+    } else {
+        fail("HTTP status %d%s", this->httpStatus, this->bodyLength < 0 ? " without length" : "");
+        return false;
+    }
+    this->currentState = UPDATE_BODY;
+    return false;
+}
+
+// Read received body bytes, and apply them
+void PullUpdate::readBody(size_t maxBytes) {
+    int available = this->client->available();
+    if (available <= 0) {
+        if (this->bodyReceived >= (uint32_t) this->bodyLength || (millis() - this->lastActivity) > this->timeout
+                || !this->client->connected()) {
+            connectionLost();
+        }
+        return;
+    }
+    int length = this->client->read(this->buffer, min((size_t) available, maxBytes));
+    if (length <= 0) {
+        return;
+    }
+    this->lastActivity = millis();
+    this->bodyReceived += length;
+    size_t start = 0;
+    if (this->skip) {
+        // Server ignored Range, drop bytes we already have
+        start = min((uint32_t) length, this->skip);
+        this->skip -= start;
+    }
+    this->offset += length - start;
+    if ((length - start) > 0) {
+        // Download goes on, allow as many resumes again
+        this->retries = 0;
+    }
+    if (!this->typeKnown && (length - start) > 0) {
+        // Resource starts with delta signature or image
+        this->typeKnown = true;
+        this->isDelta = this->buffer[start] == DELTA_SIGNATURE[0];
+        if (!this->isDelta && !startUpdater(this->resourceSize)) {
+            return;
+        }
+    }
+    size_t used = apply(this->buffer + start, length - start);
+    this->bufferStart = start + used;
+    this->bufferLength = length - start - used;
+}
+
+// Apply resource bytes. Returns count used (less than length if a copy has to be done first)
+size_t PullUpdate::apply(const uint8_t* data, size_t length) {
+    if (this->isDelta) {
+        return applyDelta(data, length);
+    }
+    // Image: write it, up to its size
+    length = min(length, (size_t) (this->size - this->writtenBytes));
+    write(data, length);
+    return length;
+}
+
+// Apply delta bytes. Returns count used (stopping at a copy operation)
+size_t PullUpdate::applyDelta(const uint8_t* data, size_t length) {
+    size_t used = 0;
+    while (used < length && this->currentState == UPDATE_BODY && !this->copyRemaining) {
+        switch (this->deltaState) {
+            case DELTA_HEADER:
+                this->deltaBuffer[this->deltaLength++] = data[used++];
+                if (this->deltaLength == 8) {
+                    if (memcmp(this->deltaBuffer, DELTA_SIGNATURE, 4)) {
+                        fail("Bad delta signature");
+                        break;
+                    }
+                    if (!startUpdater(readLong(this->deltaBuffer + 4))) {
+                        break;
+                    }
+                    this->deltaState = DELTA_OP;
+                }
+                break;
+            case DELTA_OP:
+                this->deltaOp = data[used++];
+                if (this->deltaOp != DELTA_COPY && this->deltaOp != DELTA_LITERAL_OP) {
+                    fail("Bad delta operation %02x", this->deltaOp);
+                    break;
+                }
+                this->deltaLength = 0;
+                this->deltaState = DELTA_ARGS;
+                break;
+            case DELTA_ARGS:
+                this->deltaBuffer[this->deltaLength++] = data[used++];
+                if (this->deltaOp == DELTA_COPY && this->deltaLength == 8) {
+                    this->copyOffset = readLong(this->deltaBuffer);
+                    this->copyRemaining = readLong(this->deltaBuffer + 4);
+                    if (this->copyOffset + this->copyRemaining > ESP.getSketchSize()
+                            || this->copyRemaining > this->size - this->writtenBytes) {
+                        fail("Delta copies outside of image");
+                        break;
+                    }
+                    this->deltaState = DELTA_OP;
+                } else if (this->deltaOp == DELTA_LITERAL_OP && this->deltaLength == 4) {
+                    this->literalRemaining = readLong(this->deltaBuffer);
+                    if (this->literalRemaining > this->size - this->writtenBytes) {
+                        fail("Delta writes outside of image");
+                        break;
+                    }
+                    this->deltaState = this->literalRemaining ? DELTA_LITERAL : DELTA_OP;
+                }
+                break;
+            case DELTA_LITERAL: {
+                size_t count = min(length - used, (size_t) this->literalRemaining);
+                if (!write(data + used, count)) {
+                    break;
+                }
+                used += count;
+                this->literalRemaining -= count;
+                if (!this->literalRemaining) {
+                    this->deltaState = DELTA_OP;
+                }
+                break;
+            }
+        }
+    }
+    return used;
+}
+
+// Copy bytes of running image (flash is read by aligned words)
+void PullUpdate::copy(size_t maxBytes) {
+    uint32_t start = this->copyOffset & ~3UL;
+    uint32_t shift = this->copyOffset - start;
+    size_t count = min((size_t) this->copyRemaining, min(maxBytes, sizeof(this->flashBuffer) - 4));
+    if (!ESP.flashRead(start, this->flashBuffer, (shift + count + 3) & ~3UL)) {
+        fail("Can't read running image at %lu", (unsigned long) start);
+        return;
+    }
+    if (write((const uint8_t*) this->flashBuffer + shift, count)) {
+        this->copyOffset += count;
+        this->copyRemaining -= count;
+    }
+}
+
+// Start Updater for an image of given size. Returns false if failed
+bool PullUpdate::startUpdater(uint32_t imageSize) {
+    if (!imageSize) {
+        fail("Empty image");
+        return false;
+    }
+    if (!Update.begin(imageSize)) {
+        fail("Can't start update of %lu bytes (error %u)", (unsigned long) imageSize, Update.getError());
+        return false;
+    }
+    Update.setMD5(this->md5);
+    this->updaterStarted = true;
+    this->size = imageSize;
+    return true;
+}
+
+// Write image bytes. Returns false if failed
+bool PullUpdate::write(const uint8_t* data, size_t length) {
+    if (!length) {
+        return true;
+    }
+    if (Update.write((uint8_t*) data, length) != length) {
+        fail("Can't write image at %lu (error %u)", (unsigned long) this->writtenBytes, Update.getError());
+        return false;
+    }
+    this->writtenBytes += length;
+    return true;
+}
+
+// Whole image written, let Updater check it
+void PullUpdate::finish() {
+    this->client->stop();
+    this->updaterStarted = false;
+    if (!Update.end()) {
+        fail("Image not valid (error %u)", Update.getError());
+        return;
+    }
+    this->currentState = UPDATE_DONE;
+}
+
+// Connection lost (or not established), resume later if allowed
+void PullUpdate::connectionLost() {
+    this->client->stop();
+    if (this->retries >= this->maxRetries) {
+        fail("Connection lost at %lu, too many retries", (unsigned long) this->offset);
+        return;
+    }
+    this->retries++;
+    this->resumeCount++;
+    this->lastActivity = millis();
+    this->currentState = UPDATE_RETRY;
+}
+
+// Stop update, giving reason
+void PullUpdate::fail(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(this->errorText, sizeof(this->errorText), format, args);
+    va_end(args);
+    abort();
+    this->currentState = UPDATE_FAILED;
+}
+
+uint32_t PullUpdate::readLong(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
@@ -0,0 +1,130 @@
+/*
+  PullUpdate.h - Download and flash a firmware image over HTTP, a chunk at a time.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Unlike ArduinoOTA (image pushed in one go), image is pulled by module over HTTP/1.0,
+  each run() call reading at most a given count of bytes, so that loop() goes on serving
+  button and MQTT during update. When connection drops, download is resumed at the same
+  offset (asking for the rest with a Range header). Image is written by Updater, which
+  checks its MD5 before committing it: new image is only booted if it matches.
+
+  Instead of an image, a delta against running image (made by makeDelta.py) can be given.
+  It is recognized by its signature, then applied on the fly:
+    - "FFD1", new image size (uint32),
+    - then operations, until new image is complete:
+        'C', offset (uint32), length (uint32): copy bytes of running image,
+        'L', length (uint32), then these bytes: literal bytes.
+  (integers are little endian)
+
+  TCP connection uses client timeout (as MQTT one), other steps don't block.
+*/
+
+#ifndef PullUpdate_h
+#define PullUpdate_h
+
+#include <Arduino.h>
+#include <Client.h>
+
+// PULL_UPDATE_BUFFER_SIZE : bytes read from connection (or copied from running image) at most by each run()
+#ifndef PULL_UPDATE_BUFFER_SIZE
+#define PULL_UPDATE_BUFFER_SIZE 512
+#endif
+
+class PullUpdate {
+public:
+   enum State {
+      UPDATE_IDLE,                                          // No update
+      UPDATE_REQUEST,                                       // Connect and send request (at offset)
+      UPDATE_HEADERS,                                       // Read answer headers
+      UPDATE_BODY,                                          // Read and write image (or apply delta)
+      UPDATE_RETRY,                                         // Connection lost, waiting to resume
+      UPDATE_DONE,                                          // Image written and checked, restart to boot it
+      UPDATE_FAILED                                         // Update stopped (see error())
+   };
+
+   PullUpdate();
+   // Set resume attempts after a connection loss (without new data since), delay before them (ms), and time without data before giving up a connection (ms)
+   void setRetry(uint8_t maxRetries, unsigned long retryDelay, unsigned long timeout);
+   // Start update from url ("http://host[:port]/path") of an image (or a delta) giving this MD5 (32 hex digits) once written
+   bool begin(Client &client, const char* url, const char* md5);
+   // Do next step, reading at most maxBytes. Returns state
+   State run(size_t maxBytes = PULL_UPDATE_BUFFER_SIZE);
+   // Stop update (written data is dropped)
+   void abort();
+   State state();
+   // Is an update running?
+   bool running();
+   // Is a delta applied?
+   bool delta();
+   // New image size (0 until known) and bytes of it written
+   uint32_t imageSize();
+   uint32_t written();
+   // Count of resumes of current update
+   unsigned long resumes();
+   // Reason of last failure
+   const char* error();
+
+private:
+   enum DeltaState {
+      DELTA_HEADER,                                         // Signature and image size
+      DELTA_OP,                                             // Operation code
+      DELTA_ARGS,                                           // Operation arguments
+      DELTA_LITERAL                                         // Literal bytes
+   };
+   Client* client;
+   State currentState;
+   char host[64];
+   uint16_t port;
+   char path[128];
+   char md5[33];
+   uint8_t maxRetries;
+   unsigned long retryDelay;
+   unsigned long timeout;
+   uint8_t retries;                                         // Resumes done since last new data
+   unsigned long resumeCount;                               // Resumes done
+   unsigned long lastActivity;                              // Time (ms) of last data (or of connection loss in UPDATE_RETRY)
+   uint32_t offset;                                         // Bytes of resource (image or delta) already received
+   uint32_t skip;                                           // Bytes to ignore (server ignoring Range)
+   int32_t bodyLength;                                      // Content-Length of answer (-1 if not given)
+   uint32_t bodyReceived;                                   // Bytes of answer body received
+   int httpStatus;                                          // Answer status (0 until status line read)
+   uint32_t rangeStart;                                     // Content-Range start (of a 206 answer)
+   char line[128];                                          // Header line being read
+   uint8_t lineLength;
+   bool isDelta;                                            // Resource is a delta
+   bool typeKnown;                                          // Resource type has been checked
+   bool updaterStarted;                                     // Updater is running
+   uint32_t size;                                           // New image size
+   uint32_t writtenBytes;                                   // New image bytes written
+   uint32_t resourceSize;                                   // Resource size (from first answer)
+   DeltaState deltaState;
+   uint8_t deltaOp;
+   uint8_t deltaBuffer[8];                                  // Header or arguments being read
+   uint8_t deltaLength;                                     // Bytes in deltaBuffer
+   uint32_t literalRemaining;                               // Literal bytes still to write
+   uint32_t copyOffset;                                     // Running image offset of next copied byte
+   uint32_t copyRemaining;                                  // Bytes still to copy
+   uint8_t buffer[PULL_UPDATE_BUFFER_SIZE];                 // Received bytes not yet applied
+   size_t bufferStart;
+   size_t bufferLength;
+   uint32_t flashBuffer[PULL_UPDATE_BUFFER_SIZE / 4 + 2];   // Running image bytes (aligned reads)
+   char errorText[64];
+   bool parseUrl(const char* url);
+   void request();
+   void readHeaders(size_t maxBytes);
+   bool headerLine();
+   bool headersDone();
+   void readBody(size_t maxBytes);
+   size_t apply(const uint8_t* data, size_t length);
+   size_t applyDelta(const uint8_t* data, size_t length);
+   void copy(size_t maxBytes);
+   bool startUpdater(uint32_t imageSize);
+   bool write(const uint8_t* data, size_t length);
+   void finish();
+   void connectionLost();
+   void fail(const char* format, ...);
+   static uint32_t readLong(const uint8_t* data);
+};
+
+#endif
@@ -88,6 +88,15 @@ bool Syslog::vlogf(uint16_t pri, const char *fmt, va_list args) {
   size_t len;
   bool result;
 
+  // *** FF_CHANGE ***
+  // Don't format a message that would be filtered
+  if ((LOG_MASK(LOG_PRI(pri)) & this->_priMask) == 0)
+    return true;
+
+  if (this->_formatBuffer != NULL)
+    return this->_vlogfStatic(pri, fmt, args, false);
+  // *** FF_CHANGE ***
+
   initialLen = strlen(fmt);
 
   message = new char[initialLen + 1];
@@ -112,6 +121,15 @@ bool Syslog::vlogf_P(uint16_t pri, PGM_P fmt_P, va_list args) {
   size_t len;
   bool result;
 
+  // *** FF_CHANGE ***
+  // Don't format a message that would be filtered
+  if ((LOG_MASK(LOG_PRI(pri)) & this->_priMask) == 0)
+    return true;
+
+  if (this->_formatBuffer != NULL)
+    return this->_vlogfStatic(pri, fmt_P, args, true);
+  // *** FF_CHANGE ***
+
   initialLen = strlen_P(fmt_P);
 
   message = new char[initialLen + 1];
@@ -183,21 +201,110 @@ bool Syslog::log(const char *message) {
   return this->_sendLog(this->_priDefault, message);
 }
 
-// Private Methods /////////////////////////////////////////////////////////////
+// *** FF_CHANGE ***
+Syslog &Syslog::buffer(uint8_t* buffer, uint16_t size) {
+  this->_ringBuffer = (size > 4) ? buffer : NULL;
+  this->_ringSize = (this->_ringBuffer == NULL) ? 0 : size;
+  this->_ringHead = 0;
+  this->_ringTail = 0;
+  this->_ringUsed = 0;
+  return *this;
+}
 
-inline bool Syslog::_sendLog(uint16_t pri, const char *message) {
-  int result;
+Syslog &Syslog::pacing(uint16_t interval, uint8_t maxPackets, uint16_t maxBytes) {
+  this->_ringInterval = interval;
+  this->_ringMaxPackets = (maxPackets == 0) ? 1 : maxPackets;
+  this->_ringMaxBytes = maxBytes;
+  return *this;
+}
 
-  if ((this->_server == NULL && this->_ip == INADDR_NONE) || this->_port == 0)
-    return false;
+bool Syslog::loop() {
+  uint8_t packets = 0;
+  uint16_t bytes = 0;
+
+  while (this->_ringUsed) {
+    uint16_t pri = this->_ringPeek(0) | (this->_ringPeek(1) << 8);
+    uint16_t length = this->_ringPeek(2) | (this->_ringPeek(3) << 8);
+
+    // Check budget for this call (first packet is always allowed to avoid stalling on large messages)
+    if (packets >= this->_ringMaxPackets)
+      break;
+    if (packets && this->_ringMaxBytes && (bytes + length) > this->_ringMaxBytes)
+      break;
+    if ((millis() - this->_ringLastSend) < this->_ringInterval)
+      break;
+
+    // Message may wrap at end of buffer, it's stored in (up to) two parts
+    uint16_t start = (this->_ringTail + 4) % this->_ringSize;
+    uint16_t firstPart = this->_ringSize - start;
+    if (firstPart > length)
+      firstPart = length;
+
+    if (this->_formatBuffer != NULL) {
+      // Assemble header and message in format buffer, to send them in one write
+      uint16_t headerLength = this->_buildHeader(pri);
+      uint16_t room = this->_formatSize - headerLength;
+      char *text = this->_formatBuffer + headerLength;
+      uint16_t part1 = (firstPart < room) ? firstPart : room;
+      uint16_t part2 = ((length - firstPart) < (room - part1)) ? (length - firstPart) : (room - part1);
+      memcpy(text, this->_ringBuffer + start, part1);
+      memcpy(text + part1, this->_ringBuffer, part2);
+      // Keep message in buffer if it can't be sent now, we'll retry on next call
+      if (!this->_sendPacket(headerLength + this->_truncate(text, room, length)))
+        break;
+    } else {
+      // Keep message in buffer if it can't be sent now, we'll retry on next call
+      if (!this->_beginPacket(pri))
+        break;
+      this->_client->write(this->_ringBuffer + start, firstPart);
+      if (firstPart < length)
+        this->_client->write(this->_ringBuffer, length - firstPart);
+      this->_client->endPacket();
+    }
+
+    this->_ringTail = (start + length) % this->_ringSize;
+    this->_ringUsed -= length + 4;
+    this->_ringLastSend = millis();
+    packets++;
+    bytes += length;
+  }
+  return this->_ringUsed == 0;
+}
 
-  // Check priority against priMask values.
-  //if ((LOG_MASK(LOG_PRI(pri)) & this->_priMask) == 0)
-  //  return true;
+unsigned long Syslog::droppedCount() {
+  return this->_droppedCount;
+}
 
-  // Set default facility if none specified.
-  if ((pri & LOG_FACMASK) == 0)
-    pri = LOG_MAKEPRI(LOG_FAC(this->_priDefault), pri);
+uint16_t Syslog::pendingBytes() {
+  return this->_ringUsed;
+}
+
+unsigned long Syslog::nextSendMillis() {
+  // Packets and bytes budgets are given again at each loop() call, only interval delays next one
+  unsigned long now = millis();
+  if ((now - this->_ringLastSend) < this->_ringInterval)
+    return this->_ringLastSend + this->_ringInterval;
+  return now;
+}
+
+Syslog &Syslog::formatBuffer(char* buffer, uint16_t size) {
+  // Keep room for a minimal header and message
+  this->_formatBuffer = (size > 64) ? buffer : NULL;
+  this->_formatSize = (this->_formatBuffer == NULL) ? 0 : size;
+  return *this;
+}
+
+unsigned long Syslog::truncatedCount() {
+  return this->_truncatedCount;
+}
+// *** FF_CHANGE ***
+
+// Private Methods /////////////////////////////////////////////////////////////
+
+// *** FF_CHANGE ***
+// Open packet and write syslog header
+bool Syslog::_beginPacket(uint16_t pri) {
+  int result;
 
   if (this->_server != NULL) {
     result = this->_client->beginPacket(this->_server, this->_port);
@@ -225,6 +332,166 @@ inline bool Syslog::_sendLog(uint16_t pri, const char *message) {
   } else {
     this->_client->print(F("[0]: "));
   }
+  return true;
+}
+
+// Write syslog header at start of format buffer, returns its length
+uint16_t Syslog::_buildHeader(uint16_t pri) {
+  int length;
+
+  // IETF Doc: https://tools.ietf.org/html/rfc5424
+  // BSD Doc: https://tools.ietf.org/html/rfc3164
+  if (this->_protocol == SYSLOG_PROTO_IETF) {
+    length = snprintf_P(this->_formatBuffer, this->_formatSize, PSTR("<%u>1 - %s %s - - - \xEF\xBB\xBF"),
+      pri, this->_deviceHostname, this->_appName);
+  } else {
+    length = snprintf_P(this->_formatBuffer, this->_formatSize, PSTR("<%u>%s %s[0]: "),
+      pri, this->_deviceHostname, this->_appName);
+  }
+  if (length < 0)
+    return 0;
+  // Always keep room for (part of) message
+  if (length > this->_formatSize / 2)
+    length = this->_formatSize / 2;
+  return length;
+}
+
+// Returns length of message formatted in room bytes, marking it with "..." if truncated
+uint16_t Syslog::_truncate(char *message, uint16_t room, int length) {
+  if (length < 0)
+    length = 0;
+  if (length >= room) {
+    length = room - 1;
+    memcpy_P(message + length - 3, PSTR("..."), 3);
+    message[length] = 0;
+    this->_truncatedCount++;
+  }
+  return length;
+}
+
+// Copy message after header in format buffer and send it
+bool Syslog::_sendStatic(uint16_t pri, const char *message, bool isFlash) {
+  uint16_t headerLength = this->_buildHeader(pri);
+  uint16_t room = this->_formatSize - headerLength;
+  char *text = this->_formatBuffer + headerLength;
+  int length = isFlash ? strlen_P(message) : strlen(message);
+
+  if (isFlash) {
+    strncpy_P(text, message, room);
+  } else {
+    strncpy(text, message, room);
+  }
+  text[room - 1] = 0;
+  return this->_sendPacket(headerLength + this->_truncate(text, room, length));
+}
+
+// Format message into format buffer (after its header when not queued), then queue or send it
+bool Syslog::_vlogfStatic(uint16_t pri, const char *fmt, va_list args, bool isFlash) {
+  if ((this->_server == NULL && this->_ip == INADDR_NONE) || this->_port == 0)
+    return false;
+
+  // Set default facility if none specified.
+  if ((pri & LOG_FACMASK) == 0)
+    pri = LOG_MAKEPRI(LOG_FAC(this->_priDefault), pri);
+
+  // Queued messages get their header when sent
+  uint16_t headerLength = (this->_ringBuffer != NULL) ? 0 : this->_buildHeader(pri);
+  uint16_t room = this->_formatSize - headerLength;
+  char *message = this->_formatBuffer + headerLength;
+  int length = isFlash ? vsnprintf_P(message, room, fmt, args) : vsnprintf(message, room, fmt, args);
+
+  length = this->_truncate(message, room, length);
+  if (this->_ringBuffer != NULL)
+    return this->_queueLog(pri, message, false);
+  return this->_sendPacket(headerLength + length);
+}
+
+// Send length bytes of format buffer as one packet
+bool Syslog::_sendPacket(uint16_t length) {
+  int result;
+
+  if (this->_server != NULL) {
+    result = this->_client->beginPacket(this->_server, this->_port);
+  } else {
+    result = this->_client->beginPacket(this->_ip, this->_port);
+  }
+
+  if (result != 1)
+    return false;
+
+  this->_client->write((const uint8_t*) this->_formatBuffer, length);
+  this->_client->endPacket();
+  this->lastSyslogMillis = millis();
+  // Queued messages are paced by loop()
+  if (this->_ringBuffer == NULL)
+    delay(30);
+  return true;
+}
+
+// Copy data at head of ring buffer (caller checked free space)
+void Syslog::_ringPut(const uint8_t *data, uint16_t length, bool isFlash) {
+  uint16_t firstPart = this->_ringSize - this->_ringHead;
+  if (firstPart > length)
+    firstPart = length;
+  if (isFlash) {
+    memcpy_P(this->_ringBuffer + this->_ringHead, data, firstPart);
+    memcpy_P(this->_ringBuffer, data + firstPart, length - firstPart);
+  } else {
+    memcpy(this->_ringBuffer + this->_ringHead, data, firstPart);
+    memcpy(this->_ringBuffer, data + firstPart, length - firstPart);
+  }
+  this->_ringHead = (this->_ringHead + length) % this->_ringSize;
+  this->_ringUsed += length;
+}
+
+// Read byte at offset from ring buffer tail
+uint8_t Syslog::_ringPeek(uint16_t offset) {
+  return this->_ringBuffer[(this->_ringTail + offset) % this->_ringSize];
+}
+
+// Queue a message into ring buffer, dropping it if there's not enough room
+bool Syslog::_queueLog(uint16_t pri, const char *message, bool isFlash) {
+  size_t length = isFlash ? strlen_P(message) : strlen(message);
+
+  if (length + 4 > (size_t) (this->_ringSize - this->_ringUsed)) {
+    this->_droppedCount++;
+    return false;
+  }
+
+  uint8_t header[4] = {(uint8_t) (pri & 0xFF), (uint8_t) (pri >> 8), (uint8_t) (length & 0xFF), (uint8_t) (length >> 8)};
+  this->_ringPut(header, 4, false);
+  this->_ringPut((const uint8_t*) message, length, isFlash);
+  // Message will be sent soon, don't trigger keep alive
+  this->lastSyslogMillis = millis();
+  return true;
+}
+// *** FF_CHANGE ***
+
+inline bool Syslog::_sendLog(uint16_t pri, const char *message) {
+  if ((this->_server == NULL && this->_ip == INADDR_NONE) || this->_port == 0)
+    return false;
+
+  // Check priority against priMask values.
+  // *** FF_CHANGE ***
+  if ((LOG_MASK(LOG_PRI(pri)) & this->_priMask) == 0)
+    return true;
+  // *** FF_CHANGE ***
+
+  // Set default facility if none specified.
+  if ((pri & LOG_FACMASK) == 0)
+    pri = LOG_MAKEPRI(LOG_FAC(this->_priDefault), pri);
+
+  // *** FF_CHANGE ***
+  if (this->_ringBuffer != NULL)
+    return this->_queueLog(pri, message, false);
+
+  if (this->_formatBuffer != NULL)
+    return this->_sendStatic(pri, message, false);
+
+  if (!this->_beginPacket(pri))
+    return false;
+  // *** FF_CHANGE ***
+
   this->_client->print(message);
   this->_client->endPacket();
   // *** FF_CHANGE ***
@@ -235,8 +502,6 @@ inline bool Syslog::_sendLog(uint16_t pri, const char *message) {
 }
 
 inline bool Syslog::_sendLog(uint16_t pri, const __FlashStringHelper *message) {
-  int result;
-
   if ((this->_server == NULL && this->_ip == INADDR_NONE) || this->_port == 0)
     return false;
 
@@ -248,32 +513,17 @@ inline bool Syslog::_sendLog(uint16_t pri, const __FlashStringHelper *message) {
   if ((pri & LOG_FACMASK) == 0)
     pri = LOG_MAKEPRI(LOG_FAC(this->_priDefault), pri);
 
-  if (this->_server != NULL) {
-    result = this->_client->beginPacket(this->_server, this->_port);
-  } else {
-    result = this->_client->beginPacket(this->_ip, this->_port);
-  }
+  // *** FF_CHANGE ***
+  if (this->_ringBuffer != NULL)
+    return this->_queueLog(pri, (const char*) message, true);
 
-  if (result != 1)
+  if (this->_formatBuffer != NULL)
+    return this->_sendStatic(pri, (const char*) message, true);
+
+  if (!this->_beginPacket(pri))
     return false;
+  // *** FF_CHANGE ***
 
-  // IETF Doc: https://tools.ietf.org/html/rfc5424
-  // BSD Doc: https://tools.ietf.org/html/rfc3164
-  this->_client->print('<');
-  this->_client->print(pri);
-  if (this->_protocol == SYSLOG_PROTO_IETF) {
-    this->_client->print(F(">1 - "));
-  } else {
-    this->_client->print(F(">"));
-  }
-  this->_client->print(this->_deviceHostname);
-  this->_client->print(' ');
-  this->_client->print(this->_appName);
-  if (this->_protocol == SYSLOG_PROTO_IETF) {
-    this->_client->print(F(" - - - \xEF\xBB\xBF"));
-  } else {
-    this->_client->print(F("[0]: "));
-  }
   this->_client->print(message);
   this->_client->endPacket();
   // *** FF_CHANGE ***
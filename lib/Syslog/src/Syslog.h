@@ -95,9 +95,58 @@ class Syslog {
     bool _sendLog(uint16_t pri, const char *message);
     bool _sendLog(uint16_t pri, const __FlashStringHelper *message);
 
+  // *** FF_CHANGE ***
+    // Asynchronous mode: messages are queued in a caller supplied ring buffer as
+    //  [pri (2 bytes)][length (2 bytes)][message], and sent later by loop()
+    uint8_t* _ringBuffer = NULL;
+    uint16_t _ringSize = 0;
+    uint16_t _ringHead = 0;
+    uint16_t _ringTail = 0;
+    uint16_t _ringUsed = 0;
+    uint16_t _ringInterval = 0;
+    uint8_t _ringMaxPackets = 1;
+    uint16_t _ringMaxBytes = 0;
+    unsigned long _ringLastSend = 0;
+    unsigned long _droppedCount = 0;
+
+    bool _beginPacket(uint16_t pri);
+    bool _queueLog(uint16_t pri, const char *message, bool isFlash);
+    void _ringPut(const uint8_t *data, uint16_t length, bool isFlash);
+    uint8_t _ringPeek(uint16_t offset);
+
+    // Static mode: messages are formatted (with their header) into a caller supplied buffer, without heap
+    char* _formatBuffer = NULL;
+    uint16_t _formatSize = 0;
+    unsigned long _truncatedCount = 0;
+
+    uint16_t _buildHeader(uint16_t pri);
+    uint16_t _truncate(char *message, uint16_t room, int length);
+    bool _sendStatic(uint16_t pri, const char *message, bool isFlash);
+    bool _vlogfStatic(uint16_t pri, const char *fmt, va_list args, bool isFlash);
+    bool _sendPacket(uint16_t length);
+  // *** FF_CHANGE ***
+
   public:
   // *** FF_CHANGE ***
     unsigned long lastSyslogMillis = 0;
+
+    // Switch to asynchronous mode, queuing messages into buffer (NULL to go back to synchronous mode)
+    Syslog &buffer(uint8_t* buffer, uint16_t size);
+    // Set minimal interval (ms) between two packets and maximum packets/bytes sent by each loop() call (0 = no byte limit)
+    Syslog &pacing(uint16_t interval, uint8_t maxPackets = 1, uint16_t maxBytes = 0);
+    // Send queued messages, within pacing limits. Returns true if queue is empty
+    bool loop();
+    // Count of messages dropped because buffer was full
+    unsigned long droppedCount();
+    // Count of bytes waiting in buffer
+    uint16_t pendingBytes();
+    // Time (ms) from which loop() may send next queued message (now if it may send it at once)
+    unsigned long nextSendMillis();
+
+    // Format messages into buffer instead of heap, truncating them to fit (NULL to go back to heap)
+    Syslog &formatBuffer(char* buffer, uint16_t size);
+    // Count of messages truncated to fit into format buffer
+    unsigned long truncatedCount();
   // *** FF_CHANGE ***
 
     Syslog(UDP &client, uint8_t protocol = SYSLOG_PROTO_IETF);
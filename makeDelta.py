@@ -0,0 +1,60 @@
+#   Make a FF_ShellyMilight delta image (see PULL_OTA_TOPIC)
+#
+#   Usage: python makeDelta.py old_firmware.bin new_firmware.bin output.delta
+#
+#   Old image should be the one running on module (delta copies its bytes). Prints MD5 of new image, to be
+#       sent with delta url (module checks new image, not delta, after applying it).
+#
+#   Delta layout is described in lib/PullUpdate/src/PullUpdate.h: "FFD1", new image size, then copy operations
+#       ('C', offset, length) of old image blocks found in new image, and literal operations ('L', length, bytes)
+#       for the rest (integers are little endian).
+
+import hashlib
+import struct
+import sys
+
+BLOCK_SIZE = 32                                             # Size of blocks searched in old image
+MIN_COPY = 64                                               # Shorter matches are sent as literal bytes
+
+if len(sys.argv) != 4:
+    print('Usage: python makeDelta.py old_firmware.bin new_firmware.bin output.delta')
+    exit(1)
+old = open(sys.argv[1], 'rb').read()
+new = open(sys.argv[2], 'rb').read()
+
+# Index old image blocks, at all offsets (first offset kept for each block)
+blocks = {}
+for offset in range(len(old) - BLOCK_SIZE + 1):
+    blocks.setdefault(old[offset:offset + BLOCK_SIZE], offset)
+
+delta = bytearray(b'FFD1' + struct.pack('<I', len(new)))
+literal = bytearray()
+copied = 0
+
+# Flush pending literal bytes
+def flushLiteral():
+    if literal:
+        delta.extend(b'L' + struct.pack('<I', len(literal)) + literal)
+        literal.clear()
+
+position = 0
+while position < len(new):
+    offset = blocks.get(new[position:position + BLOCK_SIZE])
+    length = 0
+    if offset is not None:
+        # Extend match as far as possible
+        while position + length < len(new) and offset + length < len(old) and new[position + length] == old[offset + length]:
+            length += 1
+    if length >= MIN_COPY:
+        flushLiteral()
+        delta.extend(b'C' + struct.pack('<II', offset, length))
+        position += length
+        copied += length
+    else:
+        literal.append(new[position])
+        position += 1
+flushLiteral()
+
+open(sys.argv[3], 'wb').write(delta)
+print('%d bytes delta for %d bytes image (%d bytes copied from old one)' % (len(delta), len(new), copied))
+print('New image MD5: '+hashlib.md5(new).hexdigest())
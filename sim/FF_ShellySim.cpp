@@ -0,0 +1,1034 @@
+/*
+  FF_ShellySim.cpp - Native simulation and benchmarks of FF_ShellyMilight.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Firmware (with its src/FF_Shelly.h settings) is built for host against mocks of sim/mock,
+  with a simulated board (SimBoard) and network (SimNetwork). It then runs scripted scenarios
+  and microbenchmarks, giving for each:
+    - loop() duration on host (average and maximum),
+    - heap used at end of scenario (simulation structures included),
+    - TCP writes and syslog packets sent,
+    - checks of bulb/relay/hub states, reported as FAILED when not met.
+
+  Usage: program [-v] [-n] [-b] [-s scenario]
+    -v: print syslog traces and MQTT traffic
+    -n: don't run benchmarks
+    -b: only run benchmarks (after boot)
+    -s: only run this scenario (after boot)
+
+  Note that host unsigned long is usually 64 bits, so millis() and micros() don't wrap around.
+*/
+
+// Firmware itself
+#include "../src/FF_ShellyMilight.cpp"
+
+#include <chrono>
+#include <Syslog.h>
+#include "SimBoard.h"
+#include "SimNetwork.h"
+#include "SimRadio.h"
+
+// SIM_LOOP_PERIOD : virtual time between two loop() calls (us)
+#define SIM_LOOP_PERIOD 1000
+// SIM_BOUNCE_TIME : virtual time between two bounce edges (us)
+#define SIM_BOUNCE_TIME 300
+
+// Button gives a push on each edge, or only on one of them
+#if defined(BUTTON_HIGH_TO_LOW) && defined(BUTTON_LOW_TO_HIGH)
+  #define PUSHES_PER_FLIP(x) (x)
+#else
+  #define PUSHES_PER_FLIP(x) ((x) / 2)
+#endif
+
+// Loop durations of a scenario
+struct loopStats {
+  unsigned long loops = 0;                                  // Count of loop() calls
+  uint64_t totalNs = 0;                                     // Total duration (host ns)
+  uint64_t maxNs = 0;                                       // Longest loop (host ns)
+};
+
+loopStats scenarioStats;                                    // Stats of current scenario
+unsigned long scenarioFailures = 0;                         // Failed checks of current scenario
+unsigned long totalFailures = 0;                            // Failed checks of all scenarios
+
+// Host time (ns)
+uint64_t hostNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Run firmware loop for a virtual duration (ms)
+void simRun(unsigned long ms) {
+  uint64_t end = simBoard.time + (uint64_t) ms * 1000;
+  while (simBoard.time < end) {
+    uint64_t start = hostNs();
+    loop();
+    uint64_t duration = hostNs() - start;
+    scenarioStats.loops++;
+    scenarioStats.totalNs += duration;
+    if (duration > scenarioStats.maxNs) {
+      scenarioStats.maxNs = duration;
+    }
+    simBoard.advance(SIM_LOOP_PERIOD);
+  }
+}
+
+// Flip a channel switch, with some bounces (edges are captured between loop() calls)
+void simFlip(uint8_t channel, uint8_t bounces = 0) {
+  uint8_t pin = channels[channel].buttonPin;
+  uint8_t level = simBoard.pinLevel[pin];
+  for (uint8_t i = 0; i < bounces; i++) {
+    simBoard.setInput(pin, !level);
+    simBoard.advance(SIM_BOUNCE_TIME);
+    simBoard.setInput(pin, level);
+    simBoard.advance(SIM_BOUNCE_TIME);
+  }
+  simBoard.setInput(pin, !level);
+}
+
+// Push a channel button once (switch is flipped twice if only one edge gives a push)
+void simPush(uint8_t channel) {
+  simFlip(channel);
+  #if !defined(BUTTON_HIGH_TO_LOW) || !defined(BUTTON_LOW_TO_HIGH)
+    simRun(100);
+    simFlip(channel);
+  #endif
+}
+
+// Check a condition, giving message if not met
+void simCheck(bool condition, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void simCheck(bool condition, const char* format, ...) {
+  if (condition) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  printf("    FAILED at %lu ms: ", millis());
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+  scenarioFailures++;
+}
+
+// Check that hub, bulb and relay agree for all channels
+void simCheckSynced(const char* when) {
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    simCheck(simNetwork.bulbOn(i) == channels[i].bulbOn, "%s: channel %d hub bulb is %s, internal state %s",
+      when, i, simNetwork.bulbOn(i) ? "ON" : "OFF", channels[i].bulbOn ? "ON" : "OFF");
+    simCheck(!channels[i].bulbOn || channels[i].relayOn, "%s: channel %d bulb is ON but relay is OFF", when, i);
+    simCheck(channels[i].relayState == RELAY_IDLE, "%s: channel %d relay state is %d, not idle", when, i, channels[i].relayState);
+  }
+}
+
+// Make local radio (if any) unusable, for bypass to use relay
+void simRadioPresent(bool present) {
+  #ifdef MILIGHT_RADIO_CS_PIN
+    simRadio.present = present;
+  #else
+    (void) present;
+  #endif
+}
+
+// Sum of a channel stat
+long simPushLost() {
+  long count = 0;
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    count += channels[i].pushLost;
+  }
+  return count;
+}
+
+// Boot module, until MQTT is connected
+void scenarioBoot() {
+  simRun(10000);
+  simCheck(WiFi.status() == WL_CONNECTED, "WiFi not connected");
+  simCheck(mqttClient.connected() && simNetwork.mqttConnected(), "MQTT not connected");
+  simCheckSynced("after boot");
+}
+
+#ifdef PREDICTIVE_RELAY
+// Bulb turned on while relay is off: relay should be powered at once, then confirmed, rolled back or bypassed
+void scenarioPredictive() {
+  if (channels[0].relayOn) {
+    printf("    skipped, relay already on\n");
+    return;
+  }
+  simRadioPresent(false);
+  // Confirmed by ack
+  simPush(0);
+  simRun(25);
+  simCheck(channels[0].bulbOn && channels[0].relayOn, "relay not powered at once");
+  simRun(2000);
+  simCheckSynced("after confirmation");
+  // Turned off without ack, relay is turned off by bypass, then resynchronized by a state message
+  simNetwork.hubUp = false;
+  simPush(0);
+  simRun(COMMAND_TIMEOUT_MAX + 500);
+  simCheck(!channels[0].relayOn, "relay still on in bypass");
+  simNetwork.hubUp = true;
+  simNetwork.publishState(0, false);
+  simRun(2000);
+  simCheckSynced("after resync");
+  // Rejected by an OFF state (bulb turned off by another remote)
+  long rollbacks = predictRollback;
+  simNetwork.hubUp = false;
+  simPush(0);
+  simRun(25);
+  simCheck(channels[0].relayOn, "relay not powered at once");
+  simNetwork.publishState(0, false);
+  simRun(50);
+  simCheck(predictRollback == rollbacks + 1, "prediction not rolled back");
+  simCheck(!channels[0].bulbOn && !channels[0].relayOn, "bulb or relay still on after rollback");
+  // Not acknowledged in time: bypass, relay kept on, then resynchronized by a state message
+  simPush(0);
+  simRun(COMMAND_TIMEOUT_MAX + 500);
+  simCheck(channels[0].relayState == RELAY_BYPASS && channels[0].relayOn, "relay not kept on in bypass");
+  simNetwork.hubUp = true;
+  simNetwork.publishState(0, false);
+  simRun(2000);
+  simCheckSynced("after resync");
+  simRadioPresent(true);
+}
+#endif
+
+// Normal use: switch flips, acknowledged in time
+void scenarioPresses() {
+  long lost = simPushLost();
+  for (uint8_t i = 0; i < 10; i++) {
+    simPush(i % CHANNEL_COUNT);
+    simRun(2000);
+    simCheckSynced("after flip");
+  }
+  simCheck(simPushLost() == lost, "%ld pushes lost", simPushLost() - lost);
+}
+
+#ifdef DEVICE_SHADOW_TOPIC
+// Device shadow: retained, sent only on changes (with changed counters only), at most once per interval
+void scenarioShadow() {
+  simRun(DEVICE_SHADOW_INTERVAL);
+  simCheck(simNetwork.retained(DEVICE_SHADOW_TOPIC) != NULL, "no retained shadow");
+  // Nothing sent while idle
+  unsigned long sent = simNetwork.retainedPublishCount;
+  simRun(5 * DEVICE_SHADOW_INTERVAL);
+  simCheck(simNetwork.retainedPublishCount == sent, "%lu shadows sent while idle", simNetwork.retainedPublishCount - sent);
+  // Pushes in a row are grouped
+  unsigned long start = millis();
+  for (uint8_t i = 0; i < 10; i++) {
+    simPush(0);
+    simRun(DEVICE_SHADOW_INTERVAL / 4);
+  }
+  simRun(DEVICE_SHADOW_INTERVAL + 2000);
+  unsigned long maxSent = (millis() - start) / DEVICE_SHADOW_INTERVAL + 1;
+  simCheck(simNetwork.retainedPublishCount - sent <= maxSent, "%lu shadows sent, more than %lu",
+    simNetwork.retainedPublishCount - sent, maxSent);
+  simCheckSynced("after pushes");
+  // Last shadow gives current states, and only changed counters
+  const char* shadow = simNetwork.retained(DEVICE_SHADOW_TOPIC);
+  if (!shadow) {
+    return;
+  }
+  long bulbOn[CHANNEL_COUNT];
+  long relayOn[CHANNEL_COUNT];
+  if (!shadowParse(shadow, "bulbOn", bulbOn) || !shadowParse(shadow, "relayOn", relayOn)) {
+    simCheck(false, "states not in shadow %s", shadow);
+    return;
+  }
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    simCheck(bulbOn[i] == channels[i].bulbOn && relayOn[i] == channels[i].relayOn, "channel %d states don't match shadow %s", i, shadow);
+  }
+  simCheck(strstr(shadow, "pushCount") && !strstr(shadow, "networkLost"), "unexpected counters in shadow %s", shadow);
+}
+#endif
+
+#ifdef MILIGHT_RADIO_CS_PIN
+// Hub down while bulb is powered: commands are sent by local radio, relay staying on
+void scenarioRadio() {
+  // Power bulb
+  if (!channels[0].relayOn) {
+    simPush(0);
+    simRun(2000);
+  }
+  simNetwork.hubUp = false;
+  unsigned long sent = radio.sentCount();
+  unsigned long packets = simRadio.packetCount;
+  simPush(0);
+  simRun(COMMAND_TIMEOUT_MAX + 500);
+  simCheck(channels[0].relayState == RELAY_RADIO && channels[0].relayOn, "not in radio mode with relay on");
+  simCheck(radio.sentCount() == sent + 1, "%lu commands sent by radio", radio.sentCount() - sent);
+  simCheck(channels[0].relayOn, "relay turned off in radio mode");
+  // Next pushes are sent at once (one radio transmission per loop)
+  for (uint8_t i = 0; i < 3; i++) {
+    simPush(0);
+    simRun(100);
+    simCheck(radio.sentCount() == sent + 2 + i && channels[0].relayOn, "push %d not sent by radio", i);
+    simRun(950);
+  }
+  simCheck(simRadio.packetCount - packets == 4 * 3 * MILIGHT_RADIO_REPEATS, "%lu radio packets sent", simRadio.packetCount - packets);
+  simCheck(simRadio.packet[0] == MILIGHT_PACKET_LENGTH, "radio packet length is %d", simRadio.packet[0]);
+  // Radio stops answering, relay is used as last resort
+  simRadioPresent(false);
+  simPush(0);
+  simRun(2000);
+  simCheck(channels[0].relayState == RELAY_BYPASS && channels[0].relayOn == channels[0].bulbOn, "relay not bypassed without radio");
+  simRadioPresent(true);
+  // Hub back, resynchronized by a state message
+  simNetwork.hubUp = true;
+  simNetwork.publishState(0, !channels[0].bulbOn);
+  simRun(2000);
+  simCheckSynced("after resync");
+}
+#endif
+
+#ifdef ESPNOW_PEERS
+// Give a first channel bulb state from a peer
+void simPeerPush(uint16_t generation, bool bulbOn) {
+  peerMessage message = {PEER_MAGIC, channels[0].peerBulb, generation, bulbOn, 0};
+  simNetwork.espnowReceive((uint8_t*) &message, sizeof(message));
+  simRun(5);
+}
+
+// Peer sharing first channel bulb: our pushes are sent to it, its newer ones are followed at once
+void scenarioPeers() {
+  unsigned long frames = simNetwork.espnowCount;
+  simPush(0);
+  simRun(2000);
+  peerMessage sent;
+  memcpy(&sent, simNetwork.espnowFrame, sizeof(sent));
+  simCheck(simNetwork.espnowCount == frames + 1 && sent.magic == PEER_MAGIC && sent.bulb == channels[0].peerBulb
+    && sent.bulbOn == channels[0].bulbOn, "push not sent to peers");
+  simCheckSynced("after push");
+  // Peer push, then peer command ack
+  bool newState = !channels[0].bulbOn;
+  simPeerPush(sent.generation + 1, newState);
+  simCheck(channels[0].bulbOn == newState && (!newState || channels[0].relayOn), "peer state not followed");
+  simNetwork.publishState(0, newState);
+  simRun(2000);
+  simCheckSynced("after peer push");
+  // Older state ignored
+  simPeerPush(sent.generation, !newState);
+  simCheck(channels[0].bulbOn == newState, "older peer state followed");
+  // Pushes at the same time here and on peer, ON wins on both sides
+  for (uint8_t i = 0; i < 2; i++) {
+    simPush(0);
+    simRun(25);
+    bool pushed = channels[0].bulbOn;
+    simPeerPush(channels[0].peerGeneration, !pushed);
+    simCheck(channels[0].bulbOn, "OFF won against ON");
+    simRun(2000);
+    simCheckSynced("after simultaneous pushes");
+  }
+  // Broker down, relay follows peer states
+  simRadioPresent(false);
+  simNetwork.setBroker(false);
+  simRun(2000);
+  for (uint8_t i = 0; i < 2; i++) {
+    simPeerPush(channels[0].peerGeneration + 1, !channels[0].bulbOn);
+    simRun(COMMAND_TIMEOUT_MAX + DISCHARGE_TIME + 500);
+    simCheck(channels[0].relayOn == channels[0].bulbOn, "relay not following peer while broker is down");
+  }
+  simNetwork.setBroker(true);
+  simRadioPresent(true);
+  simRun(MQTT_RETRY_MAX + 10000);
+  simCheckSynced("after reconnection");
+}
+#endif
+
+// Hub answers later than timeout: relay should be bypassed, then resynchronized
+void scenarioSlowAcks() {
+  long lost = simPushLost();
+  unsigned long ackDelay = simNetwork.ackDelay;
+  simRadioPresent(false);
+  simNetwork.ackDelay = COMMAND_TIMEOUT_MAX + 1000;
+  simPush(0);
+  simRun(commandTimeout + DISCHARGE_TIME + 500);
+  simCheck(simPushLost() > lost, "no push lost with late ack");
+  simCheck(channels[0].relayOn == channels[0].bulbOn, "relay not bypassed");
+  // Back to normal
+  simNetwork.ackDelay = ackDelay;
+  simRadioPresent(true);
+  simRun(20000);
+  simCheckSynced("after late acks");
+}
+
+// Broker down for a while, with flips meanwhile
+void scenarioBrokerDrop() {
+  long lost = mqttLost;
+  simRadioPresent(false);
+  simNetwork.setBroker(false);
+  simRun(2000);
+  simCheck(!mqttClient.connected(), "MQTT still connected");
+  simPush(0);
+  simRun(COMMAND_TIMEOUT_MAX + DISCHARGE_TIME + 500);
+  simCheck(channels[0].relayOn == channels[0].bulbOn, "relay not bypassed while broker is down");
+  simPush(0);
+  simRun(20000);
+  simNetwork.setBroker(true);
+  simRadioPresent(true);
+  simRun(MQTT_RETRY_MAX + 10000);
+  simCheck(mqttClient.connected(), "MQTT not reconnected");
+  simCheck(mqttLost > lost, "MQTT loss not counted");
+  simCheckSynced("after reconnection");
+}
+
+#ifdef MQTT_QUEUE_SIZE
+// Command queued while broker is down is replayed at reconnection, older states received before its ack are ignored
+void scenarioQueueReplay() {
+  simRadioPresent(false);
+  simNetwork.publishState(0, true);
+  simRun(1000);
+  simCheck(channels[0].bulbOn, "hub state not received");
+  simNetwork.setBroker(false);
+  simRun(2000);
+  simPush(0);
+  simRun(COMMAND_TIMEOUT_MAX + DISCHARGE_TIME + 500);
+  simCheck(!channels[0].bulbOn && !channels[0].relayOn, "bulb not turned off while broker is down");
+  // Broker sends retained ON state at subscription, before hub acks queued OFF command
+  simNetwork.setBroker(true);
+  simRadioPresent(true);
+  bool flashed = false;
+  for (unsigned long i = 0; i < MQTT_RETRY_MAX + 10000; i += 10) {
+    simRun(10);
+    flashed = flashed || channels[0].bulbOn || channels[0].relayOn;
+  }
+  simCheck(mqttClient.connected(), "MQTT not reconnected");
+  simCheck(!flashed, "bulb turned on by retained state older than replayed command");
+  simCheck(!simNetwork.bulbOn(0), "replayed command not received by hub");
+  simCheckSynced("after replay");
+}
+#endif
+
+// Bouncing flips, then flips while loop is stalled
+void scenarioButtonStorm() {
+  long pushes = channels[0].pushCount;
+  for (uint8_t i = 0; i < 40; i++) {
+    simFlip(0, 5);
+    simRun(100);
+  }
+  #ifdef BUTTON_INTERRUPT
+    // Loop stalled (flips captured by interrupt only)
+    for (uint8_t i = 0; i < 10; i++) {
+      simFlip(0);
+      simBoard.advance(50000);
+    }
+  #endif
+  simRun(5000);
+  #ifdef BUTTON_INTERRUPT
+    simCheck(channels[0].pushCount - pushes == PUSHES_PER_FLIP(50), "%ld pushes for %d flips", channels[0].pushCount - pushes, 50);
+  #else
+    simCheck(channels[0].pushCount - pushes == PUSHES_PER_FLIP(40), "%ld pushes for %d flips", channels[0].pushCount - pushes, 40);
+  #endif
+  simCheckSynced("after storm");
+}
+
+// TCP data received a few bytes at a time
+void scenarioPartialReads() {
+  long lost = simPushLost();
+  simNetwork.chunkSize = 1;
+  simNetwork.chunkInterval = 500;
+  for (uint8_t i = 0; i < 10; i++) {
+    simPush(0);
+    simRun(2000);
+    simCheckSynced("after flip");
+  }
+  simNetwork.chunkSize = 0;
+  simCheck(simPushLost() == lost, "%ld pushes lost", simPushLost() - lost);
+}
+
+// Access point lost for a while, with a flip meanwhile
+void scenarioWifiDrop() {
+  long lost = networkLost;
+  simRadioPresent(false);
+  simNetwork.setAccessPoint(false);
+  simRun(1000);
+  simPush(0);
+  simRun(COMMAND_TIMEOUT_MAX + DISCHARGE_TIME + 500);
+  simCheck(channels[0].relayOn == channels[0].bulbOn, "relay not bypassed while WiFi is down");
+  simRun(10000);
+  simNetwork.setAccessPoint(true);
+  simRadioPresent(true);
+  simRun(MQTT_RETRY_MAX + 30000);
+  simCheck(WiFi.status() == WL_CONNECTED, "WiFi not reconnected");
+  simCheck(mqttClient.connected(), "MQTT not reconnected");
+  simCheck(networkLost > lost, "network loss not counted");
+  simCheckSynced("after reconnection");
+}
+
+#ifdef POWER_SAVE
+// Power save: module sleeps while idle, keeping MQTT connection, without delaying button
+void scenarioPowerSave() {
+  // Idle for a few keep alive intervals
+  long lost = mqttLost;
+  unsigned long slept = sleptMillis;
+  unsigned long start = millis();
+  simRun(3 * MQTT_KEEPALIVE * 1000);
+  unsigned long idle = millis() - start;
+  simCheck(sleptMillis - slept >= idle * 9 / 10, "slept only %lu ms out of %lu ms", sleptMillis - slept, idle);
+  simCheck(mqttClient.connected() && mqttLost == lost, "MQTT connection lost while sleeping");
+  // Button is seen at end of debounce, as when loop doesn't sleep
+  for (uint8_t i = 0; i < 4; i++) {
+    long pushes = channels[0].pushCount;
+    simRun(500);
+    unsigned long flip = millis();
+    simFlip(0, 3);
+    while (channels[0].pushCount == pushes && (millis() - flip) < 100) {
+      simRun(1);
+    }
+    // (command is sent by the loop seeing push, before it sleeps)
+    #if defined(BUTTON_HIGH_TO_LOW) && defined(BUTTON_LOW_TO_HIGH)
+      unsigned long latency = channels[0].lastMqttCommandSent - flip;
+      simCheck(channels[0].pushCount != pushes && latency <= 23, "push seen after %lu ms", latency);
+    #endif
+    simRun(2000);
+    simCheckSynced("after flip");
+  }
+}
+#endif
+
+#ifdef TELEMETRY_HOST
+// Telemetry frames are sent periodically, with counters since boot
+void scenarioTelemetry() {
+  // Wait for next frame
+  unsigned long frames = simNetwork.udpCount;
+  unsigned long start = millis();
+  while (simNetwork.udpCount == frames && (millis() - start) < TELEMETRY_INTERVAL * 2) {
+    simRun(1);
+  }
+  telemetryFrame first;
+  memcpy(&first, simNetwork.udpFrame, sizeof(first));
+  simCheck(simNetwork.udpCount != frames && simNetwork.udpLength == sizeof(first), "no telemetry frame sent");
+  frames = simNetwork.udpCount;
+  simCheck(first.magic == TELEMETRY_MAGIC && first.version == TELEMETRY_VERSION && first.channelCount == CHANNEL_COUNT,
+    "bad telemetry header");
+  simCheck(first.uptime == millis() / 1000, "bad uptime %lu", (unsigned long) first.uptime);
+  // Pushes are counted in next frame
+  for (uint8_t i = 0; i < 3; i++) {
+    simPush(0);
+    simRun(2000);
+  }
+  simRun(TELEMETRY_INTERVAL - 6000 + 100);
+  telemetryFrame second;
+  memcpy(&second, simNetwork.udpFrame, sizeof(second));
+  simCheck(simNetwork.udpCount == frames + 1 && second.sequence == first.sequence + 1, "telemetry frame lost");
+  simCheck(second.pushCount == first.pushCount + 3, "pushes not counted (%ld then %ld)", (long) first.pushCount,
+    (long) second.pushCount);
+  simCheck(second.loopCount > first.loopCount && second.loopMicros >= first.loopMicros, "loops not measured");
+  #ifdef LATENCY_TOPIC
+    uint32_t published = 0;
+    for (uint8_t i = 0; i < TELEMETRY_LATENCY_BUCKETS; i++) {
+      published += second.latency[0][i] - first.latency[0][i];
+    }
+    simCheck(published == 3, "%lu press to publish latencies instead of 3", (unsigned long) published);
+  #endif
+  simCheckSynced("after pushes");
+}
+#endif
+
+#ifdef PERSIST_FLASH
+// Clear states and counters, as after a power loss (RTC memory is random)
+void simPowerLoss() {
+  persistedState cleared;
+  memset(&cleared, 0, sizeof(cleared));
+  persistSet(cleared);
+  memset(simBoard.rtcMemory, 0x5a, sizeof(simBoard.rtcMemory));
+  persistSequence = 0;
+  persistSlot = 0;
+}
+
+// States and counters are written to flash log and restored after power loss
+void scenarioPersist() {
+  // State change is written after PERSIST_STATE_DELAY, with the ones done meanwhile
+  unsigned long writes = persistWrites;
+  simPush(0);
+  simRun(PERSIST_STATE_DELAY / 2);
+  simPush(0);
+  simRun(PERSIST_STATE_DELAY / 2 + 100);
+  simCheck(persistWrites == writes + 1, "%lu flash log writes instead of 1", persistWrites - writes);
+  simPush(0);
+  simRun(PERSIST_STATE_DELAY + 2000);
+  simCheckSynced("after pushes");
+  persistedState before;
+  persistGet(before);
+  // Warm reset: RTC memory is kept
+  simCheck(rtcStateLoad(), "RTC state not found");
+  // Cold boot: RTC memory is lost, flash log is kept
+  simPowerLoss();
+  simCheck(!rtcStateLoad(), "random RTC memory accepted");
+  simCheck(persistFlashLoad(true), "flash log not restored");
+  persistedState after;
+  persistGet(after);
+  simCheck(!memcmp(&before, &after, sizeof(before)), "flash log states differ (bulb %d/%d, relay %d/%d, pushCount %ld/%ld)",
+    before.bulbOn, after.bulbOn, before.relayOn, after.relayOn, (long) before.pushCount[0], (long) after.pushCount[0]);
+  // Counters alone are written at PERSIST_STATS_INTERVAL, over several sectors
+  unsigned long erases = 0;
+  for (uint32_t i = 0; i < PERSIST_FLASH_SECTORS * PERSIST_SLOTS + 10; i++) {
+    channels[0].pushLost++;
+    persistTask(TASK_PERSIST);
+  }
+  for (uint8_t i = 0; i < PERSIST_FLASH_SECTORS; i++) {
+    erases = max(erases, simBoard.flashErases[i]);
+  }
+  simCheck(erases <= 3, "a log sector has been erased %lu times", erases);
+  persistGet(before);
+  simPowerLoss();
+  simCheck(persistFlashLoad(true) && channels[0].pushLost == before.pushLost[0], "last counters not restored after sectors wrap");
+  // Record interrupted by a power loss is ignored (previous one is restored)
+  uint32_t slot = persistSlot;
+  channels[0].pushLost++;
+  persistTask(TASK_PERSIST);
+  simBoard.flash[(slot / PERSIST_SLOTS) * FLASH_SECTOR_SIZE + (slot % PERSIST_SLOTS) * sizeof(persistRecord) + offsetof(persistRecord, crc)] = 0;
+  simPowerLoss();
+  simCheck(persistFlashLoad(true) && channels[0].pushLost == before.pushLost[0], "interrupted record restored");
+  // Next one is written after it
+  channels[0].pushLost++;
+  persistTask(TASK_PERSIST);
+  simPowerLoss();
+  simCheck(persistFlashLoad(true) && channels[0].pushLost == before.pushLost[0] + 1, "record after interrupted one not restored");
+  simRun(2000);
+  simCheckSynced("after restore");
+}
+#endif
+
+#ifdef POWER_TOPIC
+// Run firmware loop for a virtual duration (ms), BL0937 giving pulses of a load of this power (W) while relay is on
+void simRunLoad(unsigned long ms, long watts) {
+  static unsigned long energy = 0;                          // Energy not yet given as a pulse (mWs)
+  unsigned long end = millis() + ms;
+  while (millis() < end) {
+    unsigned long start = millis();
+    bool relayOn = channels[0].relayOn;
+    simRun(10);
+    if (relayOn) {
+      energy += watts * (millis() - start);
+    }
+    while (energy >= POWER_PULSE_ENERGY) {
+      energy -= POWER_PULSE_ENERGY;
+      simBoard.setInput(POWER_PIN, HIGH);
+      simBoard.setInput(POWER_PIN, LOW);
+    }
+  }
+}
+
+// Powered bulb not lit (burnt-out bulb, failed bypass power cycle) is reported once, after power settles
+void scenarioPower() {
+  simRadioPresent(false);
+  if (!channels[0].bulbOn) {
+    simPush(0);
+  }
+  simRunLoad(POWER_SETTLE_TIME + 2000, 7);
+  simCheck(channels[0].bulbOn && channels[0].relayOn && bulbLit, "bulb not lit");
+  long notLit = bulbNotLit;
+  // Bulb burns out
+  simRunLoad(POWER_SETTLE_TIME + 20000, 0);
+  simCheck(bulbNotLit == notLit + 1, "burnt-out bulb reported %ld times instead of once", bulbNotLit - notLit);
+  // Bypass power cycle (relay already on) lights bulb
+  simPush(0);
+  simRunLoad(2000, 7);
+  simNetwork.hubUp = false;
+  simPush(0);
+  simRunLoad(COMMAND_TIMEOUT_MAX + DISCHARGE_TIME + POWER_SETTLE_TIME + 2000, 7);
+  simCheck(channels[0].relayState == RELAY_BYPASS && channels[0].relayOn && !powerBypassCheck, "bypass power cycle not checked");
+  simCheck(bulbNotLit == notLit + 1, "lit bulb reported as not lit after bypass power cycle");
+  // Bulb already burnt-out when relay is switched on
+  simPush(0);
+  simRunLoad(2000, 0);
+  simPush(0);
+  simRunLoad(POWER_SETTLE_TIME / 2, 0);
+  simCheck(bulbNotLit == notLit + 1, "bulb checked before power settled");
+  simRunLoad(POWER_SETTLE_TIME, 0);
+  simCheck(bulbNotLit == notLit + 2, "burnt-out bulb not reported at relay switch on");
+  // Hub back, resynchronized by a state message
+  simNetwork.hubUp = true;
+  simRadioPresent(true);
+  simNetwork.publishState(0, !channels[0].bulbOn);
+  simRunLoad(2000, 7);
+  simCheckSynced("after resync");
+}
+#endif
+
+#ifdef PULL_OTA_TOPIC
+// Send an update request, then run until update ends (without restarting). Returns final state
+PullUpdate::State simPullOta(const char* path, const uint8_t* image, size_t size, const char* md5, unsigned long maxMs) {
+  char request[128];
+  snprintf(request, sizeof(request), "{\"url\":\"http://192.168.1.10:%u%s\",\"md5\":\"%s\"}", simNetwork.httpPort, path, md5);
+  simNetwork.publish(PULL_OTA_TOPIC, request);
+  simRun(10);
+  unsigned long start = millis();
+  while (pullUpdate.running() && (millis() - start) < maxMs) {
+    simRun(10);
+  }
+  // Don't boot new image
+  scheduler.cancel(TASK_PULL_OTA);
+  pullOtaRestart = false;
+  if (pullUpdate.state() == PullUpdate::UPDATE_DONE) {
+    simCheck(simBoard.updateReady && simBoard.updateSize == size && !memcmp(simBoard.updateImage, image, size),
+      "%s: image not written", path);
+  }
+  return pullUpdate.state();
+}
+
+// Update is pulled by chunks over HTTP, resumed after connection losses, checked by MD5, and can be a delta
+void scenarioPullOta() {
+  static uint8_t image[SIM_SKETCH_SIZE];
+  static uint8_t delta[SIM_SKETCH_SIZE];
+  char md5[33];
+  // New image: running one with a few changes
+  memcpy(image, simBoard.sketch, sizeof(image));
+  for (size_t i = 1000; i < 1200; i++) {
+    image[i] ^= 0x55;
+  }
+  for (size_t i = 20000; i < 20100; i++) {
+    image[i] = i;
+  }
+  simMd5(image, sizeof(image), md5);
+  // Full image, connection lost every 8 KB, while button is used
+  simNetwork.setHttpResource("/firmware.bin", image, sizeof(image));
+  simNetwork.httpDrops = 3;
+  simNetwork.httpDropAfter = 8192;
+  unsigned long requests = simNetwork.httpRequests;
+  char request[128];
+  snprintf(request, sizeof(request), "{\"url\":\"http://192.168.1.10:%u/firmware.bin\",\"md5\":\"%s\"}", simNetwork.httpPort, md5);
+  simNetwork.publish(PULL_OTA_TOPIC, request);
+  simRun(200);
+  simCheck(pullUpdate.running(), "update not started");
+  simPush(0);
+  simRun(1000);
+  simCheckSynced("push during update");
+  unsigned long start = millis();
+  while (pullUpdate.running() && (millis() - start) < 60000) {
+    simRun(10);
+  }
+  scheduler.cancel(TASK_PULL_OTA);
+  pullOtaRestart = false;
+  simCheck(pullUpdate.state() == PullUpdate::UPDATE_DONE, "update not done (%s)", pullUpdate.error());
+  simCheck(simBoard.updateReady && !memcmp(simBoard.updateImage, image, sizeof(image)), "image not written");
+  simCheck(simNetwork.httpRequests - requests == 4 && simNetwork.httpRangeRequests == 3 && pullUpdate.resumes() == 3,
+    "%lu requests, %lu resumed, instead of 4 and 3", simNetwork.httpRequests - requests, simNetwork.httpRangeRequests);
+  simCheck(simBoard.updateMaxWrite <= PULL_OTA_CHUNK_SIZE, "%u bytes written at once", (unsigned) simBoard.updateMaxWrite);
+  // Server ignoring Range: resumed by skipping bytes already received
+  simNetwork.httpDrops = 1;
+  simNetwork.httpDropAfter = 20000;
+  simNetwork.httpRange = false;
+  simCheck(simPullOta("/firmware.bin", image, sizeof(image), md5, 60000) == PullUpdate::UPDATE_DONE,
+    "update without Range not done (%s)", pullUpdate.error());
+  simNetwork.httpRange = true;
+  // More connection losses than retries, but each one after new data
+  simNetwork.httpDrops = PULL_OTA_RETRIES + 2;
+  simNetwork.httpDropAfter = 2048;
+  simCheck(simPullOta("/firmware.bin", image, sizeof(image), md5, 120000) == PullUpdate::UPDATE_DONE
+    && pullUpdate.resumes() == PULL_OTA_RETRIES + 2, "update with %d drops not done (%s)", PULL_OTA_RETRIES + 2, pullUpdate.error());
+  // Delta: copies of running image around changed bytes
+  size_t length = 0;
+  auto add = [&](const void* data, size_t size) {
+    memcpy(delta + length, data, size);
+    length += size;
+  };
+  auto addLong = [&](uint32_t value) {
+    uint8_t bytes[4] = {(uint8_t) value, (uint8_t) (value >> 8), (uint8_t) (value >> 16), (uint8_t) (value >> 24)};
+    add(bytes, 4);
+  };
+  add("FFD1", 4);
+  addLong(sizeof(image));
+  const uint32_t changes[][2] = {{1000, 1200}, {20000, 20100}, {sizeof(image), sizeof(image)}};
+  uint32_t position = 0;
+  for (auto &change : changes) {
+    add("C", 1);
+    addLong(position);
+    addLong(change[0] - position);
+    if (change[1] > change[0]) {
+      add("L", 1);
+      addLong(change[1] - change[0]);
+      add(image + change[0], change[1] - change[0]);
+    }
+    position = change[1];
+  }
+  simNetwork.setHttpResource("/firmware.delta", delta, length);
+  unsigned long bodyBytes = simNetwork.httpBodyBytes;
+  simCheck(simPullOta("/firmware.delta", image, sizeof(image), md5, 60000) == PullUpdate::UPDATE_DONE && pullUpdate.delta(),
+    "delta update not done (%s)", pullUpdate.error());
+  simCheck(simNetwork.httpBodyBytes - bodyBytes == length, "%lu delta bytes read instead of %u",
+    simNetwork.httpBodyBytes - bodyBytes, (unsigned) length);
+  // Image not matching MD5 is not kept
+  image[30000] ^= 1;
+  simNetwork.setHttpResource("/firmware.bin", image, sizeof(image));
+  simCheck(simPullOta("/firmware.bin", image, sizeof(image), md5, 60000) == PullUpdate::UPDATE_FAILED && !simBoard.updateReady,
+    "image with bad MD5 accepted");
+  // Missing resource
+  simCheck(simPullOta("/missing.bin", image, sizeof(image), md5, 60000) == PullUpdate::UPDATE_FAILED, "missing image accepted");
+  // Running image is not downloaded again (retained request)
+  requests = simNetwork.httpRequests;
+  simPullOta("/firmware.bin", image, sizeof(image), ESP.getSketchMD5().c_str(), 1000);
+  simCheck(simNetwork.httpRequests == requests, "running image downloaded again");
+  simNetwork.setHttpResource(NULL, NULL, 0);
+  simRun(2000);
+  simCheckSynced("after updates");
+}
+#endif
+
+struct scenario {
+  const char* name;
+  void (*run)();
+};
+
+const scenario scenarios[] = {
+  #ifdef PREDICTIVE_RELAY
+    {"predictive", scenarioPredictive},
+  #endif
+  {"presses", scenarioPresses},
+  #ifdef DEVICE_SHADOW_TOPIC
+    {"shadow", scenarioShadow},
+  #endif
+  #ifdef MILIGHT_RADIO_CS_PIN
+    {"radio", scenarioRadio},
+  #endif
+  #ifdef ESPNOW_PEERS
+    {"peers", scenarioPeers},
+  #endif
+  #ifdef POWER_SAVE
+    {"powerSave", scenarioPowerSave},
+  #endif
+  #ifdef TELEMETRY_HOST
+    {"telemetry", scenarioTelemetry},
+  #endif
+  #ifdef PERSIST_FLASH
+    {"persist", scenarioPersist},
+  #endif
+  #ifdef POWER_TOPIC
+    {"power", scenarioPower},
+  #endif
+  #ifdef PULL_OTA_TOPIC
+    {"pullOta", scenarioPullOta},
+  #endif
+  {"slowAcks", scenarioSlowAcks},
+  {"brokerDrop", scenarioBrokerDrop},
+  #ifdef MQTT_QUEUE_SIZE
+    {"queueReplay", scenarioQueueReplay},
+  #endif
+  {"buttonStorm", scenarioButtonStorm},
+  {"partialReads", scenarioPartialReads},
+  {"wifiDrop", scenarioWifiDrop}
+};
+
+// Run a scenario and print its results
+void runScenario(const char* name, void (*run)()) {
+  printf("%s\n", name);
+  scenarioStats = loopStats();
+  scenarioFailures = 0;
+  unsigned long tcpWrites = simNetwork.tcpWrites;
+  unsigned long syslogCount = simNetwork.syslogCount;
+  simBoard.heapReset();
+  run();
+  printf("    %lu loops, loop avg %.2f us, max %.2f us, heap %+ld bytes, %lu TCP writes, %lu syslog packets: %s\n",
+    scenarioStats.loops, scenarioStats.loops ? scenarioStats.totalNs / 1000.0 / scenarioStats.loops : 0,
+    scenarioStats.maxNs / 1000.0, simBoard.heapUsed(), simNetwork.tcpWrites - tcpWrites,
+    simNetwork.syslogCount - syslogCount, scenarioFailures ? "FAILED" : "ok");
+  totalFailures += scenarioFailures;
+}
+
+// ----- Benchmarks -----
+
+// Client answering CONNECT, then giving the same packets forever, at most budget bytes per loop() (0 for no limit)
+class BenchClient : public Client {
+private:
+  const uint8_t* data = NULL;
+  size_t length = 0;
+  size_t pos = 0;
+  const uint8_t* replayData = NULL;
+  size_t replayLength = 0;
+  bool open = false;
+public:
+  size_t budget = 0;
+  size_t left = 0;
+  void replay(const uint8_t* packets, size_t size) { replayData = packets; replayLength = size; }
+  int connect(IPAddress ip, uint16_t port) { (void) ip; (void) port; open = true; return 1; }
+  int connect(const char* host, uint16_t port) { (void) host; (void) port; open = true; return 1; }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t* buffer, size_t size) {
+    static const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    if ((buffer[0] >> 4) == 1) {
+      data = connack;
+      length = sizeof(connack);
+      pos = 0;
+    }
+    return size;
+  }
+  int available() {
+    if (pos == length && data != replayData && replayData) {
+      // CONNACK read, start replay
+      data = replayData;
+      length = replayLength;
+      pos = 0;
+    } else if (pos == length && data == replayData) {
+      pos = 0;
+    }
+    size_t size = length - pos;
+    return budget ? min(size, left) : size;
+  }
+  int read() { uint8_t c; return (read(&c, 1) == 1) ? c : -1; }
+  int read(uint8_t* buffer, size_t size) {
+    size_t count = min(size, (size_t) available());
+    memcpy(buffer, data + pos, count);
+    pos += count;
+    left -= min(left, count);
+    return count;
+  }
+  int peek() { return available() ? data[pos] : -1; }
+  void flush() {}
+  void stop() { open = false; }
+  uint8_t connected() { return open; }
+  operator bool() { return open; }
+};
+
+unsigned long benchMessages = 0;                            // Messages received by bench client
+void benchCallback(char* topic, uint8_t* payload, unsigned int length) {
+  (void) topic;
+  (void) payload;
+  (void) length;
+  benchMessages++;
+}
+
+// Print a benchmark result
+void benchResult(const char* name, uint64_t ns, unsigned long count) {
+  printf("    %-36s %10.1f ns/op\n", name, (double) ns / count);
+}
+
+// Parse state messages as received from broker, whole or by small reads
+void benchReadPacket(size_t budget) {
+  const char* topic = channels[0].stateTopic ? channels[0].stateTopic : channels[0].updateTopic;
+  const char* payload = "{\"state\":\"ON\",\"brightness\":255,\"color_mode\":\"color_temp\",\"color_temp\":370}";
+  static uint8_t packets[32 * 256];
+  size_t length = 0;
+  size_t topicLength = strlen(topic);
+  size_t payloadLength = strlen(payload);
+  for (uint8_t i = 0; i < 32; i++) {
+    packets[length++] = 0x30;
+    packets[length++] = 2 + topicLength + payloadLength;
+    packets[length++] = 0;
+    packets[length++] = topicLength;
+    memcpy(packets + length, topic, topicLength);
+    length += topicLength;
+    memcpy(packets + length, payload, payloadLength);
+    length += payloadLength;
+  }
+  BenchClient client;
+  client.replay(packets, length);
+  PubSubClient mqtt(client);
+  mqtt.setServer("bench", 1883);
+  mqtt.setCallback(benchCallback);
+  mqtt.connect("bench");
+  client.budget = budget;
+  const unsigned long count = 100000;
+  benchMessages = 0;
+  uint64_t start = hostNs();
+  while (benchMessages < count) {
+    client.left = budget;
+    mqtt.loop();
+  }
+  uint64_t duration = hostNs() - start;
+  char name[50];
+  snprintf(name, sizeof(name), budget ? "readPacket (%u bytes reads)" : "readPacket (whole packets)", (unsigned) budget);
+  printf("    %-36s %10.1f ns/op, %.1f MB/s\n", name, (double) duration / count, (double) count * (length / 32) * 1000.0 / duration);
+}
+
+// State message given to channel callback
+void benchCallbackPath() {
+  char topic[SIM_TOPIC_SIZE];
+  snprintf(topic, sizeof(topic), "%s", channels[0].stateTopic ? channels[0].stateTopic : channels[0].updateTopic);
+  char payloads[2][100];
+  snprintf(payloads[0], sizeof(payloads[0]), "{\"state\":\"OFF\",\"brightness\":255,\"color_mode\":\"color_temp\",\"color_temp\":370}");
+  snprintf(payloads[1], sizeof(payloads[1]), "{\"state\":\"ON\",\"brightness\":255,\"color_mode\":\"color_temp\",\"color_temp\":370}");
+  const unsigned long count = 100000;
+  uint64_t start = hostNs();
+  for (unsigned long i = 0; i < count; i++) {
+    mqttCallback(channels[0], topic, (byte*) payloads[i & 1], strlen(payloads[i & 1]));
+  }
+  benchResult("mqttCallback (state toggling)", hostNs() - start, count);
+}
+
+// Traces formatting and sending
+void benchSyslog() {
+  WiFiUDP udp;
+  Syslog benchSyslog(udp, "192.168.1.123", 514, "bench", "bench", LOG_USER | LOG_INFO, SYSLOG_PROTO_IETF);
+  const unsigned long count = 100000;
+  uint64_t start = hostNs();
+  for (unsigned long i = 0; i < count; i++) {
+    benchSyslog.logf(LOG_INFO, "Button %d pushed, bulb state is now %s", 0, (i & 1) ? "ON" : "OFF");
+  }
+  benchResult("Syslog::vlogf (heap buffer)", hostNs() - start, count);
+  static char buffer[256];
+  benchSyslog.formatBuffer(buffer, sizeof(buffer));
+  start = hostNs();
+  for (unsigned long i = 0; i < count; i++) {
+    benchSyslog.logf(LOG_INFO, "Button %d pushed, bulb state is now %s", 0, (i & 1) ? "ON" : "OFF");
+  }
+  benchResult("Syslog::vlogf (static buffer)", hostNs() - start, count);
+}
+
+#ifdef TEMPERATURE_TOPIC
+// NTC conversion
+void benchTemperature() {
+  volatile int sum = 0;
+  const unsigned long count = 1024 * 1000;
+  uint64_t start = hostNs();
+  for (unsigned long i = 0; i < count; i++) {
+    sum += getTemperature(i % 1025);
+  }
+  benchResult("getTemperature", hostNs() - start, count);
+}
+#endif
+
+void runBenchmarks() {
+  printf("benchmarks\n");
+  bool verbose = simNetwork.verbose;
+  simNetwork.verbose = false;
+  benchReadPacket(0);
+  benchReadPacket(16);
+  benchCallbackPath();
+  benchSyslog();
+  #ifdef TEMPERATURE_TOPIC
+    benchTemperature();
+  #endif
+  simNetwork.verbose = verbose;
+}
+
+int main(int argc, char* argv[]) {
+  const char* only = NULL;
+  bool benchmarks = true;
+  bool benchmarksOnly = false;
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-v")) {
+      simNetwork.verbose = true;
+    } else if (!strcmp(argv[i], "-n")) {
+      benchmarks = false;
+    } else if (!strcmp(argv[i], "-b")) {
+      benchmarksOnly = true;
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      only = argv[++i];
+    } else {
+      printf("Usage: %s [-v] [-n] [-b] [-s scenario]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  printf("%s V%s simulation, %d channel(s)\n", QUOTE(PROG_NAME), VERSION, CHANNEL_COUNT);
+  simBoard.heapReset();
+  setup();
+  // Hub knows all channel bulbs
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    simNetwork.addBulb(channels[i].commandTopic, channels[i].stateTopic, channels[i].updateTopic);
+  }
+  runScenario("boot", scenarioBoot);
+
+  if (!benchmarksOnly) {
+    for (const scenario &s : scenarios) {
+      if (!only || !strcmp(only, s.name)) {
+        runScenario(s.name, s.run);
+      }
+    }
+  }
+  if (benchmarks || benchmarksOnly) {
+    runBenchmarks();
+  }
+  printf("%lu check(s) failed\n", totalFailures);
+  return totalFailures ? 1 : 0;
+}
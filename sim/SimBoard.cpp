@@ -0,0 +1,378 @@
+/*
+  SimBoard.cpp - Simulated ESP8266 board (time, pins, RTC memory, flash, heap), for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#include <chrono>
+#include <malloc.h>
+#include <EEPROM.h>
+#include <ArduinoOTA.h>
+#include <Updater.h>
+#include "SimBoard.h"
+#include "SimNetwork.h"
+
+SimBoard simBoard;
+EspClass ESP;
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+ArduinoOTAClass ArduinoOTA;
+UpdaterClass Update;
+
+SimBoard::SimBoard() {
+    this->time = 0;
+    memset(this->pinLevel, 0, sizeof(this->pinLevel));
+    memset(this->pinModes, INPUT, sizeof(this->pinModes));
+    memset(this->interrupt, 0, sizeof(this->interrupt));
+    memset(this->rtcMemory, 0xff, sizeof(this->rtcMemory));
+    this->analogValue = 300;
+    this->rtcWrites = 0;
+    memset(this->flash, 0xff, sizeof(this->flash));
+    memset(this->flashErases, 0, sizeof(this->flashErases));
+    this->flashWrites = 0;
+    // Running image: magic byte, then pseudo random bytes
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < sizeof(this->sketch); i++) {
+        seed = seed * 1103515245 + 12345;
+        this->sketch[i] = seed >> 16;
+    }
+    this->sketch[0] = 0xe9;
+    memset(this->updateImage, 0xff, sizeof(this->updateImage));
+    this->updateSize = 0;
+    this->updateReady = false;
+    this->updateWrites = 0;
+    this->updateMaxWrite = 0;
+    this->randomState = 1;
+    this->heapBase = 0;
+}
+
+void SimBoard::advance(uint64_t us) {
+    this->time += us;
+    simNetwork.poll();
+}
+
+void SimBoard::setInput(uint8_t pin, uint8_t level) {
+    uint8_t previous = this->pinLevel[pin];
+    this->pinLevel[pin] = level;
+    Interrupt &irq = this->interrupt[pin];
+    if (previous == level || !(irq.handler || irq.handlerArg)) {
+        return;
+    }
+    if (irq.mode == CHANGE || (irq.mode == RISING && level) || (irq.mode == FALLING && !level)) {
+        if (irq.handlerArg) {
+            irq.handlerArg(irq.arg);
+        } else {
+            irq.handler();
+        }
+    }
+}
+
+long SimBoard::heapUsed() {
+    return (long) mallinfo2().uordblks - this->heapBase;
+}
+
+void SimBoard::heapReset() {
+    this->heapBase = (long) mallinfo2().uordblks;
+}
+
+// Time
+unsigned long millis() {
+    return (unsigned long) (simBoard.time / 1000);
+}
+
+unsigned long micros() {
+    return (unsigned long) simBoard.time;
+}
+
+uint64_t micros64() {
+    return simBoard.time;
+}
+
+void delay(unsigned long ms) {
+    simBoard.advance((uint64_t) ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    simBoard.advance(us);
+}
+
+// Busy waits cost a bit of time, so that they end
+void yield() {
+    simBoard.advance(10);
+}
+
+// Pins
+void pinMode(uint8_t pin, uint8_t mode) {
+    simBoard.pinModes[pin] = mode;
+    if (mode == INPUT_PULLUP) {
+        simBoard.pinLevel[pin] = HIGH;
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    return simBoard.pinLevel[pin];
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    simBoard.pinLevel[pin] = value ? HIGH : LOW;
+}
+
+int analogRead(uint8_t pin) {
+    (void) pin;
+    return simBoard.analogValue;
+}
+
+uint32_t simGpioConfig[16];
+
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode) {
+    simBoard.interrupt[pin] = {handler, NULL, NULL, mode};
+}
+
+void attachInterruptArg(uint8_t pin, void (*handler)(void*), void* arg, int mode) {
+    simBoard.interrupt[pin] = {NULL, handler, arg, mode};
+}
+
+void detachInterrupt(uint8_t pin) {
+    simBoard.interrupt[pin] = {NULL, NULL, NULL, 0};
+}
+
+// Random (xorshift32)
+long random(long high) {
+    if (high <= 0) {
+        return 0;
+    }
+    uint32_t x = simBoard.randomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    simBoard.randomState = x;
+    return x % high;
+}
+
+long random(long low, long high) {
+    return (high > low) ? low + random(high - low) : low;
+}
+
+void randomSeed(unsigned long seed) {
+    simBoard.randomState = seed ? seed : 1;
+}
+
+struct rst_info* system_get_rst_info() {
+    static rst_info info = {REASON_DEFAULT_RST};
+    return &info;
+}
+
+// ESP
+uint32_t EspClass::getChipId() {
+    return 0x5131a7;
+}
+
+uint32_t EspClass::getFreeHeap() {
+    return SIM_HEAP_SIZE - simBoard.heapUsed();
+}
+
+uint32_t EspClass::getMaxFreeBlockSize() {
+    return getFreeHeap();
+}
+
+uint8_t EspClass::getHeapFragmentation() {
+    return 0;
+}
+
+uint32_t EspClass::getCycleCount() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint32_t) (std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() * getCpuFreqMHz() / 1000);
+}
+
+uint8_t EspClass::getCpuFreqMHz() {
+    return 80;
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+    if (offset * 4 + size > sizeof(simBoard.rtcMemory)) {
+        return false;
+    }
+    memcpy(data, &simBoard.rtcMemory[offset], size);
+    return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+    if (offset * 4 + size > sizeof(simBoard.rtcMemory)) {
+        return false;
+    }
+    memcpy(&simBoard.rtcMemory[offset], data, size);
+    simBoard.rtcWrites++;
+    return true;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector) {
+    uint32_t address = sector * FLASH_SECTOR_SIZE;
+    if (address < FS_PHYS_ADDR || address >= FS_PHYS_ADDR + FS_PHYS_SIZE) {
+        return false;
+    }
+    memset(&simBoard.flash[address - FS_PHYS_ADDR], 0xff, FLASH_SECTOR_SIZE);
+    simBoard.flashErases[(address - FS_PHYS_ADDR) / FLASH_SECTOR_SIZE]++;
+    return true;
+}
+
+bool EspClass::flashWrite(uint32_t address, const uint32_t* data, size_t size) {
+    if ((address & 3) || (size & 3) || address < FS_PHYS_ADDR || address + size > FS_PHYS_ADDR + FS_PHYS_SIZE) {
+        return false;
+    }
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < size; i++) {
+        simBoard.flash[address - FS_PHYS_ADDR + i] &= bytes[i];
+    }
+    simBoard.flashWrites++;
+    return true;
+}
+
+bool EspClass::flashRead(uint32_t address, uint32_t* data, size_t size) {
+    if (!(address & 3) && !(size & 3) && address + size <= sizeof(simBoard.sketch)) {
+        memcpy(data, &simBoard.sketch[address], size);
+        return true;
+    }
+    if ((address & 3) || (size & 3) || address < FS_PHYS_ADDR || address + size > FS_PHYS_ADDR + FS_PHYS_SIZE) {
+        return false;
+    }
+    memcpy(data, &simBoard.flash[address - FS_PHYS_ADDR], size);
+    return true;
+}
+
+uint32_t EspClass::getSketchSize() {
+    return sizeof(simBoard.sketch);
+}
+
+String EspClass::getSketchMD5() {
+    char md5[33];
+    simMd5(simBoard.sketch, sizeof(simBoard.sketch), md5);
+    return String(md5);
+}
+
+void EspClass::restart() {
+    printf("ESP.restart() called at %lu ms\n", millis());
+    exit(2);
+}
+
+// Updater (image is written in update area)
+bool UpdaterClass::begin(size_t size, int command) {
+    (void) command;
+    this->error = UPDATE_ERROR_OK;
+    if (this->started || !size) {
+        this->error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    if (size > sizeof(simBoard.updateImage)) {
+        this->error = UPDATE_ERROR_SPACE;
+        return false;
+    }
+    this->started = true;
+    this->size = size;
+    this->written = 0;
+    this->md5[0] = 0;
+    memset(simBoard.updateImage, 0xff, sizeof(simBoard.updateImage));
+    simBoard.updateSize = size;
+    simBoard.updateReady = false;
+    return true;
+}
+
+void UpdaterClass::setMD5(const char* md5) {
+    strncpy(this->md5, md5, sizeof(this->md5) - 1);
+    this->md5[sizeof(this->md5) - 1] = 0;
+}
+
+size_t UpdaterClass::write(uint8_t* data, size_t length) {
+    if (!this->started || this->written + length > this->size) {
+        this->error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+    if (!this->written && length && data[0] != 0xe9) {
+        this->error = UPDATE_ERROR_MAGIC_BYTE;
+        return 0;
+    }
+    memcpy(simBoard.updateImage + this->written, data, length);
+    this->written += length;
+    simBoard.updateWrites++;
+    simBoard.updateMaxWrite = max(simBoard.updateMaxWrite, length);
+    return length;
+}
+
+bool UpdaterClass::end(bool evenIfRemaining) {
+    if (!this->started) {
+        return false;
+    }
+    this->started = false;
+    if (!evenIfRemaining && this->written < this->size) {
+        return false;
+    }
+    char md5[33];
+    simMd5(simBoard.updateImage, this->written, md5);
+    if (this->md5[0] && strcasecmp(md5, this->md5)) {
+        this->error = UPDATE_ERROR_MD5;
+        return false;
+    }
+    simBoard.updateReady = true;
+    return true;
+}
+
+// MD5 (RFC 1321)
+void simMd5(const uint8_t* data, size_t length, char* md5) {
+    static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    static const uint8_t r[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+    uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    // Process 64 bytes blocks, last ones being padded with 0x80, zeros and bit length
+    size_t total = ((length + 8) / 64 + 1) * 64;
+    for (size_t block = 0; block < total; block += 64) {
+        uint32_t w[16];
+        for (uint8_t i = 0; i < 64; i++) {
+            size_t position = block + i;
+            uint8_t byte = (position < length) ? data[position] : (position == length) ? 0x80 : 0;
+            if (position >= total - 8) {
+                byte = (uint8_t) (((uint64_t) length * 8) >> ((position - (total - 8)) * 8));
+            }
+            if (!(i & 3)) {
+                w[i / 4] = 0;
+            }
+            w[i / 4] |= (uint32_t) byte << ((i & 3) * 8);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for (uint8_t i = 0; i < 64; i++) {
+            uint32_t f;
+            uint8_t g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) & 15;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) & 15;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) & 15;
+            }
+            uint32_t rotated = a + f + k[i] + w[g];
+            uint8_t shift = r[(i / 16) * 4 + (i & 3)];
+            a = d;
+            d = c;
+            c = b;
+            b += (rotated << shift) | (rotated >> (32 - shift));
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+    for (uint8_t i = 0; i < 16; i++) {
+        snprintf(md5 + i * 2, 3, "%02x", (h[i / 4] >> ((i & 3) * 8)) & 0xff);
+    }
+}
@@ -0,0 +1,79 @@
+/*
+  SimBoard.h - Simulated ESP8266 board (time, pins, RTC memory, flash, heap), for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Time is virtual: it only moves when simulation calls advance() (or when firmware waits,
+  using delay() or yield()), so that scenarios are reproducible whatever host speed is.
+  Cycle counter is the only thing running on host time, to let loop profile measure
+  real code duration.
+
+  Only file system area of flash is simulated, as NOR flash: erase sets a sector to 0xFF,
+  write can only clear bits. Running image (sketch) can be read at start of flash, and
+  Updater writes new image in a separate area.
+*/
+
+#ifndef SimBoard_h
+#define SimBoard_h
+
+#include <Arduino.h>
+#include <flash_hal.h>
+
+// SIM_PIN_COUNT : number of simulated pins (0 to 16, plus A0)
+#define SIM_PIN_COUNT 18
+
+// SIM_SKETCH_SIZE : size of running image (and maximum size of new one)
+#define SIM_SKETCH_SIZE 32768
+
+// SIM_HEAP_SIZE : heap size reported as free when simulation starts
+#ifndef SIM_HEAP_SIZE
+#define SIM_HEAP_SIZE 40000
+#endif
+
+class SimBoard {
+private:
+   struct Interrupt {
+      void (*handler)(void);
+      void (*handlerArg)(void*);
+      void* arg;
+      int mode;
+   };
+   Interrupt interrupt[SIM_PIN_COUNT];
+   long heapBase;
+   uint32_t randomState;
+   friend void attachInterrupt(uint8_t pin, void (*handler)(void), int mode);
+   friend void attachInterruptArg(uint8_t pin, void (*handler)(void*), void* arg, int mode);
+   friend void detachInterrupt(uint8_t pin);
+   friend long random(long high);
+   friend void randomSeed(unsigned long seed);
+public:
+   uint64_t time;                                           // Virtual time (us)
+   uint8_t pinLevel[SIM_PIN_COUNT];                         // Current level of each pin
+   uint8_t pinModes[SIM_PIN_COUNT];                         // Mode given by pinMode()
+   int analogValue;                                         // Value returned by analogRead()
+   uint32_t rtcMemory[128];                                 // RTC user memory (kept across simulated resets)
+   unsigned long rtcWrites;                                 // Count of RTC memory writes
+   uint8_t flash[FS_PHYS_SIZE];                             // File system area of flash (kept across simulated resets)
+   unsigned long flashErases[FS_PHYS_SIZE / FLASH_SECTOR_SIZE]; // Count of erases of each sector
+   unsigned long flashWrites;                               // Count of flash writes
+   uint8_t sketch[SIM_SKETCH_SIZE];                         // Running image (at flash address 0)
+   uint8_t updateImage[SIM_SKETCH_SIZE];                    // Image written by Updater
+   size_t updateSize;                                       // Its size
+   bool updateReady;                                        // Image written and MD5 checked (would be booted by restart)
+   unsigned long updateWrites;                              // Count of Updater writes
+   size_t updateMaxWrite;                                   // Longest of them (bytes)
+   SimBoard();
+   // Let time pass, processing network events
+   void advance(uint64_t us);
+   // Drive an input pin to a level, calling its interrupt handler if needed
+   void setInput(uint8_t pin, uint8_t level);
+   // Heap used since last heapReset() (bytes, simulation structures included)
+   long heapUsed();
+   void heapReset();
+};
+extern SimBoard simBoard;
+
+// Compute MD5 of data, as 32 hex digits (md5 should be 33 bytes long)
+void simMd5(const uint8_t* data, size_t length, char* md5);
+
+#endif
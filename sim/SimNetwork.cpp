@@ -0,0 +1,812 @@
+/*
+  SimNetwork.cpp - Simulated WiFi access point, MQTT broker, Milight hub and HTTP server, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#include <WiFiUdp.h>
+#include "SimBoard.h"
+#include "SimNetwork.h"
+
+SimNetwork simNetwork;
+ESP8266WiFiClass WiFi;
+
+// WiFi event handlers given by firmware
+static std::function<void(const WiFiEventStationModeConnected&)> onConnectedHandler;
+static std::function<void(const WiFiEventStationModeDisconnected&)> onDisconnectedHandler;
+static std::function<void(const WiFiEventStationModeGotIP&)> onGotIPHandler;
+static uint8_t accessPointBssid[6] = {0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc};
+#define ACCESS_POINT_CHANNEL 6
+#define LOCAL_IP IPAddress(192, 168, 1, 50)
+#define GATEWAY_IP IPAddress(192, 168, 1, 1)
+#define SUBNET_MASK IPAddress(255, 255, 255, 0)
+
+SimNetwork::SimNetwork() {
+    memset(this->events, 0, sizeof(this->events));
+    this->bulbCount = 0;
+    this->topicCount = 0;
+    this->retainedCount = 0;
+    this->espnowCallback = NULL;
+    this->wifiStatus = WL_DISCONNECTED;
+    this->wifiBegun = false;
+    this->wifiAutoReconnect = false;
+    this->wifiGeneration = 0;
+    this->client = NULL;
+    this->tcpGeneration = 0;
+    this->mqttSession = false;
+    this->inLength = 0;
+    this->outLength = 0;
+    this->outVisible = 0;
+    this->lastChunkTime = 0;
+    this->httpPath[0] = 0;
+    this->httpData = NULL;
+    this->httpSize = 0;
+    this->httpClient = NULL;
+    this->httpRequestLength = 0;
+    this->httpHeaderLength = 0;
+}
+
+void SimNetwork::schedule(unsigned long delayMs, uint8_t type, uint16_t generation, uint8_t arg, bool state) {
+    for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++) {
+        if (!this->events[i].used) {
+            this->events[i] = {simBoard.time + (uint64_t) delayMs * 1000, type, arg, state, generation, true};
+            return;
+        }
+    }
+    printf("SimNetwork: too many events, increase SIM_MAX_EVENTS\n");
+}
+
+void SimNetwork::poll() {
+    uint64_t now = simBoard.time;
+    for (;;) {
+        // Run oldest due event first
+        Event* next = NULL;
+        for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++) {
+            if (this->events[i].used && this->events[i].time <= now && (!next || this->events[i].time < next->time)) {
+                next = &this->events[i];
+            }
+        }
+        if (!next) {
+            break;
+        }
+        Event event = *next;
+        next->used = false;
+        switch (event.type) {
+            case EVENT_WIFI_CONNECT:
+                if (event.generation != this->wifiGeneration || !this->wifiBegun || this->wifiStatus == WL_CONNECTED) {
+                    break;
+                }
+                if (!this->accessPointUp) {
+                    // Access point not found, core retries if auto reconnect is set
+                    if (this->wifiAutoReconnect) {
+                        wifiAttempt(this->wifiConnectTime);
+                    }
+                    break;
+                }
+                if (onConnectedHandler) {
+                    WiFiEventStationModeConnected info;
+                    memcpy(info.bssid, accessPointBssid, sizeof(info.bssid));
+                    info.channel = ACCESS_POINT_CHANNEL;
+                    onConnectedHandler(info);
+                }
+                schedule(this->wifiStaticIp ? 0 : this->dhcpTime, EVENT_WIFI_GOT_IP, this->wifiGeneration);
+                break;
+            case EVENT_WIFI_GOT_IP:
+                if (event.generation != this->wifiGeneration || !this->accessPointUp) {
+                    break;
+                }
+                this->wifiStatus = WL_CONNECTED;
+                if (onGotIPHandler) {
+                    WiFiEventStationModeGotIP info;
+                    info.ip = LOCAL_IP;
+                    info.mask = SUBNET_MASK;
+                    info.gw = GATEWAY_IP;
+                    onGotIPHandler(info);
+                }
+                break;
+            case EVENT_CONNACK:
+                if (event.generation == this->tcpGeneration && this->client) {
+                    static const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+                    this->mqttSession = true;
+                    brokerSend(connack, sizeof(connack));
+                }
+                break;
+            case EVENT_HUB_ACK:
+                // Hub sent radio command, publish new bulb state (also kept as retained state)
+                this->bulbs[event.arg].on = event.state;
+                bulbPublish(event.arg, false);
+                break;
+        }
+    }
+    // Release received bytes by chunks
+    if (this->chunkSize) {
+        while (this->outVisible < this->outLength && (now - this->lastChunkTime) >= this->chunkInterval) {
+            this->lastChunkTime += this->chunkInterval;
+            this->outVisible = min(this->outVisible + this->chunkSize, this->outLength);
+        }
+        if (this->outVisible == this->outLength) {
+            this->lastChunkTime = now;
+        }
+    } else {
+        this->outVisible = this->outLength;
+    }
+}
+
+void SimNetwork::addBulb(const char* commandTopic, const char* stateTopic, const char* updateTopic) {
+    if (this->bulbCount >= SIM_MAX_BULBS) {
+        return;
+    }
+    Bulb &bulb = this->bulbs[this->bulbCount++];
+    snprintf(bulb.commandTopic, sizeof(bulb.commandTopic), "%s", commandTopic);
+    snprintf(bulb.stateTopic, sizeof(bulb.stateTopic), "%s", stateTopic ? stateTopic : "");
+    snprintf(bulb.updateTopic, sizeof(bulb.updateTopic), "%s", updateTopic ? updateTopic : "");
+    bulb.on = false;
+    bulb.commands = 0;
+}
+
+void SimNetwork::publishState(uint8_t index, bool on) {
+    this->bulbs[index].on = on;
+    bulbPublish(index, false);
+}
+
+bool SimNetwork::bulbOn(uint8_t index) {
+    return this->bulbs[index].on;
+}
+
+unsigned long SimNetwork::bulbCommands(uint8_t index) {
+    return this->bulbs[index].commands;
+}
+
+void SimNetwork::setAccessPoint(bool up) {
+    this->accessPointUp = up;
+    if (!up && this->wifiStatus == WL_CONNECTED) {
+        // Connection lost
+        this->wifiStatus = WL_DISCONNECTED;
+        this->wifiGeneration++;
+        closeConnection();
+        httpClose();
+        if (onDisconnectedHandler) {
+            WiFiEventStationModeDisconnected info;
+            memcpy(info.bssid, accessPointBssid, sizeof(info.bssid));
+            info.reason = 4;                                // Beacon timeout
+            onDisconnectedHandler(info);
+        }
+        if (this->wifiAutoReconnect) {
+            wifiAttempt(this->wifiConnectTime);
+        }
+    }
+}
+
+void SimNetwork::setBroker(bool up) {
+    this->brokerUp = up;
+    if (!up) {
+        closeConnection();
+    }
+}
+
+bool SimNetwork::mqttConnected() {
+    return this->client && this->mqttSession;
+}
+
+void SimNetwork::espnowReceive(const uint8_t* data, uint8_t length) {
+    if (this->verbose) {
+        printf("%10.3f espnow < %u bytes\n", simBoard.time / 1000000.0, length);
+    }
+    if (this->espnowCallback) {
+        uint8_t mac[] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+        uint8_t frame[SIM_ESPNOW_SIZE];
+        memcpy(frame, data, length);
+        this->espnowCallback(mac, frame, length);
+    }
+}
+
+void SimNetwork::syslogPacket(const char* packet, size_t length) {
+    this->syslogCount++;
+    if (this->verbose) {
+        printf("%10.3f syslog %.*s\n", simBoard.time / 1000000.0, (int) length, packet);
+    }
+}
+
+void SimNetwork::udpPacket(const char* packet, size_t length) {
+    this->udpCount++;
+    this->udpLength = min(length, sizeof(this->udpFrame));
+    memcpy(this->udpFrame, packet, this->udpLength);
+    if (this->verbose) {
+        printf("%10.3f udp < %u bytes\n", simBoard.time / 1000000.0, (unsigned) length);
+    }
+}
+
+void SimNetwork::publish(const char* topic, const char* payload) {
+    brokerPublish(topic, payload);
+}
+
+void SimNetwork::setHttpResource(const char* path, const uint8_t* data, size_t size) {
+    snprintf(this->httpPath, sizeof(this->httpPath), "%s", path ? path : "");
+    this->httpData = data;
+    this->httpSize = data ? size : 0;
+}
+
+void SimNetwork::wifiAttempt(unsigned long delayMs) {
+    this->wifiGeneration++;
+    schedule(delayMs, EVENT_WIFI_CONNECT, this->wifiGeneration);
+}
+
+void SimNetwork::closeConnection() {
+    this->client = NULL;
+    this->mqttSession = false;
+    this->tcpGeneration++;
+    this->inLength = 0;
+    this->outLength = 0;
+    this->outVisible = 0;
+}
+
+const char* SimNetwork::retained(const char* topic) {
+    for (uint8_t i = 0; i < this->retainedCount; i++) {
+        if (!strcmp(this->retainedMessages[i].topic, topic)) {
+            return this->retainedMessages[i].payload;
+        }
+    }
+    return NULL;
+}
+
+bool SimNetwork::subscribed(const char* topic) {
+    for (uint8_t i = 0; i < this->topicCount; i++) {
+        if (!strcmp(this->topics[i], topic)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SimNetwork::brokerSend(const uint8_t* data, size_t length) {
+    if (!this->client || this->outLength + length > sizeof(this->outBuffer)) {
+        return;
+    }
+    memcpy(this->outBuffer + this->outLength, data, length);
+    this->outLength += length;
+    if (!this->chunkSize) {
+        this->outVisible = this->outLength;
+    }
+}
+
+void SimNetwork::brokerPublish(const char* topic, const char* payload) {
+    if (!this->mqttSession || !subscribed(topic)) {
+        return;
+    }
+    if (this->verbose) {
+        printf("%10.3f mqtt > %s %s\n", simBoard.time / 1000000.0, topic, payload);
+    }
+    uint8_t packet[SIM_TOPIC_SIZE + SIM_PAYLOAD_SIZE];
+    size_t topicLength = strlen(topic);
+    size_t payloadLength = strlen(payload);
+    size_t remaining = 2 + topicLength + payloadLength;
+    size_t length = 0;
+    packet[length++] = 0x30;
+    do {
+        uint8_t digit = remaining & 0x7f;
+        remaining >>= 7;
+        packet[length++] = digit | (remaining ? 0x80 : 0);
+    } while (remaining);
+    packet[length++] = topicLength >> 8;
+    packet[length++] = topicLength & 0xff;
+    memcpy(packet + length, topic, topicLength);
+    length += topicLength;
+    memcpy(packet + length, payload, payloadLength);
+    length += payloadLength;
+    brokerSend(packet, length);
+}
+
+// Publish bulb state as hub does (state topic is retained, update topic isn't)
+void SimNetwork::bulbPublish(uint8_t index, bool retained) {
+    Bulb &bulb = this->bulbs[index];
+    char payload[128];
+    snprintf(payload, sizeof(payload), "{\"state\":\"%s\",\"brightness\":255,\"color_mode\":\"color_temp\",\"color_temp\":370}",
+        bulb.on ? "ON" : "OFF");
+    if (bulb.stateTopic[0]) {
+        brokerPublish(bulb.stateTopic, payload);
+    }
+    if (bulb.updateTopic[0] && !retained) {
+        snprintf(payload, sizeof(payload), "{\"state\":\"%s\"}", bulb.on ? "ON" : "OFF");
+        brokerPublish(bulb.updateTopic, payload);
+    }
+}
+
+void SimNetwork::brokerPacket(const uint8_t* packet, size_t length) {
+    // Skip fixed header (remaining length has already been checked)
+    size_t pos = 1;
+    while (packet[pos++] & 0x80) {}
+    switch (packet[0] >> 4) {
+        case 1:                                             // CONNECT
+            schedule(this->connackDelay, EVENT_CONNACK, this->tcpGeneration);
+            break;
+        case 3: {                                           // PUBLISH
+            this->publishCount++;
+            size_t topicLength = (packet[pos] << 8) | packet[pos + 1];
+            char topic[SIM_TOPIC_SIZE];
+            snprintf(topic, sizeof(topic), "%.*s", (int) topicLength, packet + pos + 2);
+            pos += 2 + topicLength;
+            if (packet[0] & 0x06) {
+                // Skip packet id (QoS > 0)
+                pos += 2;
+            }
+            char payload[SIM_PAYLOAD_SIZE];
+            snprintf(payload, sizeof(payload), "%.*s", (int) (length - pos), packet + pos);
+            if (this->verbose) {
+                printf("%10.3f mqtt < %s %s%s\n", simBoard.time / 1000000.0, topic, payload, (packet[0] & 0x01) ? " (retained)" : "");
+            }
+            if (packet[0] & 0x01) {
+                // Keep (or replace) retained message
+                this->retainedPublishCount++;
+                uint8_t i = 0;
+                while (i < this->retainedCount && strcmp(this->retainedMessages[i].topic, topic)) {
+                    i++;
+                }
+                if (i < SIM_MAX_RETAINED) {
+                    if (i == this->retainedCount) {
+                        this->retainedCount++;
+                    }
+                    snprintf(this->retainedMessages[i].topic, SIM_TOPIC_SIZE, "%s", topic);
+                    snprintf(this->retainedMessages[i].payload, SIM_PAYLOAD_SIZE, "%s", payload);
+                }
+            }
+            for (uint8_t i = 0; i < this->bulbCount; i++) {
+                if (!strcmp(topic, this->bulbs[i].commandTopic)) {
+                    this->bulbs[i].commands++;
+                    if (this->hubUp) {
+                        schedule(this->ackDelay, EVENT_HUB_ACK, 0, i, strstr(payload, "\"ON\"") != NULL);
+                    }
+                }
+            }
+            break;
+        }
+        case 8: {                                           // SUBSCRIBE
+            uint8_t suback[4 + SIM_MAX_TOPICS] = {0x90, 2, packet[pos], packet[pos + 1]};
+            pos += 2;
+            uint8_t count = 0;
+            uint8_t firstTopic = this->topicCount;
+            while (pos + 2 < length) {
+                size_t topicLength = (packet[pos] << 8) | packet[pos + 1];
+                if (this->topicCount < SIM_MAX_TOPICS) {
+                    snprintf(this->topics[this->topicCount++], SIM_TOPIC_SIZE, "%.*s", (int) topicLength, packet + pos + 2);
+                }
+                pos += 2 + topicLength + 1;
+                if (count < SIM_MAX_TOPICS) {
+                    suback[4 + count++] = 0;
+                }
+            }
+            suback[1] = 2 + count;
+            brokerSend(suback, 4 + count);
+            // Send retained messages of new topics, then retained states
+            for (uint8_t i = firstTopic; i < this->topicCount; i++) {
+                const char* payload = retained(this->topics[i]);
+                if (payload) {
+                    brokerPublish(this->topics[i], payload);
+                }
+            }
+            for (uint8_t i = 0; i < this->bulbCount; i++) {
+                bulbPublish(i, true);
+            }
+            break;
+        }
+        case 10: {                                          // UNSUBSCRIBE
+            uint8_t unsuback[4] = {0xb0, 2, packet[pos], packet[pos + 1]};
+            pos += 2;
+            while (pos + 2 <= length) {
+                size_t topicLength = (packet[pos] << 8) | packet[pos + 1];
+                for (uint8_t i = 0; i < this->topicCount; i++) {
+                    if (strlen(this->topics[i]) == topicLength && !memcmp(this->topics[i], packet + pos + 2, topicLength)) {
+                        // Replace topic by last one
+                        memcpy(this->topics[i], this->topics[--this->topicCount], SIM_TOPIC_SIZE);
+                        break;
+                    }
+                }
+                pos += 2 + topicLength;
+            }
+            brokerSend(unsuback, sizeof(unsuback));
+            break;
+        }
+        case 12: {                                          // PINGREQ
+            static const uint8_t pingresp[] = {0xd0, 0x00};
+            brokerSend(pingresp, sizeof(pingresp));
+            break;
+        }
+        case 14:                                            // DISCONNECT
+            closeConnection();
+            break;
+    }
+}
+
+// WiFi
+bool ESP8266WiFiClass::hostname(const char* name) {
+    (void) name;
+    return true;
+}
+
+bool ESP8266WiFiClass::mode(WiFiMode_t mode) {
+    (void) mode;
+    return true;
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeConnected(std::function<void(const WiFiEventStationModeConnected&)> handler) {
+    onConnectedHandler = handler;
+    return std::make_shared<WiFiEventHandlerOpaque>();
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> handler) {
+    onDisconnectedHandler = handler;
+    return std::make_shared<WiFiEventHandlerOpaque>();
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> handler) {
+    onGotIPHandler = handler;
+    return std::make_shared<WiFiEventHandlerOpaque>();
+}
+
+bool ESP8266WiFiClass::setAutoConnect(bool autoConnect) {
+    (void) autoConnect;
+    return true;
+}
+
+bool ESP8266WiFiClass::setAutoReconnect(bool autoReconnect) {
+    simNetwork.wifiAutoReconnect = autoReconnect;
+    return true;
+}
+
+bool ESP8266WiFiClass::setSleepMode(WiFiSleepType_t type, uint8_t listenInterval) {
+    (void) type;
+    (void) listenInterval;
+    return true;
+}
+
+bool ESP8266WiFiClass::config(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns1, IPAddress dns2) {
+    (void) gateway;
+    (void) subnet;
+    (void) dns1;
+    (void) dns2;
+    // No DHCP when address is given
+    simNetwork.wifiStaticIp = ip.isSet();
+    return true;
+}
+
+wl_status_t ESP8266WiFiClass::begin(const char* ssid, const char* key, int32_t channel, const uint8_t* bssid, bool connect) {
+    (void) ssid;
+    (void) key;
+    if (simNetwork.wifiStatus == WL_CONNECTED) {
+        simNetwork.wifiStatus = WL_DISCONNECTED;
+        simNetwork.closeConnection();
+        simNetwork.httpClose();
+    }
+    simNetwork.wifiBegun = connect;
+    // Channel and BSSID save scan time, if they're the right ones
+    bool fast = channel == ACCESS_POINT_CHANNEL && bssid && !memcmp(bssid, accessPointBssid, sizeof(accessPointBssid));
+    bool wrong = (channel || bssid) && !fast;
+    if (connect && !wrong) {
+        simNetwork.wifiAttempt(fast ? simNetwork.wifiFastConnectTime : simNetwork.wifiConnectTime);
+    }
+    return simNetwork.wifiStatus;
+}
+
+bool ESP8266WiFiClass::disconnect(bool wifiOff) {
+    (void) wifiOff;
+    simNetwork.wifiBegun = false;
+    simNetwork.wifiStatus = WL_DISCONNECTED;
+    simNetwork.closeConnection();
+    simNetwork.httpClose();
+    return true;
+}
+
+wl_status_t ESP8266WiFiClass::status() {
+    return simNetwork.wifiStatus;
+}
+
+bool ESP8266WiFiClass::isConnected() {
+    return simNetwork.wifiStatus == WL_CONNECTED;
+}
+
+IPAddress ESP8266WiFiClass::localIP() {
+    return isConnected() ? LOCAL_IP : IPAddress();
+}
+
+IPAddress ESP8266WiFiClass::gatewayIP() {
+    return isConnected() ? GATEWAY_IP : IPAddress();
+}
+
+IPAddress ESP8266WiFiClass::subnetMask() {
+    return isConnected() ? SUBNET_MASK : IPAddress();
+}
+
+IPAddress ESP8266WiFiClass::dnsIP(uint8_t index) {
+    (void) index;
+    return isConnected() ? GATEWAY_IP : IPAddress();
+}
+
+uint8_t* ESP8266WiFiClass::BSSID() {
+    return accessPointBssid;
+}
+
+int32_t ESP8266WiFiClass::channel() {
+    return ACCESS_POINT_CHANNEL;
+}
+
+int32_t ESP8266WiFiClass::RSSI() {
+    return -62;
+}
+
+// Request complete, prepare answer
+void SimNetwork::httpAnswer() {
+    this->httpRequests++;
+    if (this->verbose) {
+        printf("%10.3f http < %.*s\n", simBoard.time / 1000000.0, (int) strcspn(this->httpRequest, "\r\n"), this->httpRequest);
+    }
+    char path[SIM_TOPIC_SIZE] = "";
+    sscanf(this->httpRequest, "GET %127s", path);
+    const char* range = strstr(this->httpRequest, "\r\nRange: bytes=");
+    size_t start = range ? strtoul(range + strlen("\r\nRange: bytes="), NULL, 10) : 0;
+    if (range) {
+        this->httpRangeRequests++;
+    }
+    this->httpBodyRead = 0;
+    this->httpHeaderRead = 0;
+    if (!this->httpData || strcmp(path, this->httpPath)) {
+        this->httpBodyStart = 0;
+        this->httpBodyLength = 0;
+        this->httpHeaderLength = snprintf(this->httpHeader, sizeof(this->httpHeader),
+            "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    } else if (range && this->httpRange && start < this->httpSize) {
+        this->httpBodyStart = start;
+        this->httpBodyLength = this->httpSize - start;
+        this->httpHeaderLength = snprintf(this->httpHeader, sizeof(this->httpHeader),
+            "HTTP/1.0 206 Partial Content\r\nContent-Type: application/octet-stream\r\n"
+            "Content-Range: bytes %u-%u/%u\r\nContent-Length: %u\r\n\r\n",
+            (unsigned) start, (unsigned) this->httpSize - 1, (unsigned) this->httpSize, (unsigned) this->httpBodyLength);
+    } else {
+        this->httpBodyStart = 0;
+        this->httpBodyLength = this->httpSize;
+        this->httpHeaderLength = snprintf(this->httpHeader, sizeof(this->httpHeader),
+            "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %u\r\n\r\n",
+            (unsigned) this->httpBodyLength);
+    }
+    this->httpBodyEnd = this->httpBodyLength;
+    if (this->httpDrops && this->httpDropAfter < this->httpBodyLength) {
+        this->httpDrops--;
+        this->httpBodyEnd = this->httpDropAfter;
+    }
+}
+
+// Answer bytes client can read now
+size_t SimNetwork::httpAvailable() {
+    if (!this->httpHeaderLength) {
+        return 0;
+    }
+    return min(this->httpHeaderLength - this->httpHeaderRead + this->httpBodyEnd - this->httpBodyRead, this->httpWindow);
+}
+
+int SimNetwork::httpRead(uint8_t* buffer, size_t size) {
+    size = min(size, httpAvailable());
+    size_t done = 0;
+    while (done < size && this->httpHeaderRead < this->httpHeaderLength) {
+        buffer[done++] = this->httpHeader[this->httpHeaderRead++];
+    }
+    memcpy(buffer + done, this->httpData + this->httpBodyStart + this->httpBodyRead, size - done);
+    this->httpBodyRead += size - done;
+    this->httpBodyBytes += size - done;
+    if (!httpAvailable()) {
+        // Answer sent (or connection lost)
+        httpClose();
+    }
+    return size;
+}
+
+void SimNetwork::httpClose() {
+    this->httpClient = NULL;
+    this->httpRequestLength = 0;
+    this->httpHeaderLength = 0;
+}
+
+// TCP client (connected to simulated broker, or HTTP server on its port)
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+    (void) ip;
+    return connect("", port);
+}
+
+int WiFiClient::connect(const char* host, uint16_t port) {
+    (void) host;
+    if (port == simNetwork.httpPort) {
+        if (simNetwork.wifiStatus != WL_CONNECTED || !simNetwork.httpUp) {
+            return 0;
+        }
+        simNetwork.httpClose();
+        simNetwork.httpClient = this;
+        return 1;
+    }
+    if (simNetwork.wifiStatus != WL_CONNECTED || !simNetwork.brokerUp) {
+        return 0;
+    }
+    simNetwork.closeConnection();
+    simNetwork.client = this;
+    simNetwork.topicCount = 0;
+    simNetwork.tcpConnects++;
+    return 1;
+}
+
+size_t WiFiClient::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size) {
+    if (simNetwork.httpClient == this) {
+        if (simNetwork.httpHeaderLength || simNetwork.httpRequestLength + size >= sizeof(simNetwork.httpRequest)) {
+            return 0;
+        }
+        memcpy(simNetwork.httpRequest + simNetwork.httpRequestLength, buffer, size);
+        simNetwork.httpRequestLength += size;
+        simNetwork.httpRequest[simNetwork.httpRequestLength] = 0;
+        if (strstr(simNetwork.httpRequest, "\r\n\r\n")) {
+            simNetwork.httpAnswer();
+        }
+        return size;
+    }
+    if (!connected() || simNetwork.inLength + size > sizeof(simNetwork.inBuffer)) {
+        return 0;
+    }
+    simNetwork.tcpWrites++;
+    simNetwork.tcpBytes += size;
+    memcpy(simNetwork.inBuffer + simNetwork.inLength, buffer, size);
+    simNetwork.inLength += size;
+    // Give complete packets to broker
+    for (;;) {
+        size_t pos = 1;
+        size_t remaining = 0;
+        uint8_t shift = 0;
+        bool complete = false;
+        while (pos < simNetwork.inLength && pos < 5) {
+            uint8_t digit = simNetwork.inBuffer[pos++];
+            remaining |= (size_t) (digit & 0x7f) << shift;
+            shift += 7;
+            if (!(digit & 0x80)) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete || pos + remaining > simNetwork.inLength) {
+            break;
+        }
+        size_t length = pos + remaining;
+        simNetwork.brokerPacket(simNetwork.inBuffer, length);
+        if (!connected()) {
+            break;
+        }
+        memmove(simNetwork.inBuffer, simNetwork.inBuffer + length, simNetwork.inLength - length);
+        simNetwork.inLength -= length;
+    }
+    return size;
+}
+
+int WiFiClient::available() {
+    if (simNetwork.httpClient == this) {
+        return simNetwork.httpAvailable();
+    }
+    if (!connected()) {
+        return 0;
+    }
+    if (!simNetwork.outVisible) {
+        // Nothing received: polling costs a bit of time (and lets busy waits end)
+        simBoard.advance(10);
+    }
+    return simNetwork.outVisible;
+}
+
+int WiFiClient::read() {
+    uint8_t c;
+    return (read(&c, 1) == 1) ? c : -1;
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+    if (simNetwork.httpClient == this) {
+        return simNetwork.httpAvailable() ? simNetwork.httpRead(buffer, size) : -1;
+    }
+    if (!connected() || !simNetwork.outVisible) {
+        return -1;
+    }
+    size = min(size, simNetwork.outVisible);
+    memcpy(buffer, simNetwork.outBuffer, size);
+    memmove(simNetwork.outBuffer, simNetwork.outBuffer + size, simNetwork.outLength - size);
+    simNetwork.outLength -= size;
+    simNetwork.outVisible -= size;
+    return size;
+}
+
+int WiFiClient::peek() {
+    if (simNetwork.httpClient == this) {
+        if (!simNetwork.httpAvailable()) {
+            return -1;
+        }
+        return (simNetwork.httpHeaderRead < simNetwork.httpHeaderLength) ? (uint8_t) simNetwork.httpHeader[simNetwork.httpHeaderRead]
+            : simNetwork.httpData[simNetwork.httpBodyStart + simNetwork.httpBodyRead];
+    }
+    return (connected() && simNetwork.outVisible) ? simNetwork.outBuffer[0] : -1;
+}
+
+void WiFiClient::stop() {
+    if (simNetwork.httpClient == this) {
+        simNetwork.httpClose();
+    } else if (connected()) {
+        simNetwork.closeConnection();
+    }
+}
+
+uint8_t WiFiClient::connected() {
+    return simNetwork.client == this || simNetwork.httpClient == this;
+}
+
+// UDP (syslog and telemetry)
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+    (void) ip;
+    this->packetLength = 0;
+    this->packetPort = port;
+    return simNetwork.wifiStatus == WL_CONNECTED;
+}
+
+int WiFiUDP::beginPacket(const char* host, uint16_t port) {
+    (void) host;
+    return beginPacket(IPAddress(), port);
+}
+
+int WiFiUDP::endPacket() {
+    if (this->packetPort == simNetwork.syslogPort) {
+        simNetwork.syslogPacket(this->packet, this->packetLength);
+    } else {
+        simNetwork.udpPacket(this->packet, this->packetLength);
+    }
+    this->packetLength = 0;
+    return 1;
+}
+
+size_t WiFiUDP::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t WiFiUDP::write(const uint8_t* buffer, size_t size) {
+    size = min(size, sizeof(this->packet) - this->packetLength);
+    memcpy(this->packet + this->packetLength, buffer, size);
+    this->packetLength += size;
+    return size;
+}
+
+// ESP-NOW
+int esp_now_init(void) {
+    return 0;
+}
+
+int esp_now_set_self_role(u8 role) {
+    (void) role;
+    return 0;
+}
+
+int esp_now_add_peer(u8* mac, u8 role, u8 channel, u8* key, u8 keyLength) {
+    (void) mac;
+    (void) role;
+    (void) channel;
+    (void) key;
+    (void) keyLength;
+    return 0;
+}
+
+int esp_now_send(u8* mac, u8* data, int length) {
+    (void) mac;
+    if (length > SIM_ESPNOW_SIZE) {
+        return -1;
+    }
+    if (simNetwork.verbose) {
+        printf("%10.3f espnow > %d bytes\n", simBoard.time / 1000000.0, length);
+    }
+    memcpy(simNetwork.espnowFrame, data, length);
+    simNetwork.espnowLength = length;
+    simNetwork.espnowCount++;
+    return 0;
+}
+
+int esp_now_register_recv_cb(esp_now_recv_cb_t callback) {
+    simNetwork.espnowCallback = callback;
+    return 0;
+}
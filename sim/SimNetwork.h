@@ -0,0 +1,192 @@
+/*
+  SimNetwork.h - Simulated WiFi access point, MQTT broker, Milight hub and HTTP server, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Broker accepts one TCP connection (firmware's one), understands CONNECT, SUBSCRIBE, UNSUBSCRIBE,
+  PUBLISH, PINGREQ and DISCONNECT (QoS 0 only), and keeps last state of each bulb, as well as
+  messages published as retained by firmware, as retained messages.
+  Hub answers each command published on a bulb command topic by publishing bulb state on its
+  state and update topics, after a delay.
+
+  ESP-NOW frames sent by firmware are kept (last one), and frames from peers can be given
+  to firmware receive callback.
+
+  HTTP server (on httpPort, other ports being broker ones) accepts one connection at a time,
+  answers GET requests on a given resource (honouring "Range: bytes=start-"), then closes
+  connection once answer is read, or sooner to simulate a connection loss.
+
+  All settings may be changed by scenarios at any time, to simulate network failures.
+*/
+
+#ifndef SimNetwork_h
+#define SimNetwork_h
+
+#include <ESP8266WiFi.h>
+#include <espnow.h>
+
+// SIM_MAX_BULBS : number of bulbs known by hub
+#define SIM_MAX_BULBS 8
+// SIM_MAX_TOPICS : number of topics broker keeps subscriptions for
+#define SIM_MAX_TOPICS 16
+// SIM_TOPIC_SIZE : maximum topic length (with null)
+#define SIM_TOPIC_SIZE 128
+// SIM_TCP_BUFFER_SIZE : size of each TCP direction buffer
+#define SIM_TCP_BUFFER_SIZE 8192
+// SIM_MAX_RETAINED : number of retained messages published by firmware broker keeps
+#define SIM_MAX_RETAINED 4
+// SIM_PAYLOAD_SIZE : maximum payload length (with null)
+#define SIM_PAYLOAD_SIZE 256
+// SIM_ESPNOW_SIZE : maximum ESP-NOW frame length
+#define SIM_ESPNOW_SIZE 250
+// SIM_UDP_SIZE : maximum telemetry frame length
+#define SIM_UDP_SIZE 512
+// SIM_MAX_EVENTS : number of pending events
+#define SIM_MAX_EVENTS 64
+// SIM_HTTP_REQUEST_SIZE : maximum HTTP request length
+#define SIM_HTTP_REQUEST_SIZE 512
+
+class SimNetwork {
+private:
+   enum eventTypes {EVENT_WIFI_CONNECT, EVENT_WIFI_GOT_IP, EVENT_CONNACK, EVENT_HUB_ACK};
+   struct Event {
+      uint64_t time;                                        // Virtual time (us) when event occurs
+      uint8_t type;                                         // Event type
+      uint8_t arg;                                          // Bulb index for hub acks
+      bool state;                                           // Bulb state for hub acks
+      uint16_t generation;                                  // WiFi attempt or TCP connection it belongs to
+      bool used;
+   };
+   struct Bulb {
+      char commandTopic[SIM_TOPIC_SIZE];
+      char stateTopic[SIM_TOPIC_SIZE];
+      char updateTopic[SIM_TOPIC_SIZE];
+      bool on;                                              // Last state set by a command
+      unsigned long commands;                               // Count of commands received
+   };
+   struct Retained {
+      char topic[SIM_TOPIC_SIZE];
+      char payload[SIM_PAYLOAD_SIZE];
+   };
+   Event events[SIM_MAX_EVENTS];
+   Retained retainedMessages[SIM_MAX_RETAINED];
+   uint8_t retainedCount;
+   Bulb bulbs[SIM_MAX_BULBS];
+   uint8_t bulbCount;
+   char topics[SIM_MAX_TOPICS][SIM_TOPIC_SIZE];             // Subscribed topics
+   uint8_t topicCount;
+   // WiFi
+   wl_status_t wifiStatus;
+   bool wifiBegun;                                          // Connection asked by firmware
+   bool wifiAutoReconnect;
+   uint16_t wifiGeneration;
+   // TCP connection and MQTT session
+   WiFiClient* client;                                      // Client connected to broker (or NULL)
+   uint16_t tcpGeneration;
+   bool mqttSession;                                        // CONNACK sent
+   uint8_t inBuffer[SIM_TCP_BUFFER_SIZE];                   // Bytes written by client, not yet parsed
+   size_t inLength;
+   uint8_t outBuffer[SIM_TCP_BUFFER_SIZE];                  // Bytes sent by broker, not yet read by client
+   size_t outLength;
+   size_t outVisible;                                       // Bytes of outBuffer client can already read
+   uint64_t lastChunkTime;
+   void schedule(unsigned long delayMs, uint8_t type, uint16_t generation, uint8_t arg = 0, bool state = false);
+   void wifiAttempt(unsigned long delayMs);
+   void brokerPacket(const uint8_t* packet, size_t length);
+   void brokerSend(const uint8_t* data, size_t length);
+   void brokerPublish(const char* topic, const char* payload);
+   void bulbPublish(uint8_t index, bool retained);
+   bool subscribed(const char* topic);
+   esp_now_recv_cb_t espnowCallback;
+   friend int esp_now_register_recv_cb(esp_now_recv_cb_t callback);
+   friend int esp_now_send(u8* mac, u8* data, int length);
+   void closeConnection();
+   // HTTP server
+   char httpPath[SIM_TOPIC_SIZE];                           // Resource path
+   const uint8_t* httpData;                                 // Resource data
+   size_t httpSize;
+   WiFiClient* httpClient;                                  // Client connected to HTTP server (or NULL)
+   char httpRequest[SIM_HTTP_REQUEST_SIZE];                 // Request being received
+   size_t httpRequestLength;
+   char httpHeader[256];                                    // Answer headers
+   size_t httpHeaderLength;                                 // Their length (0 until request is complete)
+   size_t httpHeaderRead;                                   // Header bytes read by client
+   size_t httpBodyStart;                                    // Resource offset of answer body
+   size_t httpBodyLength;
+   size_t httpBodyRead;                                     // Body bytes read by client
+   size_t httpBodyEnd;                                      // Body bytes sent before closing connection
+   void httpAnswer();
+   size_t httpAvailable();
+   int httpRead(uint8_t* buffer, size_t size);
+   void httpClose();
+   friend class ESP8266WiFiClass;
+   friend class WiFiClient;
+   friend class WiFiUDP;
+public:
+   // Settings
+   bool accessPointUp = true;                               // Access point reachable
+   bool brokerUp = true;                                    // Broker accepts connections
+   bool hubUp = true;                                       // Hub answers commands
+   bool wifiStaticIp = false;                               // IP given by config() (no DHCP delay)
+   unsigned long wifiConnectTime = 1500;                    // Connection with a full scan (ms)
+   unsigned long wifiFastConnectTime = 150;                 // Connection with given channel and BSSID (ms)
+   unsigned long dhcpTime = 200;                            // DHCP answer delay (ms)
+   unsigned long connackDelay = 20;                         // Broker CONNECT answer delay (ms)
+   unsigned long ackDelay = 80;                             // Hub command to state message delay (ms)
+   uint16_t chunkSize = 0;                                  // Deliver received TCP data by chunks of this size (0 for whole packets)
+   unsigned long chunkInterval = 1000;                      // Delay between two chunks (us)
+   bool verbose = false;                                    // Print syslog traces and MQTT traffic
+   uint16_t syslogPort = 514;                               // UDP port of syslog packets (others are telemetry)
+   bool httpUp = true;                                      // HTTP server accepts connections
+   uint16_t httpPort = 8080;                                // HTTP server TCP port
+   bool httpRange = true;                                   // Range requests honoured (else whole resource is sent)
+   uint8_t httpDrops = 0;                                   // Count of next answers whose connection is lost...
+   size_t httpDropAfter = 0;                                // ...after this many body bytes
+   size_t httpWindow = 2920;                                // Answer bytes client can read at once
+   // Stats
+   unsigned long tcpConnects = 0;                           // Accepted TCP connections
+   unsigned long tcpWrites = 0;                             // Client write() calls
+   unsigned long tcpBytes = 0;                              // Bytes written by client
+   unsigned long publishCount = 0;                          // PUBLISH packets received by broker
+   unsigned long retainedPublishCount = 0;                  // PUBLISH packets received by broker with retain flag
+   unsigned long syslogCount = 0;                           // Syslog packets received
+   unsigned long espnowCount = 0;                           // ESP-NOW frames sent by firmware
+   uint8_t espnowFrame[SIM_ESPNOW_SIZE];                    // Last ESP-NOW frame sent by firmware
+   uint8_t espnowLength = 0;                                // Its length
+   unsigned long udpCount = 0;                              // Other UDP packets received (telemetry)
+   uint8_t udpFrame[SIM_UDP_SIZE];                          // Last of them
+   size_t udpLength = 0;                                    // Its length
+   unsigned long httpRequests = 0;                          // HTTP requests received
+   unsigned long httpRangeRequests = 0;                     // Of them, with a Range header
+   unsigned long httpBodyBytes = 0;                         // Body bytes read by client
+   SimNetwork();
+   // Process events due at current time (called by SimBoard::advance)
+   void poll();
+   // Declare a bulb managed by hub (topics are copied, state/update topics can be NULL)
+   void addBulb(const char* commandTopic, const char* stateTopic, const char* updateTopic);
+   // Publish a bulb state, as if changed by another remote (without any command)
+   void publishState(uint8_t index, bool on);
+   // Bulb state known by hub, and count of commands it received
+   bool bulbOn(uint8_t index);
+   unsigned long bulbCommands(uint8_t index);
+   // Last retained message published by firmware on a topic (NULL if none)
+   const char* retained(const char* topic);
+   // Change access point or broker availability (dropping current connection if going down)
+   void setAccessPoint(bool up);
+   void setBroker(bool up);
+   // Is firmware connected to broker?
+   bool mqttConnected();
+   // Give a frame from a peer to firmware ESP-NOW callback
+   void espnowReceive(const uint8_t* data, uint8_t length);
+   // Receive a syslog packet
+   void syslogPacket(const char* packet, size_t length);
+   // Receive another UDP packet
+   void udpPacket(const char* packet, size_t length);
+   // Publish a message, as if sent by another client
+   void publish(const char* topic, const char* payload);
+   // Give resource served by HTTP server (data is not copied, NULL to remove it)
+   void setHttpResource(const char* path, const uint8_t* data, size_t size);
+};
+extern SimNetwork simNetwork;
+
+#endif
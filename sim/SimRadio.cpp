@@ -0,0 +1,87 @@
+/*
+  SimRadio.cpp - Simulated LT8900 radio on SPI bus, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#include "SimRadio.h"
+#include "SimBoard.h"
+#include <SPI.h>
+#include <string.h>
+
+#define SIM_RADIO_CHANNEL 7
+#define SIM_RADIO_STATUS 48
+#define SIM_RADIO_FIFO 50
+#define SIM_RADIO_FIFO_CONTROL 52
+#define SIM_RADIO_TX_ENABLE 0x0100
+#define SIM_RADIO_PACKET_FLAG 0x0040
+
+SimRadio simRadio;
+SPIClass SPI;
+
+SimRadio::SimRadio() {
+    memset(this->registers, 0, sizeof(this->registers));
+    memset(this->packet, 0, sizeof(this->packet));
+    this->fifoLength = 0;
+    this->address = 0;
+    this->position = 0;
+    this->value = 0;
+}
+
+uint16_t SimRadio::readRegister(uint8_t reg) {
+    return this->registers[reg & 0x3f];
+}
+
+void SimRadio::writeRegister(uint8_t reg, uint16_t value) {
+    reg &= 0x3f;
+    this->registers[reg] = value;
+    if (reg == SIM_RADIO_FIFO_CONTROL && (value & 0x8000)) {
+        // Clear TX FIFO
+        this->fifoLength = 0;
+    } else if (reg == SIM_RADIO_CHANNEL) {
+        this->registers[SIM_RADIO_STATUS] &= ~SIM_RADIO_PACKET_FLAG;
+        if (value & SIM_RADIO_TX_ENABLE) {
+            // Send FIFO content
+            memcpy(this->packet, this->fifo, this->fifoLength);
+            this->packetChannel = value & 0x7f;
+            this->packetCount++;
+            this->registers[SIM_RADIO_STATUS] |= SIM_RADIO_PACKET_FLAG;
+        }
+    }
+}
+
+void SPIClass::beginTransaction(SPISettings settings) {
+    (void) settings;
+    simRadio.position = 0;
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+    // Each byte takes 2 us at 4 MHz
+    simBoard.advance(2);
+    if (!simRadio.present) {
+        return 0;
+    }
+    uint8_t position = simRadio.position++;
+    if (!position) {
+        simRadio.address = data;
+        simRadio.value = 0;
+        return 0;
+    }
+    uint8_t reg = simRadio.address & 0x7f;
+    if (simRadio.address & 0x80) {
+        // Register read, high byte first
+        uint16_t value = simRadio.readRegister(reg);
+        return (position == 1) ? value >> 8 : value & 0xff;
+    }
+    if (reg == SIM_RADIO_FIFO) {
+        // FIFO data
+        if (simRadio.fifoLength < SIM_RADIO_FIFO_SIZE) {
+            simRadio.fifo[simRadio.fifoLength++] = data;
+        }
+    } else if (position == 1) {
+        simRadio.value = data << 8;
+    } else if (position == 2) {
+        simRadio.writeRegister(reg, simRadio.value | data);
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+  SimRadio.h - Simulated LT8900 radio on SPI bus, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Keeps 16 bits registers written by firmware and its FIFO. Each write of TX enable bit in
+  channel register "sends" FIFO content: it's kept as last packet, with its channel, and
+  packet sent flag is set in status register.
+
+  Each SPI transaction starts with register address (bit 7 set for a read), followed by
+  2 bytes (register value) or any count of bytes (FIFO data).
+*/
+
+#ifndef SimRadio_h
+#define SimRadio_h
+
+#include <Arduino.h>
+
+// SIM_RADIO_FIFO_SIZE : size of radio FIFO
+#define SIM_RADIO_FIFO_SIZE 64
+
+class SimRadio {
+private:
+   uint16_t registers[64];
+   uint8_t fifo[SIM_RADIO_FIFO_SIZE];
+   uint8_t fifoLength;
+   uint8_t address;                                         // Register of current transaction
+   uint8_t position;                                        // Bytes transferred in current transaction
+   uint16_t value;                                          // Register value being written
+   void writeRegister(uint8_t reg, uint16_t value);
+   friend class SPIClass;
+public:
+   // Settings
+   bool present = true;                                     // Radio answers on SPI bus (else reads give 0)
+   // Last packet sent and stats
+   uint8_t packet[SIM_RADIO_FIFO_SIZE];                     // Last packet sent (length first)
+   uint8_t packetChannel = 0;                               // Radio channel of last packet sent
+   unsigned long packetCount = 0;                           // Packets sent
+   SimRadio();
+   uint16_t readRegister(uint8_t reg);
+};
+extern SimRadio simRadio;
+
+#endif
@@ -0,0 +1,145 @@
+/*
+  Arduino.h - ESP8266 Arduino core mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Only what firmware and its libraries use is declared. Time, pins, RTC memory and
+  heap are simulated by SimBoard (see ../SimBoard.h).
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "IPAddress.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 3
+#define RISING 4
+#define FALLING 5
+
+// D1 mini pins
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define A0 17
+
+// Flash strings are plain strings
+#define PROGMEM
+#define PSTR(x) (x)
+#define PGM_P const char*
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_byte_near(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define pgm_read_dword(p) (*(const uint32_t*)(p))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strncpy_P strncpy
+#define snprintf_P snprintf
+#define vsnprintf_P vsnprintf
+
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+#define digitalPinToInterrupt(p) (p)
+#define noInterrupts()
+#define interrupts()
+
+// GPIO pin configuration registers (interrupt type and wake up enable), only stored
+extern uint32_t simGpioConfig[16];
+#define GPC(p) simGpioConfig[(p) & 0xF]
+#define GPCI 7
+#define GPCWE 10
+
+using std::min;
+using std::max;
+template<class T, class L, class H> T constrain(T x, L low, H high) { return x < low ? low : (x > high ? high : x); }
+
+// Time (virtual, see SimBoard)
+unsigned long millis();
+unsigned long micros();
+uint64_t micros64();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+// Pins
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+int analogRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode);
+void attachInterruptArg(uint8_t pin, void (*handler)(void*), void* arg, int mode);
+void detachInterrupt(uint8_t pin);
+
+// Random (deterministic, so that runs can be compared)
+long random(long high);
+long random(long low, long high);
+void randomSeed(unsigned long seed);
+
+// Reset information
+#define REASON_DEFAULT_RST 0
+#define REASON_WDT_RST 1
+#define REASON_EXCEPTION_RST 2
+#define REASON_SOFT_WDT_RST 3
+#define REASON_SOFT_RESTART 4
+#define REASON_DEEP_SLEEP_AWAKE 5
+#define REASON_EXT_SYS_RST 6
+struct rst_info {
+   uint32_t reason;
+};
+struct rst_info* system_get_rst_info();
+
+class EspClass {
+public:
+   uint32_t getChipId();
+   uint32_t getFreeHeap();
+   uint32_t getMaxFreeBlockSize();
+   uint8_t getHeapFragmentation();
+   uint32_t getCycleCount();
+   uint8_t getCpuFreqMHz();
+   bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+   bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+   bool flashEraseSector(uint32_t sector);
+   bool flashWrite(uint32_t address, const uint32_t* data, size_t size);
+   bool flashRead(uint32_t address, uint32_t* data, size_t size);
+   uint32_t getSketchSize();
+   String getSketchMD5();
+   void restart();
+};
+extern EspClass ESP;
+
+class HardwareSerial : public Stream {
+public:
+   void begin(unsigned long baud) { (void) baud; }
+   size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+   using Print::write;
+   int available() { return 0; }
+   int read() { return -1; }
+   int peek() { return -1; }
+};
+extern HardwareSerial Serial;
+
+#endif
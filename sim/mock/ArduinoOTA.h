@@ -0,0 +1,34 @@
+/*
+  ArduinoOTA.h - ArduinoOTA mock, for native simulation (no update is ever received).
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef ArduinoOTA_h
+#define ArduinoOTA_h
+
+#include <functional>
+#include <Updater.h>
+
+typedef int ota_error_t;
+#define OTA_AUTH_ERROR 0
+#define OTA_BEGIN_ERROR 1
+#define OTA_CONNECT_ERROR 2
+#define OTA_RECEIVE_ERROR 3
+#define OTA_END_ERROR 4
+
+class ArduinoOTAClass {
+public:
+   void setHostname(const char* hostname) { (void) hostname; }
+   void setPassword(const char* password) { (void) password; }
+   void onStart(std::function<void()> callback) { (void) callback; }
+   void onEnd(std::function<void()> callback) { (void) callback; }
+   void onError(std::function<void(ota_error_t)> callback) { (void) callback; }
+   void onProgress(std::function<void(unsigned int, unsigned int)> callback) { (void) callback; }
+   int getCommand() { return U_FLASH; }
+   void begin(bool useMDNS = true) { (void) useMDNS; }
+   void handle() {}
+};
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif
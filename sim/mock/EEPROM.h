@@ -0,0 +1,36 @@
+/*
+  EEPROM.h - ESP8266 EEPROM mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+class EEPROMClass {
+private:
+   uint8_t data[4096];
+public:
+   unsigned long commitCount = 0;                           // Count of (simulated) flash writes
+   EEPROMClass() { memset(data, 0xff, sizeof(data)); }
+   void begin(size_t size) { (void) size; }
+   bool commit() { commitCount++; return true; }
+   void end() {}
+   uint8_t read(int address) { return data[address]; }
+   void write(int address, uint8_t value) { data[address] = value; }
+   template<typename T> T& get(int address, T& value) {
+      memcpy(&value, data + address, sizeof(T));
+      return value;
+   }
+   template<typename T> const T& put(int address, const T& value) {
+      memcpy(data + address, &value, sizeof(T));
+      return value;
+   }
+};
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,93 @@
+/*
+  ESP8266WiFi.h - ESP8266 WiFi and TCP client mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Access point and MQTT broker are simulated by SimNetwork (see ../SimNetwork.h).
+*/
+
+#ifndef ESP8266WiFi_h
+#define ESP8266WiFi_h
+
+#include <memory>
+#include "Arduino.h"
+#include "Client.h"
+
+#define WL_IDLE_STATUS 0
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 7
+typedef int wl_status_t;
+
+#define WIFI_OFF 0
+#define WIFI_STA 1
+typedef int WiFiMode_t;
+
+#define WIFI_NONE_SLEEP 0
+#define WIFI_LIGHT_SLEEP 1
+#define WIFI_MODEM_SLEEP 2
+typedef int WiFiSleepType_t;
+
+struct WiFiEventStationModeConnected {
+   String ssid;
+   uint8_t bssid[6];
+   uint8_t channel;
+};
+struct WiFiEventStationModeDisconnected {
+   String ssid;
+   uint8_t bssid[6];
+   int reason;
+};
+struct WiFiEventStationModeGotIP {
+   IPAddress ip;
+   IPAddress mask;
+   IPAddress gw;
+};
+
+// Handlers stay registered while returned handle is kept
+struct WiFiEventHandlerOpaque {};
+typedef std::shared_ptr<WiFiEventHandlerOpaque> WiFiEventHandler;
+
+class ESP8266WiFiClass {
+public:
+   bool hostname(const char* name);
+   bool mode(WiFiMode_t mode);
+   WiFiEventHandler onStationModeConnected(std::function<void(const WiFiEventStationModeConnected&)> handler);
+   WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> handler);
+   WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> handler);
+   bool setAutoConnect(bool autoConnect);
+   bool setAutoReconnect(bool autoReconnect);
+   bool setSleepMode(WiFiSleepType_t type, uint8_t listenInterval = 0);
+   bool config(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns1 = IPAddress(), IPAddress dns2 = IPAddress());
+   wl_status_t begin(const char* ssid, const char* key, int32_t channel = 0, const uint8_t* bssid = nullptr, bool connect = true);
+   bool disconnect(bool wifiOff = false);
+   wl_status_t status();
+   bool isConnected();
+   IPAddress localIP();
+   IPAddress gatewayIP();
+   IPAddress subnetMask();
+   IPAddress dnsIP(uint8_t index = 0);
+   uint8_t* BSSID();
+   int32_t channel();
+   int32_t RSSI();
+};
+extern ESP8266WiFiClass WiFi;
+
+class WiFiClient : public Client {
+public:
+   int connect(IPAddress ip, uint16_t port);
+   int connect(const char* host, uint16_t port);
+   size_t write(uint8_t c);
+   size_t write(const uint8_t* buffer, size_t size);
+   int available();
+   int read();
+   int read(uint8_t* buffer, size_t size);
+   int peek();
+   void flush() {}
+   void stop();
+   uint8_t connected();
+   operator bool() { return connected(); }
+   void setNoDelay(bool noDelay) { (void) noDelay; }
+   void setTimeout(unsigned long timeout) { (void) timeout; }
+};
+
+#endif
@@ -0,0 +1,36 @@
+/*
+  IPAddress.h - Arduino IPAddress mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include "WString.h"
+
+// IPv4 address, first byte in lowest bits (as on ESP8266)
+class IPAddress {
+private:
+   uint32_t address = 0;
+public:
+   IPAddress() {}
+   IPAddress(uint32_t value) : address(value) {}
+   IPAddress(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+      : address(b0 | (b1 << 8) | (b2 << 16) | ((uint32_t) b3 << 24)) {}
+   operator uint32_t() const { return address; }
+   bool operator==(const IPAddress& other) const { return address == other.address; }
+   uint8_t operator[](int index) const { return (address >> (8 * index)) & 0xff; }
+   bool isSet() const { return address != 0; }
+   String toString() const {
+      char buffer[16];
+      snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+      return String(buffer);
+   }
+};
+
+#define INADDR_NONE IPAddress(0xffffffff)
+
+#endif
@@ -0,0 +1,52 @@
+/*
+  Print.h - Arduino Print mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef Print_h
+#define Print_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "WString.h"
+
+class Print {
+public:
+   virtual ~Print() {}
+   virtual size_t write(uint8_t c) = 0;
+   virtual size_t write(const uint8_t* buffer, size_t size) {
+      size_t written = 0;
+      while (size--) {
+         written += write(*buffer++);
+      }
+      return written;
+   }
+   size_t write(const char* text) { return write((const uint8_t*) text, strlen(text)); }
+   size_t print(const char* text) { return write(text); }
+   size_t print(const __FlashStringHelper* text) { return write((const char*) text); }
+   size_t print(const String& text) { return write(text.c_str()); }
+   size_t print(char c) { return write((uint8_t) c); }
+   size_t print(int value) { return printf("%d", value); }
+   size_t print(unsigned int value) { return printf("%u", value); }
+   size_t print(long value) { return printf("%ld", value); }
+   size_t print(unsigned long value) { return printf("%lu", value); }
+   size_t println() { return write('\n'); }
+   size_t println(const char* text) { return print(text) + println(); }
+   size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+      char buffer[256];
+      va_list args;
+      va_start(args, format);
+      int length = vsnprintf(buffer, sizeof(buffer), format, args);
+      va_end(args);
+      if (length < 0) {
+         return 0;
+      }
+      return write((const uint8_t*) buffer, length < (int) sizeof(buffer) ? length : sizeof(buffer) - 1);
+   }
+};
+
+#endif
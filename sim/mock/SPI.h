@@ -0,0 +1,35 @@
+/*
+  SPI.h - ESP8266 SPI mock, for native simulation (bytes go to simulated LT8900 radio).
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef SPI_h
+#define SPI_h
+
+#include <stdint.h>
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x01
+#define SPI_MODE2 0x02
+#define SPI_MODE3 0x03
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+class SPISettings {
+public:
+   SPISettings() {}
+   SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) { (void) clock; (void) bitOrder; (void) dataMode; }
+};
+
+class SPIClass {
+public:
+   void begin() {}
+   void end() {}
+   void beginTransaction(SPISettings settings);
+   void endTransaction() {}
+   uint8_t transfer(uint8_t data);
+};
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,20 @@
+/*
+  Stream.h - Arduino Stream mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef Stream_h
+#define Stream_h
+
+#include "Print.h"
+
+class Stream : public Print {
+public:
+   virtual int available() = 0;
+   virtual int read() = 0;
+   virtual int peek() = 0;
+   void setTimeout(unsigned long timeout) { (void) timeout; }
+};
+
+#endif
@@ -0,0 +1,23 @@
+/*
+  Udp.h - Arduino UDP mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef Udp_h
+#define Udp_h
+
+#include "Stream.h"
+#include "IPAddress.h"
+
+class UDP : public Stream {
+public:
+   virtual uint8_t begin(uint16_t port) = 0;
+   virtual int beginPacket(IPAddress ip, uint16_t port) = 0;
+   virtual int beginPacket(const char* host, uint16_t port) = 0;
+   virtual int endPacket() = 0;
+   virtual size_t write(uint8_t c) = 0;
+   virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+};
+
+#endif
@@ -0,0 +1,45 @@
+/*
+  Updater.h - ESP8266 Updater mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Image is written by SimBoard (see ../SimBoard.h) in its update area, then checked against
+  given MD5 by end(). Nothing is booted, scenarios check written image.
+*/
+
+#ifndef Updater_h
+#define Updater_h
+
+#include <Arduino.h>
+
+#define U_FLASH 0
+#define U_FS 100
+
+#define UPDATE_ERROR_OK 0
+#define UPDATE_ERROR_WRITE 1
+#define UPDATE_ERROR_SPACE 4
+#define UPDATE_ERROR_SIZE 5
+#define UPDATE_ERROR_MD5 7
+#define UPDATE_ERROR_MAGIC_BYTE 10
+
+class UpdaterClass {
+private:
+   bool started = false;
+   size_t size = 0;
+   size_t written = 0;
+   uint8_t error = UPDATE_ERROR_OK;
+   char md5[33] = "";
+public:
+   bool begin(size_t size, int command = U_FLASH);
+   void setMD5(const char* md5);
+   size_t write(uint8_t* data, size_t length);
+   // Ending an unfinished update drops it
+   bool end(bool evenIfRemaining = false);
+   uint8_t getError() { return error; }
+   bool hasError() { return error != UPDATE_ERROR_OK; }
+   bool isRunning() { return started; }
+   size_t progress() { return written; }
+};
+extern UpdaterClass Update;
+
+#endif
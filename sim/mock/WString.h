@@ -0,0 +1,27 @@
+/*
+  WString.h - Arduino String mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef WString_h
+#define WString_h
+
+#include <string>
+
+class __FlashStringHelper;
+#define F(x) (reinterpret_cast<const __FlashStringHelper*>(x))
+
+class String {
+private:
+   std::string value;
+public:
+   String(const char* text = "") : value(text ? text : "") {}
+   String(const std::string& text) : value(text) {}
+   const char* c_str() const { return value.c_str(); }
+   unsigned int length() const { return value.length(); }
+   String& operator+=(const String& other) { value += other.value; return *this; }
+   bool operator==(const String& other) const { return value == other.value; }
+};
+
+#endif
@@ -0,0 +1,32 @@
+/*
+  WiFiUdp.h - ESP8266 UDP mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  Sent packets are given to SimNetwork (syslog or telemetry, by port) (see ../SimNetwork.h), receiving is not simulated.
+*/
+
+#ifndef WiFiUdp_h
+#define WiFiUdp_h
+
+#include "Udp.h"
+
+class WiFiUDP : public UDP {
+private:
+   char packet[512];
+   size_t packetLength = 0;
+   uint16_t packetPort = 0;
+public:
+   uint8_t begin(uint16_t port) { (void) port; return 1; }
+   int beginPacket(IPAddress ip, uint16_t port);
+   int beginPacket(const char* host, uint16_t port);
+   int endPacket();
+   size_t write(uint8_t c);
+   size_t write(const uint8_t* buffer, size_t size);
+   using Print::write;
+   int available() { return 0; }
+   int read() { return -1; }
+   int peek() { return -1; }
+};
+
+#endif
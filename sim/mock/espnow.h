@@ -0,0 +1,30 @@
+/*
+  espnow.h - ESP8266 ESP-NOW mock, for native simulation (frames go to SimNetwork).
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+*/
+
+#ifndef ESPNOW_h
+#define ESPNOW_h
+
+#include <stdint.h>
+
+typedef uint8_t u8;
+
+enum esp_now_role {
+   ESP_NOW_ROLE_IDLE = 0,
+   ESP_NOW_ROLE_CONTROLLER,
+   ESP_NOW_ROLE_SLAVE,
+   ESP_NOW_ROLE_COMBO,
+   ESP_NOW_ROLE_MAX
+};
+
+typedef void (*esp_now_recv_cb_t)(u8* mac, u8* data, u8 length);
+
+int esp_now_init(void);
+int esp_now_set_self_role(u8 role);
+int esp_now_add_peer(u8* mac, u8 role, u8 channel, u8* key, u8 keyLength);
+int esp_now_send(u8* mac, u8* data, int length);
+int esp_now_register_recv_cb(esp_now_recv_cb_t callback);
+
+#endif
@@ -0,0 +1,16 @@
+/*
+  flash_hal.h - ESP8266 flash layout mock, for native simulation.
+  Flying Domotic
+  https://github.com/FlyingDomotic/
+
+  File system area is simulated by SimBoard (see ../SimBoard.h), using ESP.flashXxx().
+*/
+
+#ifndef flash_hal_h
+#define flash_hal_h
+
+#define FLASH_SECTOR_SIZE 0x1000
+#define FS_PHYS_ADDR 0x100000                               // As a 2MB flash with 64KB file system
+#define FS_PHYS_SIZE 0x10000
+
+#endif
@@ -7,7 +7,9 @@
       to manage a Milight bulb (but can be anything else), with a local bypass (per WAF requirement).
 
     Functions are as follow:
-      - Initially relay is off, so power is off, connected bulb is off, initial state is set to off,
+      - Initially relay is off, so power is off, connected bulb is off, initial state is set to off
+          (unless bulb and relay states are found in RTC memory after a reset, they're then restored at once),
+      - Button and relay are usable immediately, network services are started in background,
       - MQTT is connected and a state topic is queried,
       - As state topic is retained, module receives last Milight bulb state, and sets internal state accordingly,
       - When internal state turns to on, relay is set to on and stays on,
@@ -29,18 +31,55 @@
       - Automatic cycle resumes when a state message is received. When this occurs, message is ignored (as state could
           have changed meanwhile), and internal state is sent back. Normal cycle resumes (and Milight state will match
           internal state).
+      - If you define MILIGHT_RADIO_CS_PIN, bypass mode sends commands to (first channel) bulb with a local LT8900 radio
+          while relay is on (keeping brightness and color), relay being only used when radio can't be used.
+      - If you define ESPNOW_PEERS, button pushes are also sent with ESP-NOW to modules sharing the same bulb, which
+          follow them at once (even when MQTT is down), then wait for state message as if command was theirs.
+      - If you define PREDICTIVE_RELAY, turning bulb on while relay is off powers relay at once (bulb lights when
+          powered), state message only confirming it. Should an OFF state be received before, relay is turned back
+          off. Should no state message be received in time, bypass mode starts with relay already on (no discharge).
 
     Doing that way, module is autonomous, and can work alone, while being able to integrate your domotic system when working ;-)
 
     Lot of things are driven by parameters set in FF_Shelly.c file. Please have a look to it. Here are the main:
       - Traces are sent to serial (should you decide to test code on a "classical" ESP8266 if you define SERIAL_TRACE,
       - Traces are sent to SYSLOG if you define SYSLOG_HOST (and not SERIAL_TRACE),
+      - Traces less important than TRACE_LEVEL are removed at compile time,
+      - SYSLOG traces are queued in RAM and sent from loop() (without blocking) if you define SYSLOG_BUFFER_SIZE,
+      - SYSLOG traces are formatted without heap allocation (and may be truncated) if you define SYSLOG_MESSAGE_SIZE,
       - Else traces are not generated,
-      - You may define SHADOW_LED_PIN to visualize internal state on a LED,
+      - You may define WIFI_FAST_CONNECT to (re)connect to WiFi with access point and IP settings cached in RTC memory,
+      - You may define MQTT_ASYNC_CONNECT to (re)connect to MQTT without waiting for broker answer,
+      - You may define MQTT_BATCH_SIZE to send MQTT packets of a loop in one network write,
+      - You may define MQTT_STATIC_BUFFERS to allocate MQTT buffers at compile time, without heap,
+      - You may define ADAPTIVE_TIMEOUT to compute command timeout from observed ack latency (between COMMAND_TIMEOUT_MIN and COMMAND_TIMEOUT_MAX),
+      - You may define MQTT_QUEUE_SIZE to keep commands while MQTT is down and send them on reconnection,
+      - You may define PREDICTIVE_RELAY to power relay without waiting for ack when turning bulb on with relay off,
+      - You may define MILIGHT_RADIO_CS_PIN to send commands with a local LT8900 radio in bypass mode,
+      - You may define ESPNOW_PEERS to share button pushes with modules commanding the same bulb,
+      - You may manage several button/relay/bulb channels with one module defining CHANNEL_COUNT and CHANNELS,
+      - You may define SHADOW_LED_PIN to visualize internal state (of first channel) on a LED,
+      - You may define BUTTON_INTERRUPT to capture button changes by interrupt (and not lose them when loop is slow),
+      - You may define POWER_SAVE to sleep between loops until next thing to do (MQTT keep alive, command timeout,
+          temperature, stats...), letting WiFi modem sleep, and light sleep defining POWER_SAVE_LIGHT_SLEEP (received
+          data and button changes wake module up, without delaying button),
       - You should define button level change(s) that will trigger an internal state change (BUTTON_LOW_TO_HIGH or BUTTON_HIGH_TO_LOW
           for a push button, both for a switch)?
       - You may write stats to trace defining STATS_INTERVAL,
-      - You may send periodically internal temperature to MQTT defining TEMPERATURE_TOPIC
+      - You may write time spent in each loop stage with stats defining LOOP_PROFILE,
+      - You may send command latency histograms to MQTT at each stats interval defining LATENCY_TOPIC,
+      - You may send counters, heap, RSSI, loop timing and latency histograms as compact binary UDP frames
+          defining TELEMETRY_HOST (decodeTelemetry.py decodes them),
+      - You may send bulb, relay and stats changes as a retained device shadow to MQTT defining DEVICE_SHADOW_TOPIC
+          (bulbs without state topic are restored from it after power loss),
+      - You may keep states and stats across power losses in a wear-levelled flash log defining PERSIST_FLASH
+          (they are always kept across resets, in RTC memory),
+      - You may update module from an HTTP server, in throttled and resumable chunks checked by MD5, sending
+          image URL to PULL_OTA_TOPIC (a delta made by makeDelta.py against running image can be sent instead),
+      - You may send periodically internal temperature to MQTT defining TEMPERATURE_TOPIC (and an over temperature
+          alarm defining TEMPERATURE_ALARM),
+      - You may send power and energy measured by Shelly 1PM to MQTT defining POWER_TOPIC (powered bulbs, and
+          bypass power cycles, that don't light are reported)
 
 
     Written by Flying Domotic (https://github.com/FlyingDomotic/)
@@ -55,68 +94,325 @@
 // Wifi Connect event
 void onWifiConnect(const WiFiEventStationModeConnected& event) {
   if (lastDisconnect) {                                     // Have we already been disconnected?
-    TRACE("Wifi reconnected after %lu ms", millis()-lastDisconnect);
+    TRACE_INFO("Wifi reconnected after %lu ms", millis()-lastDisconnect);
   } else {
-    TRACE("Wifi connected at %lu ms", millis());
+    TRACE_INFO("Wifi connected at %lu ms", millis());
   }
 }
 
 // Wifi Disconnect event
 void onWifiDisconnect(const WiFiEventStationModeDisconnected& event) {
-  TRACE("Wifi disconnected!");
-  // Save last diconnection time
-  lastDisconnect = millis();
+  // Only trace (and count) first event, others are failed reconnection attempts
+  if (wifiConnected) {
+    TRACE_WARN("Wifi disconnected!");
+    // Update stats
+    networkLost++;
+    rtcStateSave();
+    wifiConnected = false;
+    // Save last diconnection time
+    lastDisconnect = millis();
+  }
 }
 
 // Wifi got IP event
 void onWifiGotIP(const WiFiEventStationModeGotIP& event) {
-  TRACE("Wifi got IP %s", WiFi.localIP().toString().c_str());
+  #if TRACE_LEVEL >= TRACE_LEVEL_INFO
+    IPAddress ip = WiFi.localIP();
+    TRACE_INFO("Wifi got IP %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  #endif
+  wifiConnected = true;
+  #ifdef WIFI_FAST_CONNECT
+    // Save access point and IP settings for next connection
+    wifiCache.magic = RTC_WIFI_MAGIC;
+    memcpy(wifiCache.bssid, WiFi.BSSID(), sizeof(wifiCache.bssid));
+    wifiCache.channel = WiFi.channel();
+    wifiCache.unused = 0;
+    wifiCache.ip = WiFi.localIP();
+    wifiCache.gateway = WiFi.gatewayIP();
+    wifiCache.subnet = WiFi.subnetMask();
+    wifiCache.dns = WiFi.dnsIP();
+    wifiCacheValid = true;
+    ESP.rtcUserMemoryWrite(RTC_WIFI_OFFSET, (uint32_t*) &wifiCache, sizeof(wifiCache));
+  #endif
+  // Connect to MQTT (if it was waiting for WiFi)
+  mqttConnectSchedule();
+}
+
+#ifdef WIFI_FAST_CONNECT
+// Start WiFi connection, using cached settings if fast is set
+void wifiBegin(const bool fast) {
+  wifiAttemptStart = millis();
+  if (fast) {
+    TRACE_DEBUG("Wifi fast connecting on channel %d", wifiCache.channel);
+    wifiAttempt = WIFI_ATTEMPT_FAST;
+    #ifdef WIFI_STATIC_IP
+      WiFi.config(WIFI_STATIC_IP, WIFI_GATEWAY, WIFI_SUBNET, WIFI_DNS);
+    #else
+      // Reuse last DHCP lease
+      WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+    #endif
+    WiFi.begin(WIFI_SSID, WIFI_KEY, wifiCache.channel, wifiCache.bssid);
+  } else {
+    TRACE_DEBUG("Wifi connecting with full scan");
+    wifiAttempt = WIFI_ATTEMPT_FULL;
+    #ifdef WIFI_STATIC_IP
+      WiFi.config(WIFI_STATIC_IP, WIFI_GATEWAY, WIFI_SUBNET, WIFI_DNS);
+    #else
+      // Use DHCP
+      WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+    #endif
+    WiFi.begin(WIFI_SSID, WIFI_KEY);
+  }
 }
 
-// Send a command to MQTT
-void mqttSendCommand(const bool newState) {
-  TRACE("Sending %s to %s", newState ? BULB_ON : BULB_OFF, MQTT_COMMAND);
-  // Send MQTT command (either On or Off)
-  mqttClient.publish(MQTT_COMMAND, newState ? BULB_ON : BULB_OFF);
+// Manage WiFi (re)connection
+void wifiLoop() {
+  if (WiFi.status() == WL_CONNECTED) {
+    wifiAttempt = WIFI_ATTEMPT_NONE;
+    return;
+  }
+  unsigned long now = millis();
+  switch (wifiAttempt) {
+    case WIFI_ATTEMPT_NONE:
+      // Connection lost, reconnect
+      wifiBegin(wifiCacheValid);
+      break;
+    case WIFI_ATTEMPT_FAST:
+      if ((now - wifiAttemptStart) > WIFI_FAST_TIMEOUT) {
+        // Cached settings don't work anymore, forget them and do a full scan
+        TRACE_WARN("Wifi fast connect failed");
+        wifiCacheValid = false;
+        wifiCache.magic = 0;
+        ESP.rtcUserMemoryWrite(RTC_WIFI_OFFSET, (uint32_t*) &wifiCache, sizeof(wifiCache));
+        wifiBegin(false);
+      }
+      break;
+    case WIFI_ATTEMPT_FULL:
+      if ((now - wifiAttemptStart) > WIFI_CONNECT_TIMEOUT) {
+        // Try again
+        wifiBegin(wifiCacheValid);
+      }
+      break;
+  }
+}
+#endif
+
+// Send a channel command to MQTT
+void mqttSendCommand(bulbChannel &channel, const bool newState) {
+  #ifdef MQTT_QUEUE_SIZE
+    if (!mqttClient.connected()) {
+      // MQTT is down, keep command until reconnection
+      mqttQueueCommand(channel, newState);
+    } else
+  #endif
+  {
+    TRACE_DEBUG("Sending %s to %s", newState ? BULB_ON : BULB_OFF, channel.commandTopic);
+    // Send MQTT command (either On or Off)
+    mqttClient.publish(channel.commandTopic, newState ? BULB_ON : BULB_OFF);
+    #ifdef LATENCY_TOPIC
+      latencyPublished(channel);
+    #endif
+  }
   // Save last command sent time
-  lastMqttCommandSent = millis();                         
+  channel.lastMqttCommandSent = millis();                         
+  // Wait for ack, unless we're already waiting or in bypass mode
+  if (channel.relayState == RELAY_IDLE) {
+    setRelayState(channel, RELAY_WAIT_ACK);
+  }
+  relaySchedule(channel);
+}
+
+#ifdef MQTT_QUEUE_SIZE
+// Queue a command while MQTT is down (only last state is kept for a channel)
+void mqttQueueCommand(bulbChannel &channel, const bool newState) {
+  uint8_t i = 0;
+  // Look for a command already queued for this channel
+  while (i < mqttQueueCount && mqttQueue[i].channel != &channel) {
+    i++;
+  }
+  if (i < mqttQueueCount) {
+    // Found, replace it (update stats)
+    TRACE_DEBUG("Replacing queued command for %s by %s", channel.commandTopic, newState ? BULB_ON : BULB_OFF);
+    queueCoalesced++;
+  } else if (mqttQueueCount >= MQTT_QUEUE_SIZE) {
+    // Queue full, drop oldest command
+    TRACE_WARN("MQTT queue full, dropping command for %s", mqttQueue[0].channel->commandTopic);
+    i = 0;
+  } else {
+    TRACE_DEBUG("Queuing %s for %s", newState ? BULB_ON : BULB_OFF, channel.commandTopic);
+    mqttQueueCount++;
+  }
+  // Move following commands up, to keep queue in changes order, and put this one at end
+  for (; i < mqttQueueCount - 1; i++) {
+    mqttQueue[i] = mqttQueue[i + 1];
+  }
+  mqttQueue[i].channel = &channel;
+  mqttQueue[i].state = newState;
+}
+
+// Send queued commands, in order
+void mqttFlushQueue() {
+  if (!mqttQueueCount) {
+    return;
+  }
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < mqttQueueCount; i++) {
+    bulbChannel &channel = *mqttQueue[i].channel;
+    TRACE_INFO("Sending queued %s to %s", mqttQueue[i].state ? BULB_ON : BULB_OFF, channel.commandTopic);
+    mqttClient.publish(channel.commandTopic, mqttQueue[i].state ? BULB_ON : BULB_OFF);
+    // Queued commands carry internal bulb state, no need to resend it on next state message
+    channel.mqttCommandFailed = false;
+    // States received before its ack (as retained one sent at subscription) are older than command
+    channel.replayPending = true;
+    // Wait for their ack from now
+    channel.lastMqttCommandSent = now;
+    if (channel.relayState == RELAY_BYPASS || channel.relayState == RELAY_RADIO) {
+      setRelayState(channel, RELAY_RESYNC);
+    }
+    relaySchedule(channel);
+    #ifdef LATENCY_TOPIC
+      latencyPublished(channel);
+    #endif
+  }
+  mqttQueueCount = 0;
 }
+#endif
+
+// Matcher for STATE_ON and STATE_OFF, built at compile time:
+//  length of their common prefix, and KMP failure table of this prefix
+struct StateMatcher {
+  uint8_t prefixLength;
+  uint8_t fail[sizeof(STATE_ON)];
+
+  constexpr StateMatcher(const char* on, const char* off) : prefixLength(0), fail() {
+    while (on[prefixLength] && on[prefixLength] == off[prefixLength]) {
+      prefixLength++;
+    }
+    uint8_t k = 0;
+    for (uint8_t i = 1; i < prefixLength; i++) {
+      while (k && on[i] != on[k]) {
+        k = fail[k - 1];
+      }
+      if (on[i] == on[k]) {
+        k++;
+      }
+      fail[i] = k;
+    }
+  }
+};
+static constexpr StateMatcher stateMatcher(STATE_ON, STATE_OFF);
+static_assert(stateMatcher.prefixLength > 0, "STATE_ON and STATE_OFF should start with the same text");
 
-// Callback activated when a subscribed event is received
-void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  char message[length+1];
-  // Copy the payload to the message buffer
-  memcpy(message, payload, length);
-  // End string
-  message[length] = 0;
-  TRACE("Got %s on topic %s", message, topic);
+// Look for STATE_ON or STATE_OFF in payload, in one pass. Returns 1 for ON, 0 for OFF and -1 if not found
+int8_t findBulbState(const byte* payload, unsigned int length) {
+  uint8_t matched = 0;
+  for (unsigned int i = 0; i < length; i++) {
+    // Find longest prefix part still matching
+    while (matched && payload[i] != STATE_ON[matched]) {
+      matched = stateMatcher.fail[matched - 1];
+    }
+    if (payload[i] == STATE_ON[matched]) {
+      matched++;
+    }
+    if (matched == stateMatcher.prefixLength) {
+      // Common prefix found, check end of both states
+      const byte* end = payload + i + 1;
+      unsigned int remaining = length - i - 1;
+      if (remaining >= sizeof(STATE_ON) - 1 - matched && !memcmp(end, STATE_ON + matched, sizeof(STATE_ON) - 1 - matched)) {
+        return 1;
+      }
+      if (remaining >= sizeof(STATE_OFF) - 1 - matched && !memcmp(end, STATE_OFF + matched, sizeof(STATE_OFF) - 1 - matched)) {
+        return 0;
+      }
+      matched = stateMatcher.fail[matched - 1];
+    }
+  }
+  return -1;
+}
+
+// Callback activated when a message is received on state or update topic
+//  of a channel (payload is null terminated by MQTT client)
+void mqttCallback(bulbChannel &channel, char* topic, byte* payload, unsigned int length) {
+  TRACE_DEBUG("Got %s on topic %s", (char*) payload, topic);
   // If last command failed, ignore received message and resend internal bulb state
-  if (mqttCommandFailed) {
-    TRACE("Recovering from failure, sending %s", bulbOn ? "ON" : "OFF");
+  if (channel.mqttCommandFailed) {
+    TRACE_WARN("Recovering from failure, sending %s to %s", channel.bulbOn ? "ON" : "OFF", channel.commandTopic);
     // Update stats
-    syncLost++;
-    // Resend bulb state
-    mqttSendCommand(bulbOn);
+    channel.syncLost++;
+    rtcStateSave();
     // Command is ok (for now)
-    mqttCommandFailed = false;
+    channel.mqttCommandFailed = false;
+    // Wait for resync ack
+    setRelayState(channel, RELAY_RESYNC);
+    // Resend bulb state
+    mqttSendCommand(channel, channel.bulbOn);
   } else {
-    if (strstr(message, STATE_ON)) {
+    int8_t state = findBulbState(payload, length);
+    #ifdef MQTT_QUEUE_SIZE
+      if (state >= 0 && channel.replayPending) {
+        if (state != channel.bulbOn) {
+          TRACE_DEBUG("Ignoring %s state, waiting for ack of replayed command", state ? "ON" : "OFF");
+          return;
+        }
+        // Replayed command acknowledged
+        channel.replayPending = false;
+      }
+    #endif
+    #ifdef LATENCY_TOPIC
+      if (state >= 0 && channel.ackPending) {
+        // Command acknowledged, save its latency
+        channel.ackPending = false;
+        if ((micros() - channel.publishMicros) > (commandTimeout * 1000UL)) {
+          lateAcks++;
+        }
+        latencyAdd(publishToAck, channel.publishMicros);
+      }
+    #endif
+    #ifdef ADAPTIVE_TIMEOUT
+      // Use latency of acks of commands not timed out (and not resent)
+      if (state >= 0 && channel.relayState == RELAY_WAIT_ACK && channel.lastMqttCommandSent) {
+        timeoutAck(millis() - channel.lastMqttCommandSent);
+      }
+    #endif
+    #ifdef PREDICTIVE_RELAY
+      if (state >= 0 && channel.relayPredicted) {
+        // Prediction is confirmed or rejected now
+        channel.relayPredicted = false;
+        if (state == 0) {
+          // Bulb was only lit by power up, turn it back off
+          TRACE_INFO("Predicted relay %d rolled back", channel.relayPin);
+          predictRollback++;
+          setRelayOn(channel, false);
+        }
+      }
+    #endif
+    if (state == 1) {
       // We received an ON request
-      TRACE("ON requested after %lu ms", lastMqttCommandSent ? millis() - lastMqttCommandSent : 0);
+      TRACE_DEBUG("ON requested after %lu ms", channel.lastMqttCommandSent ? millis() - channel.lastMqttCommandSent : 0);
       // Set internal bulb state
-      setBulbOn(true);
+      setBulbOn(channel, true);
       // Reset last command sent time
-      lastMqttCommandSent = 0;
+      channel.lastMqttCommandSent = 0;
       // Activate relay is not already done
-      setRelayOn(true);
-    } else if (strstr(message, STATE_OFF)) {
+      setRelayOn(channel, true);
+      // Command acknowledged
+      setRelayState(channel, RELAY_IDLE);
+    } else if (state == 0) {
       // We received an OFF request
-      TRACE("OFF requested after %lu ms", lastMqttCommandSent ? millis() - lastMqttCommandSent : 0);
+      TRACE_DEBUG("OFF requested after %lu ms", channel.lastMqttCommandSent ? millis() - channel.lastMqttCommandSent : 0);
       // Set internal bulb state
-      setBulbOn(false);
+      setBulbOn(channel, false);
       // Reset last command sent time
-      lastMqttCommandSent = 0;
+      channel.lastMqttCommandSent = 0;
+      // Command acknowledged
+      setRelayState(channel, RELAY_IDLE);
     }
+    #ifdef LATENCY_TOPIC
+      if (state >= 0) {
+        // Relay won't change anymore for this press
+        channel.relayPending = false;
+      }
+    #endif
   }
 }
 
@@ -126,53 +422,118 @@ boolean mqttReconnect() {
 
   // Define MQTT client ID as program name folowwed by chip ID on 6 hex chars
   snprintf_P(mqttId, sizeof(mqttId), PSTR("%s_%x"), QUOTE(PROG_NAME), ESP.getChipId());
-  // Connect to MQTT with LWT
-  if (mqttClient.connect(mqttId, MQTT_USER, MQTT_KEY, MQTT_LWT, 0, true, MQTT_WILL_DOWN_MSG)) {
-  TRACE("MQTT connected as %s", mqttId);
+  TRACE_DEBUG("MQTT connecting as %s", mqttId);
+  #ifdef MQTT_ASYNC_CONNECT
+    // Send connection with LWT, mqttLoop will wait for broker answer
+    return mqttClient.beginConnect(mqttId, MQTT_USER, MQTT_KEY, MQTT_LWT, 0, true, MQTT_WILL_DOWN_MSG);
+  #else
+    // Connect to MQTT with LWT
+    if (mqttClient.connect(mqttId, MQTT_USER, MQTT_KEY, MQTT_LWT, 0, true, MQTT_WILL_DOWN_MSG)) {
+      mqttConnected();
+    }
+    return mqttClient.connected();
+  #endif
+}
+
+// MQTT connected routine
+void mqttConnected() {
+  TRACE_INFO("MQTT connected");
+  // Clear last MQTT (re) connect attempt and reset retry delay
+  lastMqttConnectAttempt = 0;
+  mqttBackoffDelay = MQTT_RETRY_MIN;
+  mqttRetryDelay = MQTT_RETRY_MIN;
+  // Set MQTT connected flag
+  mqttAvailable = true;
   // Tell we're back (LWT up message)
   mqttClient.publish(MQTT_LWT, MQTT_WILL_UP_MSG);
-  // Subscribe to state topic
-  #ifdef MQTT_STATE
-    TRACE("Subscribing to %s", MQTT_STATE);
-    mqttClient.subscribe(MQTT_STATE);
-  #endif
-  #ifdef MQTT_UPDATE
-    TRACE("Subscribing to %s", MQTT_UPDATE);
-    mqttClient.subscribe(MQTT_UPDATE);
-  #endif
-  
-  // Check for at least one topic defined
-  #ifndef MQTT_STATE
-    #ifndef MQTT_UPDATE
-        #error "You should define MQTT_STATE and/or MQTT_UPDATE"
-    #endif
+  #ifdef MQTT_QUEUE_SIZE
+    // Send commands queued while disconnected (before subscribing, states received then are checked against them)
+    mqttFlushQueue();
+  #endif
+  // Subscribe to state and update topics of all channels (in one packet)
+  const char* topics[2 * CHANNEL_COUNT + 2];
+  uint8_t topicCount = 0;
+  #ifdef DEVICE_SHADOW_TOPIC
+    // Subscribe to our retained shadow if not yet read
+    if (!shadowRestored) {
+      TRACE_DEBUG("Subscribing to %s", DEVICE_SHADOW_TOPIC);
+      topics[topicCount++] = DEVICE_SHADOW_TOPIC;
+      shadowRestoreStart = millis();
+    }
+    // Send all fields in next shadow
+    shadowFull = true;
+  #endif
+  #ifdef PULL_OTA_TOPIC
+    TRACE_DEBUG("Subscribing to %s", PULL_OTA_TOPIC);
+    topics[topicCount++] = PULL_OTA_TOPIC;
   #endif
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    if (channels[i].stateTopic) {
+      TRACE_DEBUG("Subscribing to %s", channels[i].stateTopic);
+      topics[topicCount++] = channels[i].stateTopic;
+    }
+    if (channels[i].updateTopic) {
+      TRACE_DEBUG("Subscribing to %s", channels[i].updateTopic);
+      topics[topicCount++] = channels[i].updateTopic;
+    }
+  }
+  if (!mqttClient.subscribe(topics, topicCount)) {
+    TRACE_ERR("Can't subscribe");
+  }
 }
-  return mqttClient.connected();
+
+// Compute delay before next MQTT connection attempt (exponential backoff with jitter)
+void mqttBackoff() {
+  // Use current delay, then double it for next time (up to maximum)
+  unsigned long nominalDelay = mqttBackoffDelay;
+  mqttBackoffDelay = min(mqttBackoffDelay * 2, (unsigned long) MQTT_RETRY_MAX);
+  // Wait between half and full delay, so that modules don't retry all together after a broker restart
+  mqttRetryDelay = (nominalDelay / 2) + random(nominalDelay / 2 + 1);
+  TRACE_DEBUG("MQTT connection failed (%d), next attempt in %lu ms", mqttClient.state(), mqttRetryDelay);
+  mqttConnectSchedule();
+}
+
+// Schedule next MQTT connection attempt, once retry delay is over
+void mqttConnectSchedule() {
+  scheduler.runAt(TASK_MQTT_CONNECT, lastMqttConnectAttempt + mqttRetryDelay + 1);
+}
+
+// Attempt to connect to MQTT (WiFi got IP event schedules it again if WiFi is down)
+void mqttConnectTask(uint8_t task) {
+  if (mqttClient.connected() || mqttClient.connecting() || WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+  lastMqttConnectAttempt = millis();
+  if (!mqttReconnect()) {
+    // Failed, wait longer before next attempt
+    mqttBackoff();
+  }
 }
 
 // MQTT loop
 void mqttLoop() {
    // Is MQTT connected?
   if (!mqttClient.connected()) {
-    // No, give message and attempt to reconnect every 5 sec
+    // No, give message and attempt to reconnect
     if (mqttAvailable) {
-      TRACE("MQTT disconnected!");
+      TRACE_WARN("MQTT disconnected!");
       // Update stats
       mqttLost++;
+      rtcStateSave();
       // Set not connected
       mqttAvailable = false;
+      // Attempt to reconnect (at once, or when retry delay is over)
+      mqttConnectSchedule();
     }
-    unsigned long now = millis();
-    // Last attempt older than 5 sec ?
-    if (now - lastMqttConnectAttempt > 5000) {
-      lastMqttConnectAttempt = now;
-      // Attempt to reconnect
-      if (mqttReconnect()) {
-        // Clear last MQTT (re) connect attempt
-        lastMqttConnectAttempt = 0;
-      // Set MQTT connected flag
-      mqttAvailable = true;
+    // Are we waiting for broker answer?
+    if (mqttClient.connecting()) {
+      // Let client check for answer (or timeout)
+      mqttClient.loop();
+      if (mqttClient.connected()) {
+        mqttConnected();
+      } else if (!mqttClient.connecting()) {
+        // Connection refused or timeout, wait longer before next attempt
+        mqttBackoff();
       }
     }
   } else {
@@ -183,28 +544,63 @@ void mqttLoop() {
   }
 }
 
-// Set relay
-void setRelayOn(bool newState) {
+// Set channel relay
+void setRelayOn(bulbChannel &channel, bool newState) {
   // Should we change relay state?
-  if (relayOn != newState) {
-    TRACE("Setting relay to %s", bulbOn ? "ON" : "OFF");
+  if (channel.relayOn != newState) {
+    TRACE_DEBUG("Setting relay %d to %s", channel.relayPin, newState ? "ON" : "OFF");
     // SEt new state
-    digitalWrite(RELAY_PIN, bulbOn ? RELAY_ON : RELAY_OFF);
+    digitalWrite(channel.relayPin, newState ? RELAY_ON : RELAY_OFF);
     // Save state
-    relayOn = newState;
+    channel.relayOn = newState;
+    rtcStateSave();
+    #ifdef POWER_TOPIC
+      if (newState) {
+        // Check bulb once power has settled
+        powerRelayOnTime = millis();
+        powerNotLitWarned = false;
+      }
+    #endif
+    #ifdef LATENCY_TOPIC
+      if (channel.relayPending) {
+        // First relay change since button press, save its latency
+        channel.relayPending = false;
+        latencyAdd(pressToRelay, channel.pressMicros);
+      }
+    #endif
+    relaySchedule(channel);
+  }
+}
+
+// Set channel relay/bypass state
+void setRelayState(bulbChannel &channel, relayStates newState) {
+  // Should we change state?
+  if (channel.relayState != newState) {
+    #if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+      static const char* stateNames[] = {"idle", "wait ack", "discharging", "bypass", "radio", "resync"};
+      TRACE_DEBUG("Relay %d state %s -> %s", channel.relayPin, stateNames[channel.relayState], stateNames[newState]);
+    #endif
+    // Save new state and its time
+    channel.relayState = newState;
+    channel.relayStateChanged = millis();
+    relaySchedule(channel);
   }
 }
 
-// Set local bulb state
-bool setBulbOn(const bool newState) {
+// Set channel local bulb state
+bool setBulbOn(bulbChannel &channel, const bool newState) {
   // Should we change internal bulb state?
-  if (bulbOn != newState) {
+  if (channel.bulbOn != newState) {
     // Save new state
-    bulbOn = newState;
-    // Should we have a shadow LMED, update it
+    channel.bulbOn = newState;
+    rtcStateSave();
+    // Should we have a shadow LMED, update it (with first channel state)
     #ifdef SHADOW_LED_PIN
-      digitalWrite(SHADOW_LED_PIN, bulbOn ? SHADOW_LED_ON : SHADOW_LED_OFF);
+      if (&channel == channels) {
+        digitalWrite(SHADOW_LED_PIN, channel.bulbOn ? SHADOW_LED_ON : SHADOW_LED_OFF);
+      }
     #endif
+    relaySchedule(channel);
     // Something changed
     return true;
   }
@@ -214,152 +610,1230 @@ bool setBulbOn(const bool newState) {
 
 // Loop for button
 void buttonLoop() {
-  // Does button change?
-  if (debouncer.update()) {
-    bool toggleSwitch = false;
-    #ifdef BUTTON_HIGH_TO_LOW
-      toggleSwitch = toggleSwitch || (debouncer.read() == LOW);
-   #endif
-    #ifdef BUTTON_LOW_TO_HIGH
-      toggleSwitch = toggleSwitch || (debouncer.read() == HIGH);
-    #endif
-    #ifndef BUTTON_HIGH_TO_LOW
-      #ifndef BUTTON_LOW_TO_HIGH
-        #error "You should define BUTTON_HIGH_TO_LOW and/or BUTTON_LOW_TO_HIGH"
+  #ifdef LOOP_PROFILE
+    // Save longest time between debouncer updates
+    unsigned long now = micros();
+    if (lastButtonUpdate && (now - lastButtonUpdate) > maxButtonGap) {
+      maxButtonGap = now - lastButtonUpdate;
+    }
+    lastButtonUpdate = now;
+  #endif
+  // Scan all channels
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    bulbChannel &channel = channels[i];
+    // Does button change?
+    if (channel.debouncer.update()) {
+      bool toggleSwitch = false;
+      #ifdef BUTTON_HIGH_TO_LOW
+        toggleSwitch = toggleSwitch || (channel.debouncer.read() == LOW);
+     #endif
+      #ifdef BUTTON_LOW_TO_HIGH
+        toggleSwitch = toggleSwitch || (channel.debouncer.read() == HIGH);
       #endif
-    #endif
-    if (toggleSwitch) {
-      // Update stats
-      pushCount++;
-      // Toggle bulb state
-      setBulbOn(!bulbOn);
-      TRACE("Button pushed, bulb state is now %s", bulbOn ? "ON" : "OFF");
-      // Send MQTT toggle command
-      mqttSendCommand(bulbOn);
+      #ifndef BUTTON_HIGH_TO_LOW
+        #ifndef BUTTON_LOW_TO_HIGH
+          #error "You should define BUTTON_HIGH_TO_LOW and/or BUTTON_LOW_TO_HIGH"
+        #endif
+      #endif
+      if (toggleSwitch) {
+        #ifdef LATENCY_TOPIC
+          // Save press time
+          channel.pressMicros = micros();
+          channel.publishPending = true;
+          channel.relayPending = true;
+        #endif
+        // Update stats
+        channel.pushCount++;
+        // Toggle bulb state
+        setBulbOn(channel, !channel.bulbOn);
+        TRACE_INFO("Button %d pushed, bulb state is now %s", i, channel.bulbOn ? "ON" : "OFF");
+        #ifdef PREDICTIVE_RELAY
+          // Bulb lights when powered, no need to wait for ack to power it
+          channel.relayPredicted = channel.bulbOn && !channel.relayOn;
+          if (channel.relayPredicted) {
+            setRelayOn(channel, true);
+          }
+        #endif
+        #ifdef ESPNOW_PEERS
+          // Tell peers sharing this bulb
+          peerSend(channel);
+        #endif
+        // Send MQTT toggle command
+        mqttSendCommand(channel, channel.bulbOn);
+      }
     }
   }
 }
 
-// Manage command timeout
-void manageCommandTimeout() {
-  // Are we waiting for an ack ?
-  if (lastMqttCommandSent) {
-    // Are we over timeout?
-    if ((millis() - lastMqttCommandSent) > COMMAND_TIMEOUT) {
-      // Update stats
-      pushLost++;
-      // Reset last command time to avoid loop here
-      lastMqttCommandSent = 0;
-      // Set command failed flag
-      mqttCommandFailed = true;
-      TRACE("Last command timeout!");
-      // Specific case of bulb switched on but power already on
-      // We should turn relay off, wait a bit and turn it then on to light bulb
-      if(bulbOn && relayOn) {
-        setRelayOn(false);      // Turn relay off
-        delay (1000);           // Wait a bit to let time to bulb PCB fully discharge
-                                // It will be turned on by next code
+// Schedule channel relay task at next thing to do in its state
+void relaySchedule(bulbChannel &channel) {
+  uint8_t task = TASK_RELAY + (&channel - channels);
+  switch (channel.relayState) {
+    case RELAY_WAIT_ACK:
+    case RELAY_RESYNC:
+      // Command timeout
+      scheduler.runAt(task, channel.lastMqttCommandSent + commandTimeout + 1);
+      break;
+    case RELAY_DISCHARGING:
+      // End of discharge (at once if bulb has been turned off meanwhile)
+      scheduler.runAt(task, channel.bulbOn ? channel.relayStateChanged + DISCHARGE_TIME : millis());
+      break;
+    case RELAY_BYPASS:
+      // Relay follows internal bulb state
+      if (channel.relayOn != channel.bulbOn) {
+        scheduler.runIn(task, 0);
+      } else {
+        scheduler.cancel(task);
+      }
+      break;
+    #ifdef MILIGHT_RADIO_CS_PIN
+      case RELAY_RADIO:
+        // Internal bulb state changes are sent by radio
+        if (channel.bulbOn != radioBulbOn) {
+          scheduler.runIn(task, 0);
+        } else {
+          scheduler.cancel(task);
+        }
+        break;
+    #endif
+    default:
+      scheduler.cancel(task);
+      break;
+  }
+}
+
+// Manage command timeout and bypass of a channel
+void relayTask(uint8_t task) {
+  unsigned long now = millis();
+  bulbChannel &channel = channels[task - TASK_RELAY];
+  switch (channel.relayState) {
+    case RELAY_WAIT_ACK:
+    case RELAY_RESYNC:
+      // Are we over timeout?
+      if ((now - channel.lastMqttCommandSent) > commandTimeout) {
+        // Update stats
+        channel.pushLost++;
+        rtcStateSave();
+        // Reset last command time
+        channel.lastMqttCommandSent = 0;
+        // Set command failed flag
+        channel.mqttCommandFailed = true;
+        #ifdef MQTT_QUEUE_SIZE
+          // Next state message will be answered by internal bulb state
+          channel.replayPending = false;
+        #endif
+        TRACE_WARN("Last command to %s timeout!", channel.commandTopic);
+        #ifdef ADAPTIVE_TIMEOUT
+          // Wait longer for next command (unless command was not sent because MQTT is down)
+          if (mqttClient.connected()) {
+            timeoutExpired();
+          }
+        #endif
+        #ifdef PREDICTIVE_RELAY
+          if (channel.relayPredicted) {
+            // Bulb has been lit by power up, just keep relay on
+            channel.relayPredicted = false;
+            setRelayState(channel, RELAY_BYPASS);
+            break;
+          }
+        #endif
+        #ifdef MILIGHT_RADIO_CS_PIN
+          // Bulb is powered, send command by local radio (keeping brightness and color)
+          if (channel.relayOn && radioSend(channel)) {
+            setRelayState(channel, RELAY_RADIO);
+            break;
+          }
+        #endif
+        // Specific case of bulb switched on but power already on
+        // We should turn relay off, wait a bit and turn it then on to light bulb
+        if (channel.bulbOn && channel.relayOn) {
+          setRelayOn(channel, false);
+          setRelayState(channel, RELAY_DISCHARGING);
+        } else {
+          // Set relay as internal bulb state
+          setRelayOn(channel, channel.bulbOn);
+          setRelayState(channel, RELAY_BYPASS);
+        }
+      }
+      break;
+    case RELAY_DISCHARGING:
+      // Wait for bulb PCB to fully discharge, unless bulb has been turned off meanwhile
+      if (!channel.bulbOn || (now - channel.relayStateChanged) >= DISCHARGE_TIME) {
+        #ifdef POWER_TOPIC
+          // Power will tell if power cycle lit bulb
+          powerBypassCheck = channel.bulbOn;
+        #endif
+        // Set relay as internal bulb state
+        setRelayOn(channel, channel.bulbOn);
+        setRelayState(channel, RELAY_BYPASS);
+      }
+      break;
+    case RELAY_BYPASS:
+      // Relay follows internal bulb state
+      setRelayOn(channel, channel.bulbOn);
+      break;
+    #ifdef MILIGHT_RADIO_CS_PIN
+      case RELAY_RADIO:
+        // Send internal bulb state changes by radio (with relay as last resort if radio stops answering)
+        if (channel.bulbOn != radioBulbOn && !radioSend(channel)) {
+          setRelayOn(channel, channel.bulbOn);
+          setRelayState(channel, RELAY_BYPASS);
+        }
+        break;
+    #endif
+    default:
+      break;
+  }
+  // Adaptive timeout may have changed, state may not
+  relaySchedule(channel);
+}
+
+#ifdef ESPNOW_PEERS
+// ESP-NOW receive callback: queue message, it'll be processed by peerLoop
+void peerReceive(uint8_t* mac, uint8_t* data, uint8_t length) {
+  (void) mac;
+  if (length != sizeof(peerMessage)) {
+    return;
+  }
+  uint8_t head = peerHead;
+  uint8_t next = (head + 1) % PEER_QUEUE_SIZE;
+  if (next == peerTail) {
+    // Queue full, drop message
+    return;
+  }
+  memcpy(&peerQueue[head], data, sizeof(peerMessage));
+  peerHead = next;
+}
+
+// Broadcast a channel bulb state, as a new generation
+void peerSend(bulbChannel &channel) {
+  static uint8_t broadcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+  peerMessage message;
+  message.magic = PEER_MAGIC;
+  message.bulb = channel.peerBulb;
+  message.generation = ++channel.peerGeneration;
+  message.bulbOn = channel.bulbOn;
+  message.unused = 0;
+  TRACE_DEBUG("Sending %s generation %u to peers", channel.bulbOn ? "ON" : "OFF", channel.peerGeneration);
+  esp_now_send(broadcast, (uint8_t*) &message, sizeof(message));
+}
+
+// Apply bulb states received from peers
+void peerLoop() {
+  while (peerTail != peerHead) {
+    peerMessage &message = peerQueue[peerTail];
+    if (message.magic == PEER_MAGIC) {
+      for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+        bulbChannel &channel = channels[i];
+        if (channel.peerBulb != message.bulb) {
+          continue;
+        }
+        // Keep newest state. Pushes at the same time on both sides give same generation, ON wins then (on both sides)
+        int16_t age = (int16_t) (message.generation - channel.peerGeneration);
+        if (age < 0 || (age == 0 && (channel.bulbOn || !message.bulbOn))) {
+          continue;
+        }
+        channel.peerGeneration = message.generation;
+        if (!setBulbOn(channel, message.bulbOn)) {
+          continue;
+        }
+        TRACE_INFO("Peer turned bulb %d %s", i, channel.bulbOn ? "ON" : "OFF");
+        channel.peerUpdates++;
+        if (age == 0) {
+          // Our last command lost against peer's one, send bulb state again so that hub ends with it
+          mqttSendCommand(channel, channel.bulbOn);
+        } else {
+          // Wait for hub state, as if command was ours (so that bypass starts on both sides if it doesn't come)
+          channel.lastMqttCommandSent = millis();
+          if (channel.relayState == RELAY_IDLE) {
+            setRelayState(channel, RELAY_WAIT_ACK);
+          }
+          relaySchedule(channel);
+        }
+        if (channel.bulbOn && channel.relayState != RELAY_DISCHARGING) {
+          // Power bulb, as state message would do
+          setRelayOn(channel, true);
+        }
       }
     }
-    // If last command failed
-    if (mqttCommandFailed) {
-      // Set relay as internal bulb state
-      setRelayOn(bulbOn);
+    peerTail = (peerTail + 1) % PEER_QUEUE_SIZE;
+  }
+}
+#endif
+
+#ifdef MILIGHT_RADIO_CS_PIN
+// Send internal bulb state of a channel by local radio (only first channel bulb is known). Returns true if sent
+bool radioSend(bulbChannel &channel) {
+  if (&channel != channels) {
+    return false;
+  }
+  TRACE_DEBUG("Sending %s by radio", channel.bulbOn ? "ON" : "OFF");
+  if (!radio.send(channel.bulbOn ? radioOnPacket : radioOffPacket)) {
+    return false;
+  }
+  radioBulbOn = channel.bulbOn;
+  // Transmissions are sent by radio task, one at each loop
+  scheduler.runIn(TASK_RADIO, 0);
+  return true;
+}
+
+// Go on sending radio packet, using relay as last resort if radio stops answering
+void radioTask(uint8_t task) {
+  if (!radio.update()) {
+    bulbChannel &channel = channels[0];
+    TRACE_WARN("Radio stopped answering");
+    if (channel.relayState == RELAY_RADIO) {
+      setRelayOn(channel, channel.bulbOn);
+      setRelayState(channel, RELAY_BYPASS);
+    }
+    return;
+  }
+  if (radio.busy()) {
+    scheduler.runIn(task, 0);
+  }
+}
+#endif
+
+#ifdef ADAPTIVE_TIMEOUT
+// Update timeout with an ack latency (ms), as TCP retransmission timeout: smoothed latency + 4 * mean deviation
+void timeoutAck(const unsigned long latency) {
+  if (smoothedLatency) {
+    // Smoothed values are kept scaled (x8 for latency, x4 for deviation) to stay in integers
+    long delta = (long) latency - (long) (smoothedLatency >> 3);
+    smoothedLatency += delta;                               // smoothed = 7/8 smoothed + 1/8 latency
+    latencyVariance += abs(delta) - (latencyVariance >> 2); // deviation = 3/4 deviation + 1/4 |delta|
+  } else {
+    // First sample
+    smoothedLatency = latency << 3;
+    latencyVariance = latency << 1;
+  }
+  unsigned long newTimeout = (smoothedLatency >> 3) + latencyVariance;
+  commandTimeout = constrain(newTimeout, (unsigned long) COMMAND_TIMEOUT_MIN, (unsigned long) COMMAND_TIMEOUT_MAX);
+  TRACE_DEBUG("Ack latency %lu ms, timeout now %lu ms", latency, commandTimeout);
+  timeoutChange();
+}
+
+// Command not acknowledged in time, double timeout
+void timeoutExpired() {
+  commandTimeout = min(commandTimeout * 2, (unsigned long) COMMAND_TIMEOUT_MAX);
+  // Restart smoothing from new timeout, so next acks don't bring it back at once
+  smoothedLatency = max(smoothedLatency, (commandTimeout >> 1) << 3);
+  latencyVariance = max(latencyVariance, commandTimeout >> 1);
+  TRACE_DEBUG("Timeout now %lu ms", commandTimeout);
+  timeoutChange();
+}
+
+// Command timeout changed: move waiting channels deadlines, and save it (not too often to preserve flash)
+void timeoutChange() {
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    relaySchedule(channels[i]);
+  }
+  if (!timeoutChanged) {
+    timeoutChanged = true;
+    scheduler.runAt(TASK_TIMEOUT_SAVE, lastTimeoutSave + TIMEOUT_SAVE_INTERVAL + 1);
+  }
+}
+
+// Load saved timeout
+void timeoutLoad() {
+  savedTimeout saved;
+  EEPROM.begin(sizeof(saved));
+  EEPROM.get(0, saved);
+  if (saved.magic == TIMEOUT_MAGIC) {
+    smoothedLatency = saved.smoothedLatency;
+    latencyVariance = saved.latencyVariance;
+    commandTimeout = constrain((smoothedLatency >> 3) + latencyVariance, (unsigned long) COMMAND_TIMEOUT_MIN, (unsigned long) COMMAND_TIMEOUT_MAX);
+    TRACE_INFO("Command timeout restored to %lu ms", commandTimeout);
+  }
+}
+
+// Save changed timeout
+void timeoutSaveTask(uint8_t task) {
+  if (timeoutChanged) {
+    lastTimeoutSave = millis();
+    timeoutChanged = false;
+    savedTimeout saved;
+    saved.magic = TIMEOUT_MAGIC;
+    saved.smoothedLatency = smoothedLatency;
+    saved.latencyVariance = latencyVariance;
+    EEPROM.put(0, saved);
+    if (!EEPROM.commit()) {
+      TRACE_ERR("Can't save command timeout");
     }
   }
 }
+#endif
 
 #ifdef STATS_INTERVAL
-void statsLoop() {
+// Write stats (periodic task)
+void statsTask(uint8_t task) {
+  char buffer[256];
+  // Sum channels stats
+  long syncLost = 0;
+  long pushLost = 0;
+  long pushCount = 0;
+  unsigned long edgeLost = 0;
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    syncLost += channels[i].syncLost;
+    pushLost += channels[i].pushLost;
+    pushCount += channels[i].pushCount;
+    #ifdef BUTTON_INTERRUPT
+      edgeLost += channels[i].debouncer.lostCount();
+    #endif
+  }
+  // Build stats
+  int length = snprintf_P(buffer, sizeof(buffer), 
+    PSTR("Stats: networkLost %ld, mqttLost %ld, syncLost %ld, pushLost %ld, pushCount %ld"), 
+      networkLost, mqttLost, syncLost, pushLost, pushCount);
+  #if defined(SYSLOG_HOST) && defined(SYSLOG_BUFFER_SIZE)
+    // Add count of traces lost because syslog queue was full
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", syslogLost %lu"), syslog.droppedCount());
+  #endif
+  #if defined(SYSLOG_HOST) && defined(SYSLOG_MESSAGE_SIZE)
+    // Add count of traces truncated to fit in format buffer
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", syslogTruncated %lu"), syslog.truncatedCount());
+  #endif
+  #ifdef MQTT_QUEUE_SIZE
+    // Add count of commands replaced by a newer one while MQTT was down
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", queueCoalesced %ld"), queueCoalesced);
+  #endif
+  #ifdef ADAPTIVE_TIMEOUT
+    // Add current command timeout
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", timeout %lu"), commandTimeout);
+  #endif
+  #ifdef BUTTON_INTERRUPT
+    // Add count of button edges lost because queue was full
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", edgeLost %lu"), edgeLost);
+  #endif
+  #ifdef MILIGHT_RADIO_CS_PIN
+    // Add count of commands sent by local radio
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", radioSent %lu"), radio.sentCount());
+  #endif
+  #ifdef PREDICTIVE_RELAY
+    // Add count of predicted relay power ons rolled back
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", predictRollback %ld"), predictRollback);
+  #endif
+  #ifdef ESPNOW_PEERS
+    // Add count of bulb states received from peers
+    long peerUpdates = 0;
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+      peerUpdates += channels[i].peerUpdates;
+    }
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", peerUpdates %ld"), peerUpdates);
+  #endif
+  TRACE_INFO("%s", buffer);
+  // Heap state (and sleep ratio) on their own line, to keep traces below SYSLOG_MESSAGE_SIZE
+  length = snprintf_P(buffer, sizeof(buffer), PSTR("Stats heap: freeHeap %lu, maxBlock %lu, fragmentation %u%%"),
+    (unsigned long) ESP.getFreeHeap(), (unsigned long) ESP.getMaxFreeBlockSize(), (unsigned int) ESP.getHeapFragmentation());
+  #ifdef POWER_SAVE
+    // Add part of time slept since last stats
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", slept %lu%%"),
+      (unsigned long) ((uint64_t) sleptMillis * 100 / STATS_INTERVAL));
+    sleptMillis = 0;
+  #endif
+  TRACE_INFO("%s", buffer);
+  #if CHANNEL_COUNT > 1
+    // Detail each channel
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+      TRACE_INFO("Stats channel %d: syncLost %ld, pushLost %ld, pushCount %ld",
+        i, channels[i].syncLost, channels[i].pushLost, channels[i].pushCount);
+    }
+  #endif
+  #ifdef LOOP_PROFILE
+    // Write loop profile
+    profileWrite();
+  #endif
+  #ifdef LATENCY_TOPIC
+    // Send latency histograms
+    latencySend();
+  #endif
+}
+#endif
+
+#ifdef DEVICE_SHADOW_TOPIC
+// Get current shadow values
+void shadowGet(deviceShadow &shadow) {
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    shadow.channel[0][i] = channels[i].bulbOn;
+    shadow.channel[1][i] = channels[i].relayOn;
+    shadow.channel[2][i] = channels[i].relayState == RELAY_DISCHARGING || channels[i].relayState == RELAY_BYPASS
+      || channels[i].relayState == RELAY_RADIO;
+    shadow.channel[3][i] = channels[i].mqttCommandFailed;
+    shadow.channel[4][i] = channels[i].pushCount;
+    shadow.channel[5][i] = channels[i].pushLost;
+    shadow.channel[6][i] = channels[i].syncLost;
+  }
+  shadow.networkLost = networkLost;
+  shadow.mqttLost = mqttLost;
+}
+
+// Write channel values as "name":[value0,value1...]. Returns written length
+int shadowToJson(char* buffer, const size_t size, const char* name, const long* values) {
+  int length = snprintf_P(buffer, size, PSTR("\"%s\":["), name);
+  for (uint8_t i = 0; i < CHANNEL_COUNT && length < (int) size; i++) {
+    length += snprintf_P(buffer + length, size - length, PSTR("%s%ld"), i ? "," : "", values[i]);
+  }
+  if (length < (int) size) {
+    length += snprintf_P(buffer + length, size - length, PSTR("]"));
+  }
+  return length;
+}
+
+// Read channel values from "name":[value0,value1...] in message. Returns true if found
+bool shadowParse(const char* message, const char* name, long* values) {
+  char key[20];
+  snprintf_P(key, sizeof(key), PSTR("\"%s\":["), name);
+  const char* position = strstr(message, key);
+  if (!position) {
+    return false;
+  }
+  position += strlen(key);
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    char* end;
+    values[i] = strtol(position, &end, 10);
+    if (end == position) {
+      return false;
+    }
+    position = (*end == ',') ? end + 1 : end;
+  }
+  return true;
+}
+
+// Callback activated when retained shadow is received (payload is null terminated by MQTT client)
+void shadowCallback(char* topic, byte* payload, unsigned int length) {
+  TRACE_DEBUG("Got %s on topic %s", (char*) payload, topic);
+  // Ignore our own messages (until unsubscribe is done)
+  if (shadowRestored) {
+    return;
+  }
+  if (shadowRestoreStates) {
+    // States have been lost with power, light bulbs that were on before
+    //  (but those with a state topic, as retained hub state is the reference for them)
+    long bulbOn[CHANNEL_COUNT];
+    if (shadowParse((char*) payload, shadowNames[0], bulbOn)) {
+      for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+        if (bulbOn[i] && !channels[i].stateTopic) {
+          TRACE_INFO("Restoring bulb %d ON from shadow", i);
+          setBulbOn(channels[i], true);
+          setRelayOn(channels[i], true);
+        }
+      }
+    }
+  }
+  shadowRestoreDone();
+}
+
+// Retained shadow received (or not found), start sending ours
+void shadowRestoreDone() {
+  shadowRestored = true;
+  shadowFull = true;
+  mqttClient.unsubscribe(DEVICE_SHADOW_TOPIC);
+}
+
+// Device shadow loop
+void shadowLoop() {
+  if (!mqttClient.connected()) {
+    return;
+  }
+  unsigned long now = millis();
+  // Don't overwrite retained shadow before reading it
+  if (!shadowRestored) {
+    if ((now - shadowRestoreStart) > DEVICE_SHADOW_RESTORE_TIMEOUT) {
+      TRACE_INFO("No retained shadow");
+      shadowRestoreDone();
+    }
+    return;
+  }
+  // Was last shadow sent older than minimum interval?
+  if ((now - lastShadowSent) < DEVICE_SHADOW_INTERVAL) {
+    return;
+  }
+  deviceShadow shadow;
+  shadowGet(shadow);
+  // Find changed fields first, message being only built when something changed
+  bool fieldChanged[SHADOW_CHANNEL_FIELDS];
+  bool changed = shadowFull || shadow.networkLost != shadowSent.networkLost || shadow.mqttLost != shadowSent.mqttLost;
+  for (uint8_t field = 0; field < SHADOW_CHANNEL_FIELDS; field++) {
+    fieldChanged[field] = memcmp(shadow.channel[field], shadowSent.channel[field], sizeof(shadow.channel[field])) != 0;
+    changed = changed || fieldChanged[field];
+  }
+  if (!changed) {
+    return;
+  }
+  // Build message with state fields (to be able to restore them from retained message) and changed counters
+  char buffer[MQTT_MAX_PACKET_SIZE - sizeof(DEVICE_SHADOW_TOPIC) - 8];
+  int length = snprintf_P(buffer, sizeof(buffer), PSTR("{"));
+  for (uint8_t field = 0; field < SHADOW_CHANNEL_FIELDS && length < (int) sizeof(buffer) - 1; field++) {
+    if (field < SHADOW_STATE_FIELDS || fieldChanged[field] || shadowFull) {
+      if (field) {
+        buffer[length++] = ',';
+      }
+      length += shadowToJson(buffer + length, sizeof(buffer) - length, shadowNames[field], shadow.channel[field]);
+    }
+  }
+  if ((shadowFull || shadow.networkLost != shadowSent.networkLost) && length < (int) sizeof(buffer)) {
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(",\"networkLost\":%ld"), shadow.networkLost);
+  }
+  if ((shadowFull || shadow.mqttLost != shadowSent.mqttLost) && length < (int) sizeof(buffer)) {
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(",\"mqttLost\":%ld"), shadow.mqttLost);
+  }
+  lastShadowSent = now;
+  if (length < (int) sizeof(buffer) - 1) {
+    buffer[length++] = '}';
+    buffer[length] = 0;
+    TRACE_DEBUG("Sending %s to %s", buffer, DEVICE_SHADOW_TOPIC);
+    // Publish shadow as retained message, keep values to be sent again if not published
+    if (mqttClient.publish(DEVICE_SHADOW_TOPIC, buffer, true)) {
+      shadowSent = shadow;
+      shadowFull = false;
+    }
+  } else {
+    TRACE_WARN("Shadow message too long, not sent");
+  }
+}
+#endif
+
+#ifdef LOOP_PROFILE
+// End a loop stage started at given cycle count (and start next one)
+void profileEnd(const profileStages stage, uint32_t &startCycles) {
+  uint32_t now = ESP.getCycleCount();
+  uint32_t cycles = now - startCycles;
+  startCycles = now;
+  profile[stage].totalCycles += cycles;
+  if (cycles > profile[stage].maxCycles) {
+    profile[stage].maxCycles = cycles;
+  }
+  if (cycles > (uint32_t) LOOP_PROFILE_THRESHOLD * ESP.getCpuFreqMHz()) {
+    profile[stage].slowCount++;
+  }
+}
+
+// Write loop profile (then clear it)
+void profileWrite() {
+  unsigned long now = millis();
+  uint8_t mhz = ESP.getCpuFreqMHz();
+  char buffer[256];
+  // Loops per second, longest button gap, then for each stage: max, mean per loop (us) and slow count
+  int length = snprintf_P(buffer, sizeof(buffer), PSTR("Profile: %lu loops/s, buttonGap %lu us"),
+    (unsigned long) (profileLoops * 1000ULL / max(now - profileStart, 1UL)), maxButtonGap);
+  for (uint8_t i = 0; i < PROFILE_COUNT && length < (int) sizeof(buffer); i++) {
+    if (profile[i].maxCycles) {
+      length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(", %s %lu/%lu/%lu"), profileNames[i],
+        (unsigned long) (profile[i].maxCycles / mhz), (unsigned long) (profile[i].totalCycles / mhz / max(profileLoops, 1U)),
+        (unsigned long) profile[i].slowCount);
+    }
+  }
+  TRACE_INFO("%s", buffer);
+  // Restart profiling
+  memset(profile, 0, sizeof(profile));
+  profileLoops = 0;
+  profileStart = now;
+  maxButtonGap = 0;
+}
+#endif
+
+#ifdef LATENCY_TOPIC
+// Add latency since start (us) to histogram, in log2 buckets
+void latencyAdd(latencyHistogram &histogram, const unsigned long start) {
+  unsigned long latency = micros() - start;
+  uint8_t bucket = latency ? 32 - __builtin_clz((uint32_t) latency) : 0;
+  if (bucket >= LATENCY_BUCKETS) {
+    bucket = LATENCY_BUCKETS - 1;
+  }
+  // Don't overflow counter
+  if (histogram.count[bucket] < UINT16_MAX) {
+    histogram.count[bucket]++;
+  }
+  #ifdef TELEMETRY_HOST
+    histogram.total[bucket]++;
+  #endif
+}
+
+// Write histogram as "name":[count0,count1...] (without trailing empty buckets). Returns written length
+int latencyToJson(char* buffer, const size_t size, const char* name, latencyHistogram &histogram) {
+  uint8_t used = LATENCY_BUCKETS;
+  while (used && !histogram.count[used - 1]) {
+    used--;
+  }
+  int length = snprintf_P(buffer, size, PSTR("\"%s\":["), name);
+  for (uint8_t i = 0; i < used && length < (int) size; i++) {
+    length += snprintf_P(buffer + length, size - length, PSTR("%s%u"), i ? "," : "", histogram.count[i]);
+  }
+  if (length < (int) size) {
+    length += snprintf_P(buffer + length, size - length, PSTR("]"));
+  }
+  return length;
+}
+
+// A channel command has been published
+void latencyPublished(bulbChannel &channel) {
+  channel.publishMicros = micros();
+  channel.ackPending = true;
+  // Only first publish after a press counts (not resyncs)
+  if (channel.publishPending) {
+    channel.publishPending = false;
+    latencyAdd(pressToPublish, channel.pressMicros);
+  }
+}
+
+// Send latency histograms and late acks count (then clear them)
+void latencySend() {
+  // Keep message in default MQTT buffer size
+  char buffer[MQTT_MAX_PACKET_SIZE - sizeof(LATENCY_TOPIC) - 8];
+  int length = snprintf_P(buffer, sizeof(buffer), PSTR("{\"lateAcks\":%ld,"), lateAcks);
+  length += latencyToJson(buffer + length, sizeof(buffer) - length, "pressToPublish", pressToPublish);
+  if (length < (int) sizeof(buffer)) {
+    buffer[length++] = ',';
+    length += latencyToJson(buffer + length, sizeof(buffer) - length, "publishToAck", publishToAck);
+  }
+  if (length < (int) sizeof(buffer)) {
+    buffer[length++] = ',';
+    length += latencyToJson(buffer + length, sizeof(buffer) - length, "pressToRelay", pressToRelay);
+  }
+  if (length < (int) sizeof(buffer) - 1) {
+    buffer[length++] = '}';
+    buffer[length] = 0;
+    TRACE_DEBUG("Sending %s to %s", buffer, LATENCY_TOPIC);
+    mqttClient.publish(LATENCY_TOPIC, buffer);
+  } else {
+    TRACE_WARN("Latency message too long, not sent");
+  }
+  // Restart counting (telemetry totals are kept)
+  memset(pressToPublish.count, 0, sizeof(pressToPublish.count));
+  memset(publishToAck.count, 0, sizeof(publishToAck.count));
+  memset(pressToRelay.count, 0, sizeof(pressToRelay.count));
+  lateAcks = 0;
+}
+#endif
+
+#ifdef TELEMETRY_HOST
+// End measure of a loop started at given cycle count
+void telemetryLoopEnd(const uint32_t startCycles) {
+  uint32_t cycles = ESP.getCycleCount() - startCycles;
+  telemetryLoops++;
+  telemetryLoopCycles += cycles;
+  if (cycles > telemetryMaxCycles) {
+    telemetryMaxCycles = cycles;
+  }
+}
+
+// Send a telemetry frame (no formatting, collector decodes it)
+void telemetryTask(uint8_t task) {
+  if (WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+  telemetryFrame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.magic = TELEMETRY_MAGIC;
+  frame.version = TELEMETRY_VERSION;
+  frame.channelCount = CHANNEL_COUNT;
+  frame.interval = TELEMETRY_INTERVAL / 1000;
+  frame.chipId = ESP.getChipId();
+  frame.sequence = telemetrySequence++;
+  frame.uptime = (uint32_t) (micros64() / 1000000);
+  // Counters
+  frame.networkLost = networkLost;
+  frame.mqttLost = mqttLost;
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    frame.syncLost += channels[i].syncLost;
+    frame.pushLost += channels[i].pushLost;
+    frame.pushCount += channels[i].pushCount;
+    #ifdef ESPNOW_PEERS
+      frame.peerUpdates += channels[i].peerUpdates;
+    #endif
+    #ifdef BUTTON_INTERRUPT
+      frame.edgeLost += channels[i].debouncer.lostCount();
+    #endif
+  }
+  frame.queueCoalesced = queueCoalesced;
+  frame.predictRollback = predictRollback;
+  frame.commandTimeout = commandTimeout;
+  #if defined(SYSLOG_HOST) && defined(SYSLOG_BUFFER_SIZE)
+    frame.flags |= TELEMETRY_FLAG_SYSLOG_QUEUE;
+    frame.syslogLost = syslog.droppedCount();
+  #endif
+  #if defined(SYSLOG_HOST) && defined(SYSLOG_MESSAGE_SIZE)
+    frame.flags |= TELEMETRY_FLAG_SYSLOG_FORMAT;
+    frame.syslogTruncated = syslog.truncatedCount();
+  #endif
+  #ifdef MQTT_QUEUE_SIZE
+    frame.flags |= TELEMETRY_FLAG_MQTT_QUEUE;
+  #endif
+  #ifdef ADAPTIVE_TIMEOUT
+    frame.flags |= TELEMETRY_FLAG_ADAPTIVE_TIMEOUT;
+  #endif
+  #ifdef BUTTON_INTERRUPT
+    frame.flags |= TELEMETRY_FLAG_BUTTON_INTERRUPT;
+  #endif
+  #ifdef MILIGHT_RADIO_CS_PIN
+    frame.flags |= TELEMETRY_FLAG_RADIO;
+    frame.radioSent = radio.sentCount();
+  #endif
+  #ifdef PREDICTIVE_RELAY
+    frame.flags |= TELEMETRY_FLAG_PREDICTIVE_RELAY;
+  #endif
+  #ifdef ESPNOW_PEERS
+    frame.flags |= TELEMETRY_FLAG_PEERS;
+  #endif
+  // Gauges
+  frame.freeHeap = ESP.getFreeHeap();
+  frame.maxBlock = ESP.getMaxFreeBlockSize();
+  frame.fragmentation = ESP.getHeapFragmentation();
+  frame.rssi = WiFi.RSSI();
+  // Loop timing
+  uint8_t mhz = ESP.getCpuFreqMHz();
+  frame.loopCount = telemetryLoops;
+  frame.loopMicros = (uint32_t) (telemetryLoopCycles / mhz);
+  frame.loopMaxMicros = telemetryMaxCycles / mhz;
+  telemetryMaxCycles = 0;
+  #ifdef LATENCY_TOPIC
+    frame.flags |= TELEMETRY_FLAG_LATENCY;
+    memcpy(frame.latency[0], pressToPublish.total, sizeof(frame.latency[0]));
+    memcpy(frame.latency[1], publishToAck.total, sizeof(frame.latency[1]));
+    memcpy(frame.latency[2], pressToRelay.total, sizeof(frame.latency[2]));
+  #endif
+  telemetryClient.beginPacket(TELEMETRY_HOST, TELEMETRY_PORT);
+  telemetryClient.write((const uint8_t*) &frame, sizeof(frame));
+  telemetryClient.endPacket();
+}
+#endif
+
+#ifdef POWER_TOPIC
+// Count BL0937 CF pulses
+void IRAM_ATTR powerInterrupt() {
+  powerPulses++;
+}
+
+// Power metering (periodic task, every second)
+void powerTask(uint8_t task) {
+  unsigned long now = millis();
+  // Sample pulses count
+  powerSampleIndex = (powerSampleIndex + 1) % (POWER_WINDOW + 1);
+  powerSamples[powerSampleIndex].time = now;
+  powerSamples[powerSampleIndex].pulses = powerPulses;
+  if (powerSampleCount < POWER_WINDOW + 1) {
+    powerSampleCount++;
+  }
+  // Power over window is energy of pulses between oldest and last samples, divided by their time difference
+  if (powerSampleCount > 1) {
+    powerSample &oldest = powerSamples[(powerSampleIndex + POWER_WINDOW + 2 - powerSampleCount) % (POWER_WINDOW + 1)];
+    uint32_t pulses = powerSamples[powerSampleIndex].pulses - oldest.pulses;
+    unsigned long duration = now - oldest.time;
+    powerMilliwatts = (uint32_t) (((uint64_t) pulses * POWER_PULSE_ENERGY * 1000) / duration);
+  }
+  if (powerSampleCount < 2) {
+    return;
+  }
+  long power = (powerMilliwatts + 500) / 1000;
+  bulbLit = power >= POWER_BULB_MIN;
+  // Is any channel bulb and relay on?
+  bool shouldBeLit = false;
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    shouldBeLit = shouldBeLit || (channels[i].bulbOn && channels[i].relayOn);
+  }
+  if (!shouldBeLit) {
+    powerBypassCheck = false;
+    powerNotLitWarned = false;
+  } else if ((now - powerRelayOnTime) >= POWER_SETTLE_TIME) {
+    // Power window only holds samples since relay switch on, check bulb each time power is measured
+    if (bulbLit) {
+      if (powerBypassCheck) {
+        TRACE_INFO("Bypass power cycle lit bulb (%ld W)", power);
+      }
+      powerNotLitWarned = false;
+    } else if (!powerNotLitWarned) {
+      // Report it once (until bulb lights or power is cut), sending it with next power
+      powerNotLitWarned = true;
+      bulbNotLit++;
+      lastPower = -1;
+      if (powerBypassCheck) {
+        TRACE_WARN("Bypass power cycle didn't light bulb (%ld W)", power);
+      } else {
+        TRACE_WARN("Bulb should be lit but uses %ld W", power);
+      }
+    }
+    powerBypassCheck = false;
+  }
+  // Send power at regular interval
+  if ((now - lastPowerSend) > POWER_INTERVAL) {
+    lastPowerSend = now;
+    // Does the power change outside limits?
+    if (lastPower < 0 || abs(power - lastPower) >= POWER_DELTA) {
+      char buffer[100];
+      // Energy since boot (Wh)
+      uint32_t energy = (uint32_t) (((uint64_t) powerPulses * POWER_PULSE_ENERGY) / 3600000);
+      // Buid MQTT message
+      snprintf_P(buffer, sizeof(buffer), PSTR("{\"power\":%ld,\"energy\":%lu,\"lit\":%s,\"notLit\":%ld}"),
+        power, (unsigned long) energy, bulbLit ? "true" : "false", bulbNotLit);
+      TRACE_DEBUG("Sending %s to %s", buffer, POWER_TOPIC);
+      // Publish power change
+      mqttClient.publish(POWER_TOPIC, buffer);
+      // Save last power value
+      lastPower = power;
+    }
+  }
+}
+#endif
+
+#if defined(SYSLOG_HOST) && defined(SYSLOG_BUFFER_SIZE)
+// Syslog loop
+void syslogLoop() {
+  // Send queued traces (as much as pacing allows)
+  syslog.loop();
+}
+#endif
+
+#if defined(SYSLOG_HOST) && defined(SYSLOG_KEEPALIVE)
+// Send a keep alive message if nothing has been sent for a while
+void syslogKeepAliveTask(uint8_t task) {
   unsigned long now = millis();
-  
-  // Where last stats display older than required?
-  if ((now - lastStats) > STATS_INTERVAL) {
-    // Save last stats time
-    lastStats = now;
-    char buffer[50];
-    // Build stats
-    snprintf_P(buffer, sizeof(buffer), 
-      PSTR("Stats: networkLost %d, mqttLost %d, syncLost %d, pushLost %d, pushCount %d"), 
-        networkLost, mqttLost, syncLost, pushLost, pushCount);
-    TRACE(buffer);
+  unsigned long lastSent = syslog.lastSyslogMillis;
+  if ((now - lastSent) > SYSLOG_KEEPALIVE) {
+    syslog.log("Syslog keep alive message");
+    // (queued message is only sent later)
+    lastSent = now;
   }
+  scheduler.runAt(task, lastSent + SYSLOG_KEEPALIVE + 1);
+}
+#endif
+
+#ifdef POWER_SAVE
+// Shorten sleep time to given deadline (ms)
+void powerDeadline(unsigned long &sleepTime, unsigned long now, unsigned long deadline) {
+  long remaining = (long) (deadline - now);
+  if (remaining <= 0) {
+    sleepTime = 0;
+  } else if ((unsigned long) remaining < sleepTime) {
+    sleepTime = remaining;
+  }
+}
+
+// Time (ms) loop can sleep before having something to do (next task, or deadlines tested by loop functions)
+unsigned long powerSleepTime() {
+  // Don't sleep while connecting
+  if (startupState != STARTUP_DONE || WiFi.status() != WL_CONNECTED) {
+    return 0;
+  }
+  // Scheduled tasks (command timeout, MQTT connection, stats, temperature...)
+  unsigned long sleepTime = scheduler.nextDelay(POWER_SAVE_MAX_SLEEP);
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    bulbChannel &channel = channels[i];
+    // Button change to debounce
+    if (channel.debouncer.edgesQueued()) {
+      return 0;
+    }
+    unsigned long debounceTime;
+    if (channel.debouncer.debounceTime(debounceTime)) {
+      powerDeadline(sleepTime, now, debounceTime);
+    }
+  }
+  #ifdef ESPNOW_PEERS
+    // Peer messages to apply
+    if (peerTail != peerHead) {
+      return 0;
+    }
+  #endif
+  // MQTT keep alive (received data is checked while sleeping)
+  if (mqttClient.connected()) {
+    powerDeadline(sleepTime, now, now + mqttClient.keepAliveDelay());
+  }
+  #ifdef DEVICE_SHADOW_TOPIC
+    // Changes are sent at once, or at end of minimum interval
+    if (!shadowRestored) {
+      powerDeadline(sleepTime, now, shadowRestoreStart + DEVICE_SHADOW_RESTORE_TIMEOUT + 1);
+    } else if ((now - lastShadowSent) < DEVICE_SHADOW_INTERVAL) {
+      powerDeadline(sleepTime, now, lastShadowSent + DEVICE_SHADOW_INTERVAL);
+    }
+  #endif
+  #if defined(SYSLOG_HOST) && defined(SYSLOG_BUFFER_SIZE)
+    // Queued traces are sent as soon as pacing allows
+    if (syslog.pendingBytes()) {
+      powerDeadline(sleepTime, now, syslog.nextSendMillis());
+    }
+  #endif
+  return sleepTime;
+}
+
+// Is there something to do before end of sleep?
+bool powerWakeUp() {
+  if (WFClient.available()) {
+    return true;
+  }
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    if (channels[i].debouncer.edgesQueued()) {
+      return true;
+    }
+  }
+  #ifdef ESPNOW_PEERS
+    if (peerTail != peerHead) {
+      return true;
+    }
+  #endif
+  return false;
+}
+
+// Sleep until next deadline, unless woken up by received data, button change or peer message
+void powerSleep() {
+  unsigned long sleepTime = powerSleepTime();
+  if (!sleepTime) {
+    return;
+  }
+  unsigned long start = millis();
+  #ifdef POWER_SAVE_LIGHT_SLEEP
+    // Edge interrupts don't run in light sleep, let buttons wake module up
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+      channels[i].debouncer.wakeOnChange();
+    }
+  #endif
+  // SDK lets modem (or module) sleep while waiting in delay(), which can't be interrupted, so wait by slices
+  unsigned long elapsed = 0;
+  while (elapsed < sleepTime) {
+    delay(min((unsigned long) POWER_SAVE_SLICE, sleepTime - elapsed));
+    elapsed = millis() - start;
+    if (powerWakeUp()) {
+      break;
+    }
+  }
+  #ifdef POWER_SAVE_LIGHT_SLEEP
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+      channels[i].debouncer.awake();
+    }
+  #endif
+  sleptMillis += elapsed;
 }
 #endif
 
 #ifdef TEMPERATURE_TOPIC
   // Shelly specific routines
-  #include <float.h>
-  double TaylorLog(double x) {
-    if (x <= 0.0) { return NAN; }
-    if (x == 1.0) { return 0; }
-    double z = (x + 1) / (x - 1);                              // We start from power -1, to make sure we get the right power in each iteration;
-    double step = ((x - 1) * (x - 1)) / ((x + 1) * (x + 1));   // Store step to not have to calculate it each time
-    double totalValue = 0;
-    double powe = 1;
-    for (uint32_t count = 0; count < 10; count++) {            // Experimental number of 10 iterations
+  #define ANALOG_NTC_BRIDGE_RESISTANCE  32000              // NTC Voltage bridge resistor
+  #define ANALOG_NTC_RESISTANCE         10000              // NTC Resistance
+  #define ANALOG_NTC_B_COEFFICIENT      3350               // NTC Beta Coefficient
+  // Parameters for equation
+  #define TO_CELSIUS(x) ((x) - 273.15)
+  #define TO_KELVIN(x) ((x) + 273.15)
+  #define ANALOG_V33                    3.3                // ESP8266 Analog voltage
+  #define ANALOG_T0                     TO_KELVIN(25.0)    // 25 degrees Celcius in Kelvin (= 298.15)
+  #define NTC_TABLE_SHIFT               3                  // Table has one entry every 2^NTC_TABLE_SHIFT ADC values
+
+  // Natural log, usable at compile time
+  constexpr double ntcLog(double x) {
+    // Bring x in [1, 2[ (adding ln(2) multiples), then use ln(x) = 2 * atanh((x - 1) / (x + 1)) series
+    double result = 0;
+    while (x >= 2.0) { x /= 2.0; result += 0.6931471805599453; }
+    while (x < 1.0) { x *= 2.0; result -= 0.6931471805599453; }
+    double z = (x - 1) / (x + 1);
+    double step = z * z;
+    double sum = 0;
+    for (uint8_t power = 1; power < 40; power += 2) {
+      sum += z / power;
       z *= step;
-      double y = (1 / powe) * z;
-      totalValue = totalValue + y;
-      powe = powe + 2;
     }
-    totalValue *= 2;
-    return totalValue;
+    return result + 2 * sum;
   }
-    
-  // Read Shelly 1PM temperature (truncates to integer)
-  int getTemperature() {
-    // Should not use analogread to often otherwise the wifi stops working
-    // Range: 387 (cold) to 226 (hot)
-    int adc = analogRead(A0);
-    
-    #define ANALOG_NTC_BRIDGE_RESISTANCE  32000            // NTC Voltage bridge resistor
-    #define ANALOG_NTC_RESISTANCE         10000            // NTC Resistance
-    #define ANALOG_NTC_B_COEFFICIENT      3350             // NTC Beta Coefficient
-    // Parameters for equation
-    #define TO_CELSIUS(x) ((x) - 273.15)
-    #define TO_KELVIN(x) ((x) + 273.15)
-    #define ANALOG_V33                    3.3              // ESP8266 Analog voltage
-    #define ANALOG_T0                     TO_KELVIN(25.0)  // 25 degrees Celcius in Kelvin (= 298.15)
-
-    // Steinhart-Hart equation for thermistor as temperature sensor
+
+  // Temperature (hundredth of degree Celsius) for an ADC value, using Steinhart-Hart equation for thermistor
+  constexpr int16_t ntcTemperature(int adc) {
     double Rt = (adc * ANALOG_NTC_BRIDGE_RESISTANCE) / (1024.0 * ANALOG_V33 - (double)adc);
-    double BC = (double)ANALOG_NTC_B_COEFFICIENT * 10000 / 10000;
-    double T = BC / (BC / ANALOG_T0 + TaylorLog(Rt / (double)ANALOG_NTC_RESISTANCE));
-    double temperature = TO_CELSIUS(T);
-    return (int)(temperature < 0 ? temperature - 0.5 : temperature + 0.5);
-  }
-
-  // Temperature loop
-  void temperatureLoop() {
-    unsigned long now = millis();
-    // Do the job at regular interval
-    if ((now - lastTemperatureMillis) > TEMPERATURE_INTERVAL) {
-      // Save last temperature date
-      lastTemperatureMillis = now;
-      // Read temperature
-      int temperature = getTemperature();
-      // Have we been initialized?
-      if (temperatureValid) {
-        // Does the temperature change outside limits?
-        if (abs(lastTemperature - temperature) >= TEMPERATURE_DELTA) {
+    double BC = (double)ANALOG_NTC_B_COEFFICIENT;
+    double T = BC / (BC / ANALOG_T0 + ntcLog(Rt / (double)ANALOG_NTC_RESISTANCE));
+    double temperature = TO_CELSIUS(T) * 100;
+    // Clamp meaningless extreme values
+    temperature = temperature < INT16_MIN ? INT16_MIN : (temperature > INT16_MAX ? INT16_MAX : temperature);
+    return (int16_t)(temperature < 0 ? temperature - 0.5 : temperature + 0.5);
+  }
+
+  // ADC to temperature table, built at compile time
+  struct NtcTable {
+    int16_t value[(1024 >> NTC_TABLE_SHIFT) + 1];
+
+    constexpr NtcTable() : value() {
+      for (int i = 0; i <= (1024 >> NTC_TABLE_SHIFT); i++) {
+        // ADC 0 means no resistance (infinite cold), use 1 instead
+        value[i] = ntcTemperature(i ? i << NTC_TABLE_SHIFT : 1);
+      }
+    }
+  };
+  static constexpr NtcTable ntcTable PROGMEM = NtcTable();
+
+  // Convert Shelly 1PM ADC value to temperature (hundredth of degree)
+  int getTemperature(int adc) {
+    // ADC gives 0 to 1024, its maximum being last table entry
+    if (adc >= 1024) {
+      return (int16_t) pgm_read_word(&ntcTable.value[1024 >> NTC_TABLE_SHIFT]);
+    }
+    // Interpolate between the two table entries around ADC value
+    uint16_t index = adc >> NTC_TABLE_SHIFT;
+    int16_t low = pgm_read_word(&ntcTable.value[index]);
+    int16_t high = pgm_read_word(&ntcTable.value[index + 1]);
+    int16_t offset = adc & ((1 << NTC_TABLE_SHIFT) - 1);
+    return low + (((high - low) * offset) >> NTC_TABLE_SHIFT);
+  }
+
+  // Round hundredth of degrees to degrees
+  int toDegrees(int temperature) {
+    return (temperature < 0 ? temperature - 50 : temperature + 50) / 100;
+  }
+
+  // Return median of current scan ADC reads (sorting them)
+  int medianSample() {
+    for (uint8_t i = 1; i < TEMPERATURE_SAMPLES; i++) {
+      int value = temperatureSamples[i];
+      uint8_t j = i;
+      while (j && temperatureSamples[j - 1] > value) {
+        temperatureSamples[j] = temperatureSamples[j - 1];
+        j--;
+      }
+      temperatureSamples[j] = value;
+    }
+    return temperatureSamples[TEMPERATURE_SAMPLES / 2];
+  }
+
+  // Temperature (periodic task, ADC reads being spread over scan interval)
+  void temperatureTask(uint8_t task) {
+    // Should not use analogread to often otherwise the wifi stops working, so don't read while network is busy (retry on next loop)
+    if (WFClient.available() || mqttClient.connecting()) {
+      scheduler.runIn(task, 0);
+      return;
+    }
+    // Range: 387 (cold) to 226 (hot)
+    temperatureSamples[temperatureSampleCount++] = analogRead(A0);
+    if (temperatureSampleCount < TEMPERATURE_SAMPLES) {
+      return;
+    }
+    temperatureSampleCount = 0;
+    // Scan complete, median removes ADC spikes, then filter temperature
+    int temperature = getTemperature(medianSample());
+    if (temperatureValid) {
+      filteredTemperature += (temperature - filteredTemperature) >> TEMPERATURE_FILTER_SHIFT;
+      // Does the temperature change outside limits?
+      if (abs(lastTemperature - filteredTemperature) >= TEMPERATURE_DELTA * 100) {
+        char buffer[100];
+        // Buid MQTT message (in rounded degrees)
+        int degrees = toDegrees(filteredTemperature);
+        snprintf_P(buffer, sizeof(buffer), PSTR("{\"temperature\":%d,\"delta\":%d}"), degrees, degrees - toDegrees(lastTemperature));
+        TRACE_DEBUG("Sending %s to %s", buffer, TEMPERATURE_TOPIC);
+        // Publish temperature change
+        mqttClient.publish(TEMPERATURE_TOPIC, buffer);
+        // Save last temperature value
+        lastTemperature = filteredTemperature;
+      }
+      #ifdef TEMPERATURE_ALARM
+        // Set alarm over limit, clear it under limit minus hysteresis
+        if (temperatureAlarm ? (filteredTemperature <= (TEMPERATURE_ALARM - TEMPERATURE_ALARM_HYSTERESIS) * 100)
+            : (filteredTemperature >= TEMPERATURE_ALARM * 100)) {
+          temperatureAlarm = !temperatureAlarm;
           char buffer[100];
-          // Buid MQTT message
-          snprintf_P(buffer, sizeof(buffer), PSTR("{\"temperature\":%d,\"delta\":%d}"), temperature, temperature - lastTemperature);
-          TRACE("Sending %s to %s", buffer, TEMPERATURE_TOPIC);
-          // Publish temperature change
+          snprintf_P(buffer, sizeof(buffer), PSTR("{\"alarm\":%s,\"temperature\":%d}"),
+            temperatureAlarm ? "true" : "false", toDegrees(filteredTemperature));
+          if (temperatureAlarm) {
+            TRACE_ERR("Over temperature alarm: %s", buffer);
+          } else {
+            TRACE_WARN("Over temperature alarm cleared: %s", buffer);
+          }
           mqttClient.publish(TEMPERATURE_TOPIC, buffer);
-          // Save last temperature value
-          lastTemperature = temperature;
         }
-      } else {
-        // Save last temperature value
-        lastTemperature = temperature;
-        // Set init flag
-        temperatureValid = true;
-      }
+      #endif
+    } else {
+      // Save last temperature value
+      filteredTemperature = temperature;
+      lastTemperature = temperature;
+      // Set init flag
+      temperatureValid = true;
+    }
+  }
+#endif
+
+#ifdef PULL_OTA_TOPIC
+// Read string value of "name":"value" in message. Returns true if found (and fitting in size)
+bool pullOtaParse(const char* message, const char* name, char* value, const size_t size) {
+  char key[16];
+  snprintf_P(key, sizeof(key), PSTR("\"%s\":\""), name);
+  const char* position = strstr(message, key);
+  if (!position) {
+    return false;
+  }
+  position += strlen(key);
+  const char* end = strchr(position, '"');
+  if (!end || (size_t) (end - position) >= size) {
+    return false;
+  }
+  memcpy(value, position, end - position);
+  value[end - position] = 0;
+  return true;
+}
+
+// Send update state (with progress and error if any)
+void pullOtaStatus(const char* state, const char* error) {
+  char buffer[160];
+  int length = snprintf_P(buffer, sizeof(buffer), PSTR("{\"state\":\"%s\",\"delta\":%s,\"size\":%u,\"written\":%u,\"resumes\":%lu"),
+    state, pullUpdate.delta() ? "true" : "false", pullUpdate.imageSize(), pullUpdate.written(), pullUpdate.resumes());
+  if (error) {
+    length += snprintf_P(buffer + length, sizeof(buffer) - length, PSTR(",\"error\":\"%s\""), error);
+  }
+  snprintf_P(buffer + length, sizeof(buffer) - length, PSTR("}"));
+  TRACE_INFO("Pull OTA %s", buffer);
+  mqttClient.publish(PULL_OTA_STATUS_TOPIC, buffer);
+}
+
+// Callback activated when an update is asked (payload is null terminated by MQTT client)
+void pullOtaCallback(char* topic, byte* payload, unsigned int length) {
+  TRACE_DEBUG("Got %s on topic %s", (char*) payload, topic);
+  char url[200];
+  char md5[33];
+  if (!pullOtaParse((char*) payload, "url", url, sizeof(url)) || !pullOtaParse((char*) payload, "md5", md5, sizeof(md5))) {
+    TRACE_ERR("Pull OTA: can't find url and md5 in %s", (char*) payload);
+    return;
+  }
+  // Don't update again to running image (retained or repeated request)
+  if (!strcasecmp(md5, pullOtaRunningMd5)) {
+    TRACE_INFO("Pull OTA: image %s already running", md5);
+    return;
+  }
+  if (pullUpdate.running() || pullOtaRestart) {
+    TRACE_WARN("Pull OTA: update already running, ignoring %s", url);
+    return;
+  }
+  if (!pullUpdate.begin(otaClient, url, md5)) {
+    pullOtaStatus("failed", pullUpdate.error());
+    return;
+  }
+  TRACE_INFO("Pull OTA: updating from %s", url);
+  pullOtaProgress = 0;
+  pullOtaStatus("started");
+  scheduler.runIn(TASK_PULL_OTA, 0);
+}
+
+// Do next update step (then wait a bit, to let loop serve button and MQTT)
+void pullOtaTask(uint8_t task) {
+  if (pullOtaRestart) {
+    TRACE_INFO("Pull OTA: restarting on new image");
+    ESP.restart();
+    return;
+  }
+  PullUpdate::State state = pullUpdate.run(PULL_OTA_CHUNK_SIZE);
+  if (state == PullUpdate::UPDATE_DONE) {
+    pullOtaStatus("done");
+    // Let status be sent before restarting
+    pullOtaRestart = true;
+    scheduler.runIn(task, 1000);
+    return;
+  }
+  if (state == PullUpdate::UPDATE_FAILED) {
+    pullOtaStatus("failed", pullUpdate.error());
+    return;
+  }
+  // Send progress each 10%
+  if (pullUpdate.imageSize()) {
+    uint8_t progress = (uint64_t) pullUpdate.written() * 10 / pullUpdate.imageSize();
+    if (progress > pullOtaProgress) {
+      pullOtaProgress = progress;
+      pullOtaStatus("running");
     }
   }
+  // Connection lost: resume download after retry delay
+  scheduler.runIn(task, (state == PullUpdate::UPDATE_RETRY) ? PULL_OTA_RETRY_DELAY : PULL_OTA_CHUNK_INTERVAL);
+}
 #endif
 
 void setup() {
@@ -368,52 +1842,188 @@ void setup() {
     Serial.begin(74880);
   #endif
 
-  // Start Wifi
+  // Set tasks (periodic ones start one period from now)
+  scheduler.set(TASK_MQTT_CONNECT, mqttConnectTask);
+  mqttConnectSchedule();
+  #ifdef ADAPTIVE_TIMEOUT
+    scheduler.set(TASK_TIMEOUT_SAVE, timeoutSaveTask);
+  #endif
+  #ifdef STATS_INTERVAL
+    scheduler.set(TASK_STATS, statsTask, STATS_INTERVAL + 1);
+  #endif
+  #ifdef TEMPERATURE_TOPIC
+    scheduler.set(TASK_TEMPERATURE, temperatureTask, (TEMPERATURE_INTERVAL / TEMPERATURE_SAMPLES) + 1);
+  #endif
+  #ifdef POWER_TOPIC
+    scheduler.set(TASK_POWER, powerTask, 1000);
+  #endif
+  #if defined(SYSLOG_HOST) && defined(SYSLOG_KEEPALIVE)
+    scheduler.set(TASK_SYSLOG_KEEPALIVE, syslogKeepAliveTask);
+    scheduler.runAt(TASK_SYSLOG_KEEPALIVE, SYSLOG_KEEPALIVE + 1);
+  #endif
+  #ifdef TELEMETRY_HOST
+    scheduler.set(TASK_TELEMETRY, telemetryTask, TELEMETRY_INTERVAL);
+  #endif
+  #ifdef PERSIST_FLASH
+    scheduler.set(TASK_PERSIST, persistTask, PERSIST_STATS_INTERVAL);
+  #endif
+  #ifdef PULL_OTA_TOPIC
+    scheduler.set(TASK_PULL_OTA, pullOtaTask);
+  #endif
+  #ifdef MILIGHT_RADIO_CS_PIN
+    scheduler.set(TASK_RADIO, radioTask);
+  #endif
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    scheduler.set(TASK_RELAY + i, relayTask);
+  }
+
+  // Init relays
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    digitalWrite(channels[i].relayPin, RELAY_OFF);
+    pinMode(channels[i].relayPin, OUTPUT);
+  }
+
+  // Shadow LED
+  #ifdef SHADOW_LED_PIN
+  digitalWrite(SHADOW_LED_PIN, SHADOW_LED_OFF);
+  pinMode(SHADOW_LED_PIN, OUTPUT);
+  #endif
+
+  // Init debouncers
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    channels[i].debouncer.attach(channels[i].buttonPin, channels[i].buttonMode);
+    channels[i].debouncer.interval(20);    
+  }
+
+  #ifdef MILIGHT_RADIO_CS_PIN
+    // Start local radio
+    if (!radio.begin(MILIGHT_RADIO_CS_PIN, MILIGHT_RADIO_RESET_PIN, MILIGHT_RADIO_REPEATS)) {
+      TRACE_ERR("Milight radio not found");
+    }
+  #endif
+
+  #ifdef POWER_TOPIC
+    // Count BL0937 pulses
+    pinMode(POWER_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(POWER_PIN), powerInterrupt, RISING);
+  #endif
+
+  // Start Wifi (connection will be checked by startupLoop)
   WiFi.hostname(QUOTE(PROG_NAME));
   WiFi.mode(WIFI_STA);
+  #ifdef POWER_SAVE
+    #if defined(POWER_SAVE_LIGHT_SLEEP)
+      WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
+    #elif defined(ESPNOW_PEERS)
+      // Keep modem awake to receive peers messages, only CPU sleeps
+      WiFi.setSleepMode(WIFI_NONE_SLEEP);
+    #else
+      WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+    #endif
+  #endif
+  #ifdef ESPNOW_PEERS
+    // Start ESP-NOW once WiFi mode is set (on current WiFi channel), identifying bulbs by their command topic (FNV-1a hash)
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+      uint32_t hash = 2166136261UL;
+      for (const char* c = channels[i].commandTopic; *c; c++) {
+        hash = (hash ^ (uint8_t) *c) * 16777619UL;
+      }
+      channels[i].peerBulb = hash;
+    }
+    static uint8_t broadcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    if (esp_now_init() || esp_now_set_self_role(ESP_NOW_ROLE_COMBO)
+        || esp_now_add_peer(broadcast, ESP_NOW_ROLE_COMBO, 0, NULL, 0) || esp_now_register_recv_cb(peerReceive)) {
+      TRACE_ERR("Can't start ESP-NOW");
+    }
+  #endif
   static WiFiEventHandler onConnectedHandler = WiFi.onStationModeConnected(onWifiConnect);
   static WiFiEventHandler onDisonnectedHandler = WiFi.onStationModeDisconnected(onWifiDisconnect);
   static WiFiEventHandler onGotIPHandler = WiFi.onStationModeGotIP(onWifiGotIP);
-  WiFi.setAutoReconnect(true);
   WiFi.setAutoConnect(false);
-  WiFi.begin(WIFI_SSID, WIFI_KEY);
-
-  // Wait up to 10 seconds for network to start
-  while ((WiFi.status() != WL_CONNECTED) && (millis() < 10000)) {
-    delay(100);
-  }
-
-  struct rst_info *rtc_info = system_get_rst_info();
+  #ifdef WIFI_FAST_CONNECT
+    // Reconnection is done by wifiLoop, with cached settings if any
+    WiFi.setAutoReconnect(false);
+    wifiCacheValid = ESP.rtcUserMemoryRead(RTC_WIFI_OFFSET, (uint32_t*) &wifiCache, sizeof(wifiCache))
+      && wifiCache.magic == RTC_WIFI_MAGIC;
+    wifiBegin(wifiCacheValid);
+  #else
+    WiFi.setAutoReconnect(true);
+    WiFi.begin(WIFI_SSID, WIFI_KEY);
+  #endif
 
   //  Connect to syslog
   #ifdef SYSLOG_HOST
     //Initialize syslog server
     syslog.server(SYSLOG_HOST, SYSLOG_PORT);
     syslog.deviceHostname(QUOTE(PROG_NAME));
-    syslog.defaultPriority(LOG_USER || LOG_DEBUG);
+    syslog.defaultPriority(LOG_USER | LOG_DEBUG);
+    #ifdef SYSLOG_BUFFER_SIZE
+      // Queue traces, they'll be sent by syslogLoop()
+      syslog.buffer(syslogBuffer, sizeof(syslogBuffer));
+      syslog.pacing(SYSLOG_INTERVAL, SYSLOG_PACKETS_PER_LOOP, SYSLOG_BYTES_PER_LOOP);
+    #endif
+    #ifdef SYSLOG_MESSAGE_SIZE
+      // Format traces without heap allocation
+      syslog.formatBuffer(syslogMessage, sizeof(syslogMessage));
+    #endif
+  #endif
+
+  // Restore bulb and relay states (and stats) saved before reset
+  bool stateRestored = rtcStateLoad();
+  #ifdef PERSIST_FLASH
+    // Else restore them from flash log (saved before power loss)
+    stateRestored = persistFlashLoad(!stateRestored) || stateRestored;
+  #endif
+  #ifdef DEVICE_SHADOW_TOPIC
+    // Else restore them from retained shadow
+    shadowRestoreStates = !stateRestored;
   #endif
 
-  // Hello message
-  TRACE("-----------------------------------");
-  TRACE("Server %s V%s started (%d) in %lu ms", QUOTE(PROG_NAME), VERSION, rtc_info->reason, millis());
+  #ifdef ADAPTIVE_TIMEOUT
+    // Restore command timeout learnt before reboot
+    timeoutLoad();
+  #endif
 
   // Connect to MQTT
   mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
-  mqttClient.setCallback(mqttCallback);
-
-  // Init debouncer
-  debouncer = Bounce();
-  debouncer.attach(BUTTON_PIN, BUTTON_MODE);
-  debouncer.interval(20);    
-
-  // Init relay
-  digitalWrite(RELAY_PIN, RELAY_OFF);
-  pinMode(RELAY_PIN, OUTPUT);
-
-  // Shadow LED
-  #ifdef SHADOW_LED_PIN
-  digitalWrite(SHADOW_LED_PIN, SHADOW_LED_OFF);
-  pinMode(SHADOW_LED_PIN, OUTPUT);
+  // Send state and update topics directly to their channel callback
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    bulbChannel* channel = &channels[i];
+    auto callback = [channel](char* topic, byte* payload, unsigned int length) {
+      mqttCallback(*channel, topic, payload, length);
+    };
+    if ((channel->stateTopic && !mqttClient.setTopicCallback(channel->stateTopic, callback))
+        || (channel->updateTopic && !mqttClient.setTopicCallback(channel->updateTopic, callback))) {
+      TRACE_ERR("Too many topics, increase MQTT_MAX_TOPIC_CALLBACKS");
+    }
+  }
+  #ifdef DEVICE_SHADOW_TOPIC
+    // Send retained shadow to its callback
+    if (!mqttClient.setTopicCallback(DEVICE_SHADOW_TOPIC, shadowCallback)) {
+      TRACE_ERR("Too many topics, increase MQTT_MAX_TOPIC_CALLBACKS");
+    }
+  #endif
+  #ifdef PULL_OTA_TOPIC
+    // Send update requests to their callback
+    if (!mqttClient.setTopicCallback(PULL_OTA_TOPIC, pullOtaCallback)) {
+      TRACE_ERR("Too many topics, increase MQTT_MAX_TOPIC_CALLBACKS");
+    }
+    pullUpdate.setRetry(PULL_OTA_RETRIES, PULL_OTA_RETRY_DELAY, PULL_OTA_TIMEOUT);
+    // Running image MD5 reads whole sketch (and allocates a String), compute it only once
+    snprintf_P(pullOtaRunningMd5, sizeof(pullOtaRunningMd5), PSTR("%s"), ESP.getSketchMD5().c_str());
+    // Limit time spent in HTTP connection
+    otaClient.setTimeout(PULL_OTA_CONNECT_TIMEOUT);
+  #endif
+  #ifdef MQTT_CONNECT_TIMEOUT
+    // Limit time spent in TCP connection
+    WFClient.setTimeout(MQTT_CONNECT_TIMEOUT);
+  #endif
+  #ifdef MQTT_BATCH_SIZE
+    // Send MQTT packets of one loop in one TCP write, without waiting for previous ones to be acknowledged
+    #ifndef MQTT_STATIC_BUFFERS
+      mqttClient.setBatchSize(MQTT_BATCH_SIZE);
+    #endif
+    WFClient.setNoDelay(true);
   #endif
 
   // Arduino OTA
@@ -421,58 +2031,271 @@ void setup() {
   // ArduinoOTA.setPassword("admin");
 
   ArduinoOTA.onStart([]() {
-    TRACE("OTA start updating %s", (ArduinoOTA.getCommand() == U_FLASH) ? "sketch" : "filesystem");
+    TRACE_INFO("OTA start updating %s", (ArduinoOTA.getCommand() == U_FLASH) ? "sketch" : "filesystem");
   });
   ArduinoOTA.onEnd([]() {
-    TRACE("OTA end");
+    TRACE_INFO("OTA end");
   });
       
   ArduinoOTA.onError([](ota_error_t error) {
     if (error == OTA_AUTH_ERROR) {
-      TRACE("OTA error: Auth Failed!");
+      TRACE_ERR("OTA error: Auth Failed!");
     } else if (error == OTA_BEGIN_ERROR) {
-      TRACE("OTA error: Begin Failed!");
+      TRACE_ERR("OTA error: Begin Failed!");
     } else if (error == OTA_CONNECT_ERROR) {
-      TRACE("OTA error: Connect Failed!");
+      TRACE_ERR("OTA error: Connect Failed!");
     } else if (error == OTA_RECEIVE_ERROR) {
-      TRACE("OTA error: Receive Failed!");
+      TRACE_ERR("OTA error: Receive Failed!");
     } else if (error == OTA_END_ERROR) {
-      TRACE("OTA error: End Failed!");
+      TRACE_ERR("OTA error: End Failed!");
     } else {
-      TRACE("OTA error: unknown code %d", error);
+      TRACE_ERR("OTA error: unknown code %d", error);
     }
   });
-  
-  ArduinoOTA.begin();
 }
 
+// Start network services once WiFi is connected
+void startupLoop() {
+  if (startupState == STARTUP_WIFI && WiFi.status() == WL_CONNECTED) {
+    // Hello message
+    TRACE_INFO("-----------------------------------");
+    TRACE_INFO("Server %s V%s started (%d) in %lu ms", QUOTE(PROG_NAME), VERSION, system_get_rst_info()->reason, millis());
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+      TRACE_INFO("Bulb %d is %s, relay is %s", i, channels[i].bulbOn ? "ON" : "OFF", channels[i].relayOn ? "ON" : "OFF");
+    }
+
+    // Start Arduino OTA
+    ArduinoOTA.begin();
+    startupState = STARTUP_DONE;
+  }
+}
+
+// Compute CRC32 of data (continuing given one)
+uint32_t persistCrc(const void* data, const size_t length, uint32_t crc) {
+  const uint8_t* bytes = (const uint8_t*) data;
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= bytes[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+// Get states and stats counters to persist
+void persistGet(persistedState &state) {
+  memset(&state, 0, sizeof(state));
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    state.bulbOn |= channels[i].bulbOn << i;
+    state.relayOn |= channels[i].relayOn << i;
+    state.syncLost[i] = channels[i].syncLost;
+    state.pushLost[i] = channels[i].pushLost;
+    state.pushCount[i] = channels[i].pushCount;
+  }
+  state.networkLost = networkLost;
+  state.mqttLost = mqttLost;
+}
+
+// Restore persisted states and stats counters
+void persistSet(const persistedState &state) {
+  // Counters first, so that states changes save them
+  networkLost = state.networkLost;
+  mqttLost = state.mqttLost;
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    channels[i].syncLost = state.syncLost[i];
+    channels[i].pushLost = state.pushLost[i];
+    channels[i].pushCount = state.pushCount[i];
+  }
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+    setBulbOn(channels[i], (state.bulbOn >> i) & 1);
+    setRelayOn(channels[i], (state.relayOn >> i) & 1);
+  }
+}
+
+// Save bulb and relay states, and stats counters, of all channels in RTC memory (called at each change)
+void rtcStateSave() {
+  rtcState rtc;
+  rtc.magic = RTC_STATE_MAGIC;
+  persistGet(rtc.state);
+  rtc.crc = persistCrc(&rtc.state, sizeof(rtc.state));
+  ESP.rtcUserMemoryWrite(RTC_STATE_OFFSET, (uint32_t*) &rtc, sizeof(rtc));
+  #ifdef PERSIST_FLASH
+    // Write them to flash log soon if states changed
+    persistStateChanged();
+  #endif
+}
+
+// Restore bulb and relay states, and stats counters, of all channels from RTC memory. Returns true if found
+bool rtcStateLoad() {
+  rtcState rtc;
+  if (!ESP.rtcUserMemoryRead(RTC_STATE_OFFSET, (uint32_t*) &rtc, sizeof(rtc)) || rtc.magic != RTC_STATE_MAGIC
+      || rtc.crc != persistCrc(&rtc.state, sizeof(rtc.state))) {
+    return false;
+  }
+  persistSet(rtc.state);
+  return true;
+}
+
+#ifdef PERSIST_FLASH
+// Find last record of flash log, restoring it if asked to. Returns true if restored
+bool persistFlashLoad(const bool restore) {
+  persistAvailable = FS_PHYS_SIZE >= PERSIST_FLASH_SECTORS * FLASH_SECTOR_SIZE;
+  if (!persistAvailable) {
+    TRACE_ERR("No room for flash log in file system area (%lu bytes), use an ldscript with one", (unsigned long) FS_PHYS_SIZE);
+    return false;
+  }
+  // Look for valid record with highest sequence
+  persistRecord record;
+  bool found = false;
+  for (uint32_t slot = 0; slot < PERSIST_FLASH_SECTORS * PERSIST_SLOTS; slot++) {
+    uint32_t address = FS_PHYS_ADDR + (slot / PERSIST_SLOTS) * FLASH_SECTOR_SIZE + (slot % PERSIST_SLOTS) * sizeof(record);
+    if (!ESP.flashRead(address, (uint32_t*) &record, sizeof(record)) || record.sequence == UINT32_MAX
+        || record.crc != persistCrc(&record.state, sizeof(record.state), persistCrc(&record.sequence, sizeof(record.sequence)))) {
+      continue;
+    }
+    if (!found || record.sequence > persistSequence) {
+      found = true;
+      persistSequence = record.sequence;
+      persistLogged = record.state;
+      persistSlot = (slot + 1) % (PERSIST_FLASH_SECTORS * PERSIST_SLOTS);
+    }
+  }
+  if (found) {
+    TRACE_INFO("Flash log record %lu found", (unsigned long) persistSequence);
+    if (restore) {
+      persistSet(persistLogged);
+    }
+  } else {
+    TRACE_INFO("Flash log is empty");
+  }
+  // Log current states if newer (restored from RTC memory)
+  persistStateChanged();
+  return found && restore;
+}
+
+// Bulb or relay state changed: write flash log after PERSIST_STATE_DELAY, with changes done meanwhile
+void persistStateChanged() {
+  if (!persistAvailable || persistPending) {
+    return;
+  }
+  persistedState state;
+  persistGet(state);
+  if (state.bulbOn != persistLogged.bulbOn || state.relayOn != persistLogged.relayOn) {
+    persistPending = true;
+    scheduler.runIn(TASK_PERSIST, PERSIST_STATE_DELAY);
+  }
+}
+
+// Append current states and counters to flash log, if changed (periodic task, run sooner after state changes)
+void persistTask(uint8_t task) {
+  persistPending = false;
+  if (!persistAvailable) {
+    return;
+  }
+  persistRecord record;
+  persistGet(record.state);
+  if (persistSequence && !memcmp(&record.state, &persistLogged, sizeof(record.state))) {
+    return;
+  }
+  record.sequence = persistSequence + 1;
+  record.crc = persistCrc(&record.state, sizeof(record.state), persistCrc(&record.sequence, sizeof(record.sequence)));
+  // Look for an erased slot (skipping those of a write interrupted before reset)
+  for (uint32_t tries = 0; tries < PERSIST_FLASH_SECTORS * PERSIST_SLOTS; tries++) {
+    uint32_t sector = FS_PHYS_ADDR / FLASH_SECTOR_SIZE + persistSlot / PERSIST_SLOTS;
+    uint32_t address = sector * FLASH_SECTOR_SIZE + (persistSlot % PERSIST_SLOTS) * sizeof(record);
+    persistSlot = (persistSlot + 1) % (PERSIST_FLASH_SECTORS * PERSIST_SLOTS);
+    if (address % FLASH_SECTOR_SIZE == 0) {
+      // Entering a sector: erase it (last record is in previous one)
+      if (!ESP.flashEraseSector(sector)) {
+        TRACE_ERR("Can't erase flash log sector %lu", (unsigned long) sector);
+        return;
+      }
+    } else {
+      uint32_t sequence;
+      if (!ESP.flashRead(address, &sequence, sizeof(sequence)) || sequence != UINT32_MAX) {
+        continue;
+      }
+    }
+    if (!ESP.flashWrite(address, (uint32_t*) &record, sizeof(record))) {
+      TRACE_ERR("Can't write flash log record %lu", (unsigned long) record.sequence);
+      return;
+    }
+    persistSequence = record.sequence;
+    persistLogged = record.state;
+    persistWrites++;
+    TRACE_DEBUG("Flash log record %lu written", (unsigned long) persistSequence);
+    return;
+  }
+  TRACE_ERR("No free slot in flash log");
+}
+#endif
+
 void loop() {
+  PROFILE_START();
+  #ifdef TELEMETRY_HOST
+    uint32_t loopCycles = ESP.getCycleCount();
+  #endif
+
+  #ifdef WIFI_FAST_CONNECT
+    // Manage WiFi connection
+    wifiLoop();
+  #endif
+
+  // Start network services when WiFi is up
+  if (startupState != STARTUP_DONE) {
+    startupLoop();
+  }
+  PROFILE_END(PROFILE_NETWORK);
+
   // Manage MQTT
   mqttLoop();
+  PROFILE_END(PROFILE_MQTT);
 
-  // Manage command timeout
-  manageCommandTimeout();
+  // Run due tasks (command timeout, MQTT connection, stats, temperature...)
+  scheduler.run();
+  PROFILE_END(PROFILE_TASKS);
 
   // Manage button changes
   buttonLoop();
+  #ifdef ESPNOW_PEERS
+    // Apply peers changes
+    peerLoop();
+  #endif
+  PROFILE_END(PROFILE_BUTTON);
 
-  #ifdef STATS_INTERVAL
-    // Manage stats
-    statsLoop();
+  #ifdef DEVICE_SHADOW_TOPIC
+    // Manage device shadow
+    shadowLoop();
+    PROFILE_END(PROFILE_SHADOW);
   #endif
 
-  #ifdef TEMPERATURE_TOPIC
-    // Manage temperature
-    temperatureLoop();
+  #if defined(SYSLOG_HOST) && defined(SYSLOG_BUFFER_SIZE)
+    // Send queued traces
+    syslogLoop();
+    PROFILE_END(PROFILE_SYSLOG);
   #endif
 
-    #ifdef SYSLOG_KEEPALIVE
-        if (millis() - (syslog.lastSyslogMillis) > SYSLOG_KEEPALIVE) {
-          syslog.log("Syslog keep alive message");
-        }
-    #endif
+  #ifdef MQTT_BATCH_SIZE
+    // Send MQTT packets of this loop
+    mqttClient.flushBatch();
+    PROFILE_END(PROFILE_BATCH);
+  #endif
 
   // Manage Arduino OTA
-  ArduinoOTA.handle();
+  if (startupState == STARTUP_DONE) {
+    ArduinoOTA.handle();
+  }
+  PROFILE_END(PROFILE_OTA);
+
+  #ifdef TELEMETRY_HOST
+    // Measure loop (sleep excluded)
+    telemetryLoopEnd(loopCycles);
+  #endif
+
+  #ifdef POWER_SAVE
+    // Sleep until next thing to do
+    powerSleep();
+  #endif
 
 }
\ No newline at end of file